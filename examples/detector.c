@@ -381,7 +381,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
     int *map = 0;
     if (mapf) map = read_map(mapf);
 
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
@@ -566,14 +566,342 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
     }
 }
 
-void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen)
+/*
+ * Detects on every image of a list, batch images to a forward pass, while
+ * threads load and letterbox the next batch.
+ */
+static void test_detector_list(network *net, char **paths, int m, int batch, float thresh, float hier_thresh, float nms, char **names, image **alphabet, char *outfile)
+{
+    int i, b;
+    layer l = net->layers[net->n-1];
+    image *val = calloc(batch, sizeof(image));
+    image *val_sized = calloc(batch, sizeof(image));
+    image *buf = calloc(batch, sizeof(image));
+    image *buf_sized = calloc(batch, sizeof(image));
+    pthread_t *thr = calloc(batch, sizeof(pthread_t));
+    float *X = calloc((size_t)net->inputs*batch, sizeof(float));
+    set_batch_network(net, batch);
+
+    load_args args = {0};
+    args.w = net->w;
+    args.h = net->h;
+    args.type = LETTERBOX_DATA;
+    for(b = 0; b < batch && b < m; ++b){
+        args.path = paths[b];
+        args.im = &buf[b];
+        args.resized = &buf_sized[b];
+        thr[b] = load_data_in_thread(args);
+    }
+    for(i = 0; i < m; i += batch){
+        /* A short last batch runs only the images it has. */
+        int n = (m - i < batch) ? m - i : batch;
+        for(b = 0; b < n; ++b){
+            pthread_join(thr[b], 0);
+            val[b] = buf[b];
+            val_sized[b] = buf_sized[b];
+            memcpy(X + (size_t)b*net->inputs, val_sized[b].data, net->inputs*sizeof(float));
+        }
+        for(b = 0; b < batch && i + batch + b < m; ++b){
+            args.path = paths[i + batch + b];
+            args.im = &buf[b];
+            args.resized = &buf_sized[b];
+            thr[b] = load_data_in_thread(args);
+        }
+        double time = what_time_is_it_now();
+        set_active_batch(net, n);
+        network_predict(net, X);
+        time = what_time_is_it_now() - time;
+        if(batch > 1) printf("Predicted %d images in %f seconds.\n", n, time);
+        for(b = 0; b < n; ++b){
+            char *im_name = GetFilename(paths[i+b]);
+            printf("image name: %s\n", im_name);
+            /* One image at a time prints what it always has, for the scripts reading it. */
+            if(batch == 1){
+                printf("Try Very Hard:");
+                printf("%s: Predicted in %f seconds.\n", paths[i+b], time);
+            }
+            int nboxes = 0;
+            detection *dets = get_network_boxes_batch(net, b, val[b].w, val[b].h, thresh, hier_thresh, 0, 1, &nboxes);
+            if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+            draw_detections(val[b], im_name, dets, nboxes, thresh, names, alphabet, l.classes, 0.0);
+            free_detections(dets, nboxes);
+            if(outfile){
+                save_image(val[b], outfile);
+            }
+            else{
+                save_image(val[b], im_name);
+                printf("save %s successfully!\n",im_name);
+            }
+            free_image(val[b]);
+            free_image(val_sized[b]);
+        }
+    }
+    free(val);
+    free(val_sized);
+    free(buf);
+    free(buf_sized);
+    free(thr);
+    free(X);
+}
+
+/*
+ * The list mode as a pipeline: decode, letterbox, inference, drawing and
+ * image writing each run on threads of their own, connected by bounded
+ * queues, so inference never waits on file I/O or encoding unless the
+ * other stages cannot keep up. A full queue blocks the stage feeding it.
+ * Drawing stays on one thread and takes the images in list order, since
+ * draw_detections() follows people from one image to the next. An image
+ * enters the pipeline only with one of window credits, which drawing hands
+ * back once it is done with it, so no more than window images are ever
+ * between the two and each has a slot of its own in draw's window.
+ */
+
+typedef struct{
+    int index;
+    char *path;
+    char name[256];
+    image im;
+    image sized;
+    detection *dets;
+    int nboxes;
+} pipeline_item;
+
+typedef struct{
+    network *net;
+    int batch;
+    float thresh, hier_thresh, nms;
+    char **names;
+    image **alphabet;
+    char *outfile;
+    int window;
+    bounded_queue *credits;
+} pipeline_config;
+
+typedef struct{
+    const char *name;
+    void *(*run)(void *);
+    int threads;
+    int running;
+    bounded_queue *in;
+    bounded_queue *out;
+    int ends;
+    pipeline_config *config;
+    double busy, waiting, blocked;
+    pthread_mutex_t mutex;
+} pipeline_stage;
+
+typedef struct{
+    double start, waiting, blocked;
+} stage_timer;
+
+static pipeline_item *stage_pop(pipeline_stage *s, stage_timer *t)
+{
+    double start = what_time_is_it_now();
+    pipeline_item *item = bounded_queue_pop(s->in);
+    t->waiting += what_time_is_it_now() - start;
+    return item;
+}
+
+static void stage_push(pipeline_stage *s, stage_timer *t, pipeline_item *item)
+{
+    double start = what_time_is_it_now();
+    bounded_queue_push(s->out, item);
+    t->blocked += what_time_is_it_now() - start;
+}
+
+/* The last thread of a stage out tells every thread of the next one to stop. */
+static void stage_done(pipeline_stage *s, stage_timer *t)
+{
+    int i;
+    double total = what_time_is_it_now() - t->start;
+    pthread_mutex_lock(&s->mutex);
+    s->busy += total - t->waiting - t->blocked;
+    s->waiting += t->waiting;
+    s->blocked += t->blocked;
+    int last = --s->running == 0;
+    pthread_mutex_unlock(&s->mutex);
+    if(last && s->out){
+        for(i = 0; i < s->ends; ++i) bounded_queue_push(s->out, 0);
+    }
+}
+
+static void *decode_stage(void *ptr)
+{
+    pipeline_stage *s = ptr;
+    stage_timer t = {what_time_is_it_now()};
+    pipeline_item *item;
+    while((item = stage_pop(s, &t))){
+        item->im = load_image_color(item->path, 0, 0);
+        stage_push(s, &t, item);
+    }
+    stage_done(s, &t);
+    return 0;
+}
+
+static void *letterbox_stage(void *ptr)
+{
+    pipeline_stage *s = ptr;
+    stage_timer t = {what_time_is_it_now()};
+    pipeline_item *item;
+    while((item = stage_pop(s, &t))){
+        item->sized = letterbox_image(item->im, s->config->net->w, s->config->net->h);
+        stage_push(s, &t, item);
+    }
+    stage_done(s, &t);
+    return 0;
+}
+
+static void *infer_stage(void *ptr)
+{
+    pipeline_stage *s = ptr;
+    pipeline_config *c = s->config;
+    network *net = c->net;
+    stage_timer t = {what_time_is_it_now()};
+    pipeline_item **batch = calloc(c->batch, sizeof(pipeline_item *));
+    float *X = calloc((size_t)net->inputs*c->batch, sizeof(float));
+    int b, n, more = 1;
+    while(more){
+        for(n = 0; n < c->batch; ++n){
+            batch[n] = stage_pop(s, &t);
+            if(!batch[n]){
+                more = 0;
+                break;
+            }
+            memcpy(X + (size_t)n*net->inputs, batch[n]->sized.data, net->inputs*sizeof(float));
+            free_image(batch[n]->sized);
+        }
+        if(!n) break;
+        set_active_batch(net, n);
+        network_predict(net, X);
+        for(b = 0; b < n; ++b){
+            pipeline_item *item = batch[b];
+            item->dets = get_network_boxes_batch(net, b, item->im.w, item->im.h, c->thresh, c->hier_thresh, 0, 1, &item->nboxes);
+            stage_push(s, &t, item);
+        }
+    }
+    free(batch);
+    free(X);
+    stage_done(s, &t);
+    return 0;
+}
+
+static void *draw_stage(void *ptr)
+{
+    pipeline_stage *s = ptr;
+    pipeline_config *c = s->config;
+    layer l = c->net->layers[c->net->n-1];
+    stage_timer t = {what_time_is_it_now()};
+    pipeline_item **pending = calloc(c->window, sizeof(pipeline_item *));
+    pipeline_item *item;
+    int next = 0;
+    while((item = stage_pop(s, &t))){
+        pending[item->index % c->window] = item;
+        while((item = pending[next % c->window])){
+            pending[next % c->window] = 0;
+            ++next;
+            strncpy(item->name, GetFilename(item->path), sizeof(item->name) - 1);
+            printf("image name: %s\n", item->name);
+            if (c->nms) do_nms_sort(item->dets, item->nboxes, l.classes, c->nms);
+            draw_detections(item->im, item->name, item->dets, item->nboxes, c->thresh, c->names, c->alphabet, l.classes, 0.0);
+            free_detections(item->dets, item->nboxes);
+            stage_push(s, &t, item);
+            bounded_queue_push(c->credits, c);
+        }
+    }
+    free(pending);
+    stage_done(s, &t);
+    return 0;
+}
+
+static void *write_stage(void *ptr)
+{
+    pipeline_stage *s = ptr;
+    stage_timer t = {what_time_is_it_now()};
+    pipeline_item *item;
+    while((item = stage_pop(s, &t))){
+        save_image(item->im, s->config->outfile ? s->config->outfile : item->name);
+        free_image(item->im);
+        free(item);
+    }
+    stage_done(s, &t);
+    return 0;
+}
+
+static void test_detector_pipeline(network *net, char **paths, int m, int batch, int threads, float thresh, float hier_thresh, float nms, char **names, image **alphabet, char *outfile)
+{
+    int i, j;
+    int capacity = 4;
+    while(capacity < 2*batch) capacity <<= 1;
+    pipeline_config config = {net, batch, thresh, hier_thresh, nms, names, alphabet, outfile};
+    pipeline_stage stages[] = {
+        {"decode", decode_stage, threads},
+        {"letterbox", letterbox_stage, (threads + 1)/2},
+        {"infer", infer_stage, 1},
+        {"draw", draw_stage, 1},
+        /* Every image would go to the same file. */
+        {"write", write_stage, outfile ? 1 : threads},
+    };
+    int n = sizeof(stages)/sizeof(stages[0]);
+    bounded_queue **queues = calloc(n, sizeof(bounded_queue *));
+    /* Out of order images wait in draw's window until those before them arrive. */
+    config.window = batch + 1;
+    for(i = 0; i < n; ++i){
+        queues[i] = make_bounded_queue(capacity);
+        if(i < 4) config.window += capacity;
+        if(i < 2) config.window += stages[i].threads;
+    }
+    config.credits = make_bounded_queue(config.window);
+    for(i = 0; i < config.window; ++i) bounded_queue_push(config.credits, &config);
+    set_batch_network(net, batch);
+
+    pthread_t *thr = calloc(n*threads + n, sizeof(pthread_t));
+    int started = 0;
+    double start = what_time_is_it_now();
+    for(i = 0; i < n; ++i){
+        pipeline_stage *s = stages + i;
+        s->in = queues[i];
+        s->out = (i + 1 < n) ? queues[i+1] : 0;
+        s->ends = (i + 1 < n) ? stages[i+1].threads : 0;
+        s->running = s->threads;
+        s->config = &config;
+        pthread_mutex_init(&s->mutex, 0);
+        for(j = 0; j < s->threads; ++j){
+            if(pthread_create(thr + started++, 0, s->run, s)) error("Thread creation failed");
+        }
+    }
+    for(i = 0; i < m; ++i){
+        bounded_queue_pop(config.credits);
+        pipeline_item *item = calloc(1, sizeof(pipeline_item));
+        item->index = i;
+        item->path = paths[i];
+        bounded_queue_push(queues[0], item);
+    }
+    for(i = 0; i < stages[0].threads; ++i) bounded_queue_push(queues[0], 0);
+    for(i = 0; i < started; ++i) pthread_join(thr[i], 0);
+    double elapsed = what_time_is_it_now() - start;
+
+    fprintf(stderr, "pipeline: %d images in %.2f seconds, %.2f images/s\n", m, elapsed, m/elapsed);
+    for(i = 0; i < n; ++i){
+        pipeline_stage *s = stages + i;
+        double total = s->threads*elapsed;
+        fprintf(stderr, "%10s: %2d threads, %5.1f%% busy, %5.1f%% waiting for input, %5.1f%% blocked on output\n",
+                s->name, s->threads, 100*s->busy/total, 100*s->waiting/total, 100*s->blocked/total);
+        pthread_mutex_destroy(&s->mutex);
+        free_bounded_queue(queues[i]);
+    }
+    free_bounded_queue(config.credits);
+    free(queues);
+    free(thr);
+}
+
+void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, int batch, int pipeline)
 {
     list *options = read_data_cfg(datacfg);
     char *name_list = option_find_str(options, "names", "data/names.list");
     char **names = get_labels(name_list);
  
     image **alphabet = load_alphabet();
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     printf("filename type = %s\n", &filename[strlen(filename)-3]);
     srand(2222222);
@@ -581,7 +909,6 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     char buff[256];
     char *input = buff;
     float nms=.45;
-    int i=0;
     char* im_name;
 
     while(1){
@@ -632,44 +959,11 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
             list *plist = get_paths(input);
             char **paths = (char **)list_to_array(plist);
             printf("Start Testing!\n");
-            int m = plist->size;
-            for(i = 0; i < m; ++i){
-                char *path = paths[i];
-                image im = load_image_color(path,0,0);
-                image sized = letterbox_image(im, net->w, net->h);
-                //image sized = resize_image(im, net->w, net->h);
-                //image sized2 = resize_max(im, net->w);
-                //image sized = crop_image(sized2, -((net->w - sized2.w)/2), -((net->h - sized2.h)/2), net->w, net->h);
-                //resize_network(net, sized.w, sized.h);
-                layer l = net->layers[net->n-1];
-                float *X = sized.data;
-                time=what_time_is_it_now();
-                network_predict(net, X);
-
-                im_name = GetFilename(path);
-                printf("image name: %s\n", im_name);
-                printf("Try Very Hard:");
-                printf("%s: Predicted in %f seconds.\n", path, what_time_is_it_now()-time);
-                int nboxes = 0;
-                detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
-                //printf("%d\n", nboxes);
-                //if (nms) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-                if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
-                draw_detections(im, im_name, dets, nboxes, thresh, names, alphabet, l.classes, 0.0);
-                free_detections(dets, nboxes);
-                if(outfile){
-                    save_image(im, outfile);
-                }
-                else{
-                    save_image(im, im_name);
-                    printf("save %s successfully!\n",im_name);
-                }
- 
-                free_image(im);
-                free_image(sized);
-                // if (filename) break;
-            }
-            if (i == m) break;
+            if(pipeline) test_detector_pipeline(net, paths, plist->size, batch, pipeline, thresh, hier_thresh, nms, names, alphabet, outfile);
+            else test_detector_list(net, paths, plist->size, batch, thresh, hier_thresh, nms, names, alphabet, outfile);
+            free(paths);
+            free_list(plist);
+            break;
         }
     }
 }
@@ -948,23 +1242,40 @@ void run_detector(int argc, char **argv)
     int width = find_int_arg(argc, argv, "-w", 0);
     int height = find_int_arg(argc, argv, "-h", 0);
     int fps = find_int_arg(argc, argv, "-fps", 0);
+    /* 0 lets streams batch every stream at once; everything else defaults to 1. */
+    int batch = find_int_arg(argc, argv, "-batch", 0);
+    int pipeline = find_int_arg(argc, argv, "-pipeline", 0);
+    int depth = find_int_arg(argc, argv, "-depth", 3);
+    int drop = find_int_arg(argc, argv, "-drop", -1);
+    float slo = find_float_arg(argc, argv, "-slo", 0);
+    char *sizes = find_char_arg(argc, argv, "-sizes", 0);
+    float motion = find_float_arg(argc, argv, "-motion", 0);
+    int crop = find_arg(argc, argv, "-crop");
     //int class = find_int_arg(argc, argv, "-class", 0);
 
     char *datacfg = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
     char *filename = (argc > 6) ? argv[6]: 0;
-    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen);
+    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen, batch ? batch : 1, pipeline);
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(cfg, weights);
+    else if(0==strcmp(argv[2], "streams")) {
+        list *options = read_data_cfg(datacfg);
+        char *name_list = option_find_str(options, "names", "data/names.list");
+        char **names = get_labels(name_list);
+        list *plist = get_paths(filename);
+        char **sources = (char **)list_to_array(plist);
+        detect_streams(cfg, weights, sources, plist->size, names, thresh, hier_thresh, batch, drop, prefix, outfile, slo, sizes);
+    }
     else if(0==strcmp(argv[2], "demo")) {
         list *options = read_data_cfg(datacfg);
         int classes = option_find_int(options, "classes", 20);
         char *name_list = option_find_str(options, "names", "data/names.list");
         char **names = get_labels(name_list);
-        demo(cfg, weights, thresh, cam_index, filename, names, classes, frame_skip, prefix, avg, hier_thresh, width, height, fps, fullscreen);
+        demo(cfg, weights, thresh, cam_index, filename, names, classes, frame_skip, prefix, avg, hier_thresh, width, height, fps, fullscreen, depth, drop, slo, sizes, motion, crop);
     }
     //else if(0==strcmp(argv[2], "extract")) extract_detector(datacfg, cfg, weights, cam_index, filename, class, thresh, frame_skip);
     //else if(0==strcmp(argv[2], "censor")) censor_detector(datacfg, cfg, weights, cam_index, filename, class, thresh, frame_skip);
@@ -0,0 +1,174 @@
+#include "darknet.h"
+#include <math.h>
+
+static long file_size(char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static int is_output_layer(layer l)
+{
+    return l.type == YOLO || l.type == REGION || l.type == DETECTION;
+}
+
+static int best_class(detection d, float thresh)
+{
+    int j;
+    int best = -1;
+    for(j = 0; j < d.classes; ++j){
+        if(d.prob[j] > thresh && (best < 0 || d.prob[j] > d.prob[best])) best = j;
+    }
+    return best;
+}
+
+/* Detections of a that b also finds: same class, IoU above .5. */
+static int matching_detections(detection *a, int na, detection *b, int nb, float thresh)
+{
+    int i, j;
+    int matched = 0;
+    for(i = 0; i < na; ++i){
+        int class = best_class(a[i], thresh);
+        if(class < 0) continue;
+        for(j = 0; j < nb; ++j){
+            if(best_class(b[j], thresh) == class && box_iou(a[i].bbox, b[j].bbox) > .5){
+                ++matched;
+                break;
+            }
+        }
+    }
+    return matched;
+}
+
+static int count_detections(detection *dets, int n, float thresh)
+{
+    int i;
+    int count = 0;
+    for(i = 0; i < n; ++i){
+        if(best_class(dets[i], thresh) >= 0) ++count;
+    }
+    return count;
+}
+
+static double snr_db(double signal, double noise)
+{
+    if(noise <= 0) return INFINITY;
+    return 10*log10(signal/noise);
+}
+
+void quantize_network(char *cfgfile, char *weightfile, char *listfile, char *outfile, float thresh)
+{
+    int i, j, k;
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+
+    list *plist = get_paths(listfile);
+    char **paths = (char **)list_to_array(plist);
+    int m = plist->size;
+    if(!m) error("Empty calibration list");
+
+    float *ranges = calloc(net->n, sizeof(float));
+    fprintf(stderr, "Calibrating on %d images\n", m);
+    for(i = 0; i < m; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        calibrate_network(net, sized.data, ranges);
+        free_image(im);
+        free_image(sized);
+    }
+    save_weights_int8(net, ranges, outfile);
+
+    network *qnet = load_network(cfgfile, outfile, 0);
+    set_batch_network(qnet, 1);
+
+    int detector = 0;
+    int classes = 0;
+    for(j = 0; j < net->n; ++j){
+        if(!is_output_layer(net->layers[j])) continue;
+        detector = 1;
+        classes = net->layers[j].classes;
+    }
+    layer last = net->layers[net->n-1];
+
+    double signal = 0, noise = 0, worst = INFINITY;
+    double fp32_time = 0, int8_time = 0;
+    int fp32_boxes = 0, int8_boxes = 0, matched = 0, found = 0;
+    int top1 = 0;
+    for(i = 0; i < m; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        double time = what_time_is_it_now();
+        float *ref = network_predict(net, sized.data);
+        fp32_time += what_time_is_it_now() - time;
+        time = what_time_is_it_now();
+        float *out = network_predict(qnet, sized.data);
+        int8_time += what_time_is_it_now() - time;
+
+        double s = 0, n = 0;
+        for(j = 0; j < net->n; ++j){
+            if(detector && !is_output_layer(net->layers[j])) continue;
+            if(!detector && j != net->n-1) continue;
+            layer a = net->layers[j];
+            layer b = qnet->layers[j];
+            for(k = 0; k < a.outputs; ++k){
+                double d = a.output[k] - b.output[k];
+                s += a.output[k]*a.output[k];
+                n += d*d;
+            }
+        }
+        signal += s;
+        noise += n;
+        if(snr_db(s, n) < worst) worst = snr_db(s, n);
+
+        if(detector){
+            int na = 0, nb = 0;
+            detection *da = get_network_boxes(net, im.w, im.h, thresh, .5, 0, 1, &na);
+            detection *db = get_network_boxes(qnet, im.w, im.h, thresh, .5, 0, 1, &nb);
+            do_nms_sort(da, na, classes, .45);
+            do_nms_sort(db, nb, classes, .45);
+            fp32_boxes += count_detections(da, na, thresh);
+            int8_boxes += count_detections(db, nb, thresh);
+            matched += matching_detections(da, na, db, nb, thresh);
+            found += matching_detections(db, nb, da, na, thresh);
+            free_detections(da, na);
+            free_detections(db, nb);
+        } else {
+            top1 += max_index(ref, last.outputs) == max_index(out, last.outputs);
+        }
+        free_image(im);
+        free_image(sized);
+    }
+
+    printf("\nint8 vs fp32 on %d images\n", m);
+    printf("output SNR: %.2f dB (worst image %.2f dB)\n", snr_db(signal, noise), worst);
+    if(detector){
+        printf("detections @ %.2f: fp32 %d, int8 %d\n", thresh, fp32_boxes, int8_boxes);
+        printf("fp32 boxes found by int8: %.2f%%, int8 boxes found by fp32: %.2f%%\n",
+                fp32_boxes ? 100.*matched/fp32_boxes : 100., int8_boxes ? 100.*found/int8_boxes : 100.);
+    } else {
+        printf("top-1 agreement: %.2f%%\n", 100.*top1/m);
+    }
+    printf("forward: fp32 %.1f ms, int8 %.1f ms per image (%.2fx)\n",
+            1000*fp32_time/m, 1000*int8_time/m, fp32_time/int8_time);
+    printf("weights: %s %.1f MB, %s %.1f MB\n", weightfile, file_size(weightfile)/1e6, outfile, file_size(outfile)/1e6);
+
+    free(ranges);
+    free_ptrs((void **)paths, m);
+    free_list(plist);
+    free_network(net);
+    free_network(qnet);
+}
+
+void run_quantize(int argc, char **argv)
+{
+    if(argc < 6){
+        fprintf(stderr, "usage: %s %s [cfg] [weights] [calibration list] [output weights] [-thresh .5]\n", argv[0], argv[1]);
+        return;
+    }
+    float thresh = find_float_arg(argc, argv, "-thresh", .5);
+    quantize_network(argv[2], argv[3], argv[4], argv[5], thresh);
+}
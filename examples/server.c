@@ -0,0 +1,333 @@
+#include "darknet.h"
+#include <json-c/json.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * darknet serve: a local detection server that batches concurrent requests.
+ *
+ * A client sends requests one per line, either the path of an image or
+ * "@<bytes>" followed by that many bytes of an encoded image, and reads one
+ * line of JSON per request back, in order. Connection threads decode and
+ * letterbox straight into the network input. The main thread takes up to
+ * -batch queued requests, waiting at most -wait ms after the oldest arrived
+ * for more to join it, runs one forward pass over them and hands each
+ * request its boxes. Light load costs a request at most -wait ms over
+ * batch 1; heavy load fills the batches.
+ */
+
+#define MAX_REQUEST_BYTES (64 << 20)
+#define LATENCY_WINDOW 1024
+
+typedef struct request{
+    float *input;
+    int w, h;
+    double arrived;
+    double finished;
+    int batch;
+    int nboxes;
+    detection *dets;
+    int done;
+    struct request *next;
+} request;
+
+typedef struct{
+    network *net;
+    char **names;
+    int classes;
+    float thresh, hier, nms;
+    int max_batch;
+    double wait;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    request *head, *tail;
+    int pending;
+} server;
+
+typedef struct{
+    server *s;
+    int fd;
+} connection;
+
+static void submit(server *s, request *r)
+{
+    pthread_mutex_lock(&s->mutex);
+    r->arrived = what_time_is_it_now();
+    if(s->tail) s->tail->next = r;
+    else s->head = r;
+    s->tail = r;
+    ++s->pending;
+    pthread_cond_signal(&s->queued);
+    while(!r->done) pthread_cond_wait(&s->finished, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* Up to max requests, once max are queued or the oldest has waited long enough. */
+static int take_batch(server *s, request **batch)
+{
+    int n = 0;
+    pthread_mutex_lock(&s->mutex);
+    while(!s->head) pthread_cond_wait(&s->queued, &s->mutex);
+    double deadline = s->head->arrived + s->wait;
+    while(s->pending < s->max_batch && what_time_is_it_now() < deadline){
+        struct timespec ts;
+        ts.tv_sec = (time_t)deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec)*1e9);
+        pthread_cond_timedwait(&s->queued, &s->mutex, &ts);
+    }
+    while(s->head && n < s->max_batch){
+        batch[n++] = s->head;
+        s->head = s->head->next;
+    }
+    if(!s->head) s->tail = 0;
+    s->pending -= n;
+    pthread_mutex_unlock(&s->mutex);
+    return n;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float diff = *(const float *)a - *(const float *)b;
+    return (diff > 0) - (diff < 0);
+}
+
+static void print_stats(float *latency, int n, int requests, int batches, double elapsed)
+{
+    float *sorted = calloc(n, sizeof(float));
+    memcpy(sorted, latency, n*sizeof(float));
+    qsort(sorted, n, sizeof(float), compare_floats);
+    fprintf(stderr, "serve: %d requests in %d batches (%.2f per batch), %.1f requests/s, latency p50 %.1f ms, p99 %.1f ms\n",
+            requests, batches, (float)requests/batches, requests/elapsed, sorted[n/2], sorted[(int)(n*.99)]);
+    free(sorted);
+}
+
+static void run_batches(server *s)
+{
+    int i;
+    network *net = s->net;
+    request **batch = calloc(s->max_batch, sizeof(request *));
+    float *X = calloc((size_t)net->inputs*s->max_batch, sizeof(float));
+    float *latency = calloc(LATENCY_WINDOW, sizeof(float));
+    int requests = 0, batches = 0, window = 0;
+    double start = what_time_is_it_now();
+    while(1){
+        int n = take_batch(s, batch);
+        for(i = 0; i < n; ++i) memcpy(X + (size_t)i*net->inputs, batch[i]->input, net->inputs*sizeof(float));
+        set_active_batch(net, n);
+        network_predict(net, X);
+        double now = what_time_is_it_now();
+        for(i = 0; i < n; ++i){
+            request *r = batch[i];
+            r->dets = get_network_boxes_batch(net, i, r->w, r->h, s->thresh, s->hier, 0, 0, &r->nboxes);
+            r->batch = n;
+            r->finished = now;
+            latency[window++ % LATENCY_WINDOW] = (now - r->arrived)*1000;
+        }
+        pthread_mutex_lock(&s->mutex);
+        for(i = 0; i < n; ++i) batch[i]->done = 1;
+        pthread_cond_broadcast(&s->finished);
+        pthread_mutex_unlock(&s->mutex);
+
+        requests += n;
+        ++batches;
+        if(window >= LATENCY_WINDOW){
+            print_stats(latency, LATENCY_WINDOW, requests, batches, what_time_is_it_now() - start);
+            window = 0;
+        }
+    }
+}
+
+static char *read_bytes(FILE *fp, int size)
+{
+    char *buf = malloc(size);
+    if(buf && fread(buf, 1, size, fp) == (size_t)size) return buf;
+    free(buf);
+    return 0;
+}
+
+/* The encoded image a request line names, or 0 and why in *why. */
+static char *read_request(char *line, FILE *in, int *size, const char **why)
+{
+    char *buf = 0;
+    *size = 0;
+    if(line[0] == '@'){
+        *size = atoi(line + 1);
+        if(*size <= 0 || *size > MAX_REQUEST_BYTES){
+            *why = "bad request size";
+            return 0;
+        }
+        buf = read_bytes(in, *size);
+        if(!buf) *why = "request ended early";
+        return buf;
+    }
+    FILE *fp = fopen(line, "rb");
+    if(!fp){
+        *why = "cannot open image";
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if(len > 0 && len <= MAX_REQUEST_BYTES){
+        *size = len;
+        buf = read_bytes(fp, *size);
+    }
+    fclose(fp);
+    if(!buf) *why = "cannot read image";
+    return buf;
+}
+
+static struct json_object *detections_json(server *s, request *r)
+{
+    if(s->nms) do_nms_sort(r->dets, r->nboxes, s->classes, s->nms);
+    struct json_object *objects = detections_to_json(r->dets, r->nboxes, s->thresh, s->names, s->classes);
+    struct json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "width", json_object_new_int(r->w));
+    json_object_object_add(reply, "height", json_object_new_int(r->h));
+    json_object_object_add(reply, "batch", json_object_new_int(r->batch));
+    json_object_object_add(reply, "ms", json_object_new_double((r->finished - r->arrived)*1000));
+    json_object_object_add(reply, "objects", objects);
+    return reply;
+}
+
+static void *serve_connection(void *ptr)
+{
+    connection c = *(connection *)ptr;
+    free(ptr);
+    server *s = c.s;
+    FILE *in = fdopen(c.fd, "rb");
+    FILE *out = fdopen(dup(c.fd), "wb");
+    char line[4096];
+    image sized = make_image(s->net->w, s->net->h, s->net->c);
+    while(in && out && fgets(line, sizeof(line), in)){
+        line[strcspn(line, "\r\n")] = 0;
+        if(!line[0]) continue;
+        const char *why = 0;
+        struct json_object *reply;
+        int size;
+        request r = {0};
+        char *buf = read_request(line, in, &size, &why);
+        if(buf && !letterbox_image_memory((unsigned char *)buf, size, sized, &r.w, &r.h)) why = "cannot decode image";
+        free(buf);
+        if(!why){
+            r.input = sized.data;
+            submit(s, &r);
+            reply = detections_json(s, &r);
+            free_detections(r.dets, r.nboxes);
+        } else {
+            reply = json_object_new_object();
+            json_object_object_add(reply, "error", json_object_new_string(why));
+        }
+        fprintf(out, "%s\n", json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN));
+        fflush(out);
+        json_object_put(reply);
+    }
+    if(in) fclose(in);
+    if(out) fclose(out);
+    free_image(sized);
+    return 0;
+}
+
+static int listen_on(char *path, int port)
+{
+    int fd;
+    if(path){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error(path);
+    } else {
+        int one = 1;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error("Cannot listen on port");
+    }
+    if(listen(fd, 64) < 0) error("listen");
+    return fd;
+}
+
+typedef struct{
+    server *s;
+    int fd;
+    int tcp;
+} listener;
+
+static void *accept_connections(void *ptr)
+{
+    listener l = *(listener *)ptr;
+    while(1){
+        int fd = accept(l.fd, 0, 0);
+        if(fd < 0) continue;
+        if(l.tcp){
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        connection *c = calloc(1, sizeof(connection));
+        c->s = l.s;
+        c->fd = fd;
+        pthread_t thread;
+        if(pthread_create(&thread, 0, serve_connection, c)){
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+void run_server(int argc, char **argv)
+{
+    int i;
+    if(argc < 5){
+        fprintf(stderr, "usage: %s %s [data] [cfg] [weights] [-port 8080 | -socket path] [-batch 8] [-wait 5] [-thresh .5] [-hier .5] [-nms .45]\n", argv[0], argv[1]);
+        return;
+    }
+    char *path = find_char_arg(argc, argv, "-socket", 0);
+    int port = find_int_arg(argc, argv, "-port", 8080);
+    server s = {0};
+    s.max_batch = find_int_arg(argc, argv, "-batch", 8);
+    s.wait = find_float_arg(argc, argv, "-wait", 5)/1000.;
+    s.thresh = find_float_arg(argc, argv, "-thresh", .5);
+    s.hier = find_float_arg(argc, argv, "-hier", .5);
+    s.nms = find_float_arg(argc, argv, "-nms", .45);
+    if(s.max_batch < 1) s.max_batch = 1;
+
+    list *options = read_data_cfg(argv[2]);
+    char *name_list = option_find_str(options, "names", "data/names.list");
+    s.names = get_labels(name_list);
+    s.net = load_network_inference(argv[3], argv[4]);
+    set_batch_network(s.net, s.max_batch);
+    for(i = 0; i < s.net->n; ++i){
+        layer l = s.net->layers[i];
+        if(l.type == YOLO || l.type == REGION || l.type == DETECTION) s.classes = l.classes;
+    }
+    if(!s.classes) error("darknet serve needs a yolo, region or detection layer");
+    pthread_mutex_init(&s.mutex, 0);
+    pthread_cond_init(&s.queued, 0);
+    pthread_cond_init(&s.finished, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    listener l = {&s, listen_on(path, port), path == 0};
+    pthread_t thread;
+    if(pthread_create(&thread, 0, accept_connections, &l)) error("Thread creation failed");
+    if(path) fprintf(stderr, "serve: listening on %s, batches of up to %d, %g ms wait\n", path, s.max_batch, s.wait*1000);
+    else fprintf(stderr, "serve: listening on 127.0.0.1:%d, batches of up to %d, %g ms wait\n", port, s.max_batch, s.wait*1000);
+    run_batches(&s);
+}
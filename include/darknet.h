@@ -53,6 +53,10 @@ typedef enum{
     PNG, BMP, TGA, JPG
 } IMTYPE;
 
+typedef enum{
+    RESIZE_BILINEAR, RESIZE_NEAREST, RESIZE_AREA
+} RESIZE_MODE;
+
 typedef enum{
     MULT, ADD, SUB, DIV
 } BINARY_ACTIVATION;
@@ -153,6 +157,9 @@ struct layer{
     int steps;
     int hidden;
     int truth;
+    int blocked;
+    int fused;
+    int fuse_shortcut;
     float smooth;
     float dot;
     float angle;
@@ -237,6 +244,13 @@ struct layer{
 
     float * weights;
     float * weight_updates;
+    float * winograd_weights;
+    float * packed_weights;
+    float * blocked_weights;
+    signed char * int8_weights;
+    float * weight_scales;
+    int * weight_sums;
+    float input_scale;
 
     float * delta;
     float * output;
@@ -430,6 +444,7 @@ typedef enum {
 typedef struct network{
     int n;
     int batch;
+    int allocated_batch;
     size_t *seen;
     int *t;
     float epoch;
@@ -481,7 +496,17 @@ typedef struct network{
     float *truth;
     float *delta;
     float *workspace;
+    size_t workspace_size;
+    int blocked;
+    int winograd;
+    float *reorder;
+    size_t reorder_size;
+    float *blocked_scratch;
+    float *arena;
+    size_t arena_size;
+    void *weights_map;
     int train;
+    int inference_only;
     int index;
     float *cost;
     float clip;
@@ -512,6 +537,14 @@ typedef struct {
     float *data;
 } image;
 
+typedef struct {
+    int w;
+    int h;
+    int c;
+    int step;
+    unsigned char *data;
+} byte_image;
+
 typedef struct{
     float x, y, w, h;
 } box;
@@ -525,6 +558,21 @@ typedef struct detection{
     int sort_class;
 } detection;
 
+typedef struct session session;
+
+typedef struct bounded_queue bounded_queue;
+
+typedef struct resolution_controller resolution_controller;
+
+typedef struct motion_detector motion_detector;
+
+typedef struct session_detection{
+    box bbox;
+    int class_id;
+    float prob;
+    float objectness;
+} session_detection;
+
 typedef struct matrix{
     int rows, cols;
     float **vals;
@@ -585,6 +633,20 @@ typedef struct{
 
 
 network *load_network(char *cfg, char *weights, int clear);
+network *load_network_inference(char *cfg, char *weights);
+network *make_network_context(network *net);
+void free_network_context(network *ctx);
+session *make_session(network *model);
+void free_session(session *s);
+float *session_predict(session *s, image im);
+int session_detect(session *s, image im, float thresh, float hier, float nms, session_detection *dets, int max);
+resolution_controller *make_resolution_controller(network *model, int *widths, int n, float target_ms);
+void free_resolution_controller(resolution_controller *rc);
+network *resolution_network(resolution_controller *rc);
+int control_resolution(resolution_controller *rc, float ms);
+motion_detector *make_motion_detector(float threshold);
+void free_motion_detector(motion_detector *m);
+int detect_motion(motion_detector *m, byte_image frame, box *region);
 load_args get_base_args(network *net);
 
 void free_data(data d);
@@ -672,7 +734,8 @@ void rescale_weights(layer l, float scale, float trans);
 void rgbgr_weights(layer l);
 image *get_weights(layer l);
 
-void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int frame_skip, char *prefix, int avg, float hier_thresh, int w, int h, int fps, int fullscreen);
+void detect_streams(char *cfgfile, char *weightfile, char **sources, int n, char **names, float thresh, float hier_thresh, int batch, int drop, char *prefix, char *outfile, float slo, char *sizes);
+void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int frame_skip, char *prefix, int avg, float hier_thresh, int w, int h, int fps, int fullscreen, int depth, int drop, float slo, char *sizes, float motion, int crop);
 void get_detection_detections(layer l, int w, int h, float thresh, detection *dets);
 
 char *option_find_str(list *l, char *key, char *def);
@@ -680,9 +743,13 @@ int option_find_int(list *l, char *key, int def);
 int option_find_int_quiet(list *l, char *key, int def);
 
 network *parse_network_cfg(char *filename);
+network *parse_network_cfg_inference(char *filename);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
+void save_weights_int8(network *net, float *ranges, char *filename);
+void save_mapped_weights(network *net, char *filename);
+void save_network_snapshot(network *net, char *cfgfile, char *filename);
 void load_weights_upto(network *net, char *filename, int start, int cutoff);
 
 void zero_objectness(layer l);
@@ -690,13 +757,33 @@ void get_region_detections(layer l, int w, int h, int netw, int neth, float thre
 int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets);
 void free_network(network *net);
 void set_batch_network(network *net, int b);
+void set_active_batch(network *net, int b);
 void set_temp_network(network *net, float t);
+void set_num_threads(int threads);
+bounded_queue *make_bounded_queue(int capacity);
+void free_bounded_queue(bounded_queue *q);
+void bounded_queue_push(bounded_queue *q, void *item);
+void *bounded_queue_pop(bounded_queue *q);
+int bounded_queue_try_pop(bounded_queue *q, void **item);
+void set_network_layout(network *net, int blocked);
+void optimize_network(network *net);
+int fold_network_batchnorm(network *net);
 image load_image(char *filename, int w, int h, int c);
 image load_image_color(char *filename, int w, int h);
+image load_image_memory(unsigned char *buf, int len, int channels);
 image make_image(int w, int h, int c);
 image resize_image(image im, int w, int h);
+void resize_image_into(image im, image out, RESIZE_MODE mode);
+void resize_image_region(image im, image out, int dx, int dy, int w, int h, RESIZE_MODE mode);
+void resize_bytes_region(const unsigned char *data, int iw, int ih, int c, int step, int bgr, image out, int dx, int dy, int w, int h, RESIZE_MODE mode);
 void censor_image(image im, int dx, int dy, int w, int h);
 image letterbox_image(image im, int w, int h);
+void letterbox_bytes_into(const unsigned char *data, int w, int h, int c, int step, int bgr, image boxed);
+int letterbox_image_memory(unsigned char *buf, int len, image boxed, int *w, int *h);
+void bytes_to_image(const unsigned char *data, int step, int bgr, image im);
+void image_to_bytes(image im, unsigned char *data, int step, int bgr);
+byte_image make_byte_image(int w, int h, int c);
+void free_byte_image(byte_image m);
 image crop_image(image im, int dx, int dy, int w, int h);
 image center_crop_image(image im, int w, int h);
 image resize_min(image im, int min);
@@ -733,17 +820,22 @@ data load_all_cifar10();
 box_label *read_boxes(char *filename, int *n);
 box float_to_box(float *f, int stride);
 void draw_detections(image im, char* im_name, detection *dets, int num, float thresh, char **names, image **alphabet, int classes, double time_index);
+void draw_class_box(image im, box b, int id, int classes, char **names, image **alphabet);
+struct json_object;
+struct json_object *detections_to_json(detection *dets, int num, float thresh, char **names, int classes);
 
 matrix network_predict_data(network *net, data test);
 image **load_alphabet();
 image get_network_image(network *net);
 float *network_predict(network *net, float *input);
+void calibrate_network(network *net, float *input, float *ranges);
 
 int network_width(network *net);
 int network_height(network *net);
 float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num);
 void free_detections(detection *dets, int n);
 
 void reset_network_state(network *net, int b);
@@ -756,7 +848,10 @@ matrix make_matrix(int rows, int cols);
 
 #ifdef OPENCV
 void *open_video_stream(const char *f, int c, int w, int h, int fps);
+void close_video_stream(void *p);
 image get_image_from_stream(void *p);
+int read_stream_image(void *p, image *im);
+int read_stream_frame(void *p, byte_image *frame);
 void make_window(char *name, int w, int h, int fullscreen);
 #endif
 
@@ -31,6 +31,12 @@ class DETECTION(Structure):
                 ("objectness", c_float),
                 ("sort_class", c_int)]
 
+class SESSION_DETECTION(Structure):
+    _fields_ = [("bbox", BOX),
+                ("class_id", c_int),
+                ("prob", c_float),
+                ("objectness", c_float)]
+
 
 class IMAGE(Structure):
     _fields_ = [("w", c_int),
@@ -114,6 +120,21 @@ predict_image = lib.network_predict_image
 predict_image.argtypes = [c_void_p, IMAGE]
 predict_image.restype = POINTER(c_float)
 
+load_net_inference = lib.load_network_inference
+load_net_inference.argtypes = [c_char_p, c_char_p]
+load_net_inference.restype = c_void_p
+
+make_session = lib.make_session
+make_session.argtypes = [c_void_p]
+make_session.restype = c_void_p
+
+free_session = lib.free_session
+free_session.argtypes = [c_void_p]
+
+session_detect = lib.session_detect
+session_detect.argtypes = [c_void_p, IMAGE, c_float, c_float, c_float, POINTER(SESSION_DETECTION), c_int]
+session_detect.restype = c_int
+
 def classify(net, meta, im):
     out = predict_image(net, im)
     res = []
@@ -141,6 +162,18 @@ def detect(net, meta, image, thresh=.5, hier_thresh=.5, nms=.45):
     free_image(im)
     free_detections(dets, num)
     return res
+
+# Each thread detects with a session of its own: make_session(net).
+def detect_session(session, meta, image, thresh=.5, hier_thresh=.5, nms=.45, max_dets=256):
+    im = load_image(image, 0, 0)
+    dets = (SESSION_DETECTION*max_dets)()
+    num = min(session_detect(session, im, thresh, hier_thresh, nms, dets, max_dets), max_dets)
+    res = []
+    for d in dets[:num]:
+        b = d.bbox
+        res.append((meta.names[d.class_id], d.prob, (b.x, b.y, b.w, b.h)))
+    free_image(im)
+    return res
     
 if __name__ == "__main__":
     #net = load_net("cfg/densenet201.cfg", "/home/pjreddie/trained/densenet201.weights", 0)
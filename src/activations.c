@@ -1,4 +1,5 @@
 #include "activations.h"
+#include "parallel.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -97,14 +98,27 @@ float activate(float x, ACTIVATION a)
     return 0;
 }
 
-void activate_array(float *x, const int n, const ACTIVATION a)
+typedef struct {
+    float *x;
+    ACTIVATION a;
+} activate_args;
+
+static void activate_range(int start, int end, void *ptr)
 {
+    activate_args args = *(activate_args *)ptr;
     int i;
-    for(i = 0; i < n; ++i){
-        x[i] = activate(x[i], a);
+    for(i = start; i < end; ++i){
+        args.x[i] = activate(args.x[i], args.a);
     }
 }
 
+void activate_array(float *x, const int n, const ACTIVATION a)
+{
+    if(a == LINEAR) return;
+    activate_args args = {x, a};
+    parallel_for(n, 16384, activate_range, &args);
+}
+
 float gradient(float x, ACTIVATION a)
 {
     switch(a){
@@ -0,0 +1,257 @@
+#include "arena.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Activation memory for inference networks.
+ *
+ * Normally every layer owns its output for the life of the network, but
+ * most outputs are only read by the next layer. plan_activation_arena()
+ * computes when each output is written and last read (the next layer,
+ * route input_layers, shortcut index) and packs outputs whose lifetimes do
+ * not overlap into shared slots of one arena. Outputs read after
+ * forward_network() returns, those of the output and detection layers,
+ * live to the end. Every other layer's output is scratch once the network
+ * has run.
+ */
+
+/* Slot offsets are kept a cache line apart. */
+#define ARENA_ALIGN 16
+
+static int arena_capable(layer l)
+{
+    switch(l.type){
+        case CONVOLUTIONAL:
+        case CONNECTED:
+        case MAXPOOL:
+        case AVGPOOL:
+        case ROUTE:
+        case SHORTCUT:
+        case UPSAMPLE:
+        case YOLO:
+        case REGION:
+        case DETECTION:
+        case SOFTMAX:
+        case BATCHNORM:
+        case ACTIVE:
+        case REORG:
+        case L2NORM:
+        case LOGXENT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int read_after_forward(network *net, int i)
+{
+    LAYER_TYPE t = net->layers[i].type;
+    int out = net->n - 1;
+    while(out > 0 && net->layers[out].type == COST) --out;
+    return t == YOLO || t == REGION || t == DETECTION || i >= out;
+}
+
+static int in_arena(network *net, float *p)
+{
+    return net->arena && p >= net->arena && p < net->arena + net->arena_size;
+}
+
+/* Gives layers back outputs of their own, e.g. before resize_network() reallocates them. */
+void release_activation_arena(network *net)
+{
+    int i;
+    if(!net->arena) return;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(!in_arena(net, l->output)) continue;
+        l->output = calloc((size_t)l->outputs*l->batch, sizeof(float));
+        if(!l->output) malloc_error();
+    }
+    free(net->arena);
+    net->arena = 0;
+    net->arena_size = 0;
+    net->output = get_network_output_layer(net).output;
+}
+
+/* How many times layer i's output is read during a forward pass. */
+static int readers(network *net, int i)
+{
+    int j, k;
+    int count = 0;
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        if(l.type == ROUTE){
+            for(k = 0; k < l.n; ++k) count += l.input_layers[k] == i;
+            continue;
+        }
+        if(l.type == SHORTCUT) count += l.index == i;
+        if(j == i + 1) ++count;
+    }
+    return count;
+}
+
+/*
+ * Outputs that are part of another layer's: alias[i] = j when layer i's
+ * output lives at offset[i] in layer j's, so no copy is needed between them.
+ *  - a conv with a fused shortcut writes the shortcut's output;
+ *  - a route with one input is that input;
+ *  - an output only a route reads is written straight into its slice of
+ *    the route's output, which at batch 1 is contiguous.
+ * forward_route_layer() skips inputs that already sit in place.
+ */
+static void find_aliases(network *net, int *alias, size_t *offset)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        alias[i] = -1;
+        offset[i] = 0;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL && l.fuse_shortcut) alias[i] = i + 1;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != ROUTE) continue;
+        if(l.n == 1){
+            layer src = net->layers[l.input_layers[0]];
+            if(src.outputs == l.outputs && src.batch == l.batch) alias[i] = l.input_layers[0];
+            continue;
+        }
+        if(l.batch != 1) continue;
+        size_t slice = 0;
+        for(j = 0; j < l.n; ++j){
+            int p = l.input_layers[j];
+            if(alias[p] < 0 && p != i && !read_after_forward(net, p) && readers(net, p) == 1
+                    && net->layers[p].outputs == l.input_sizes[j] && net->layers[p].batch == 1){
+                alias[p] = i;
+                offset[p] = slice;
+            }
+            slice += l.input_sizes[j];
+        }
+    }
+}
+
+void plan_activation_arena(network *net)
+{
+    int i, j, k;
+    int n = net->n;
+    if(n < 1) return;
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    for(i = 0; i < n; ++i){
+        if(!arena_capable(net->layers[i])) return;
+    }
+
+    int *alias = calloc(n, sizeof(int));
+    size_t *within = calloc(n, sizeof(size_t));
+    int *root = calloc(n, sizeof(int));
+    int *first = calloc(n, sizeof(int));
+    int *last = calloc(n, sizeof(int));
+    int *order = calloc(n, sizeof(int));
+    find_aliases(net, alias, within);
+    for(i = 0; i < n; ++i){
+        first[i] = last[i] = i;
+        root[i] = i;
+        while(alias[root[i]] >= 0) root[i] = alias[root[i]];
+    }
+    /* A root tensor is written from the first of its parts on. */
+    for(i = 0; i < n; ++i){
+        if(first[root[i]] > i) first[root[i]] = i;
+    }
+    for(i = 0; i < n; ++i){
+        layer l = net->layers[i];
+        if(read_after_forward(net, i)) last[root[i]] = n;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                k = root[l.input_layers[j]];
+                if(last[k] < i) last[k] = i;
+            }
+            continue;
+        }
+        if(l.type == SHORTCUT){
+            k = root[l.index];
+            if(last[k] < i) last[k] = i;
+        }
+        if(i > 0){
+            k = root[i-1];
+            if(last[k] < i) last[k] = i;
+        }
+    }
+
+    /* Roots by write time, then greedily: best-fitting free slot, else grow the largest free one, else a new one. */
+    int roots = 0;
+    for(i = 0; i < n; ++i){
+        if(root[i] != i) continue;
+        for(j = roots++; j > 0 && first[order[j-1]] > first[i]; --j) order[j] = order[j-1];
+        order[j] = i;
+    }
+    size_t *slot_size = calloc(n, sizeof(size_t));
+    int *slot_free_at = calloc(n, sizeof(int));
+    int *slot = calloc(n, sizeof(int));
+    int slots = 0;
+    size_t before = 0;
+    for(k = 0; k < roots; ++k){
+        i = order[k];
+        layer l = net->layers[i];
+        size_t size = ((size_t)l.outputs*l.batch + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+        int t = first[i];
+        int best = -1, largest = -1;
+        for(j = 0; j < slots; ++j){
+            if(slot_free_at[j] >= t) continue;
+            if(slot_size[j] >= size && (best < 0 || slot_size[j] < slot_size[best])) best = j;
+            if(largest < 0 || slot_size[j] > slot_size[largest]) largest = j;
+        }
+        if(best < 0) best = largest;
+        if(best < 0) best = slots++;
+        if(slot_size[best] < size) slot_size[best] = size;
+        slot_free_at[best] = last[i];
+        slot[i] = best;
+    }
+    for(i = 0; i < n; ++i) before += (size_t)net->layers[i].outputs*net->layers[i].batch;
+
+    size_t *offset = calloc(slots + 1, sizeof(size_t));
+    for(j = 0; j < slots; ++j) offset[j+1] = offset[j] + slot_size[j];
+    /* Not cleared: the layers above all write their whole output. */
+    float *arena = 0;
+    if(offset[slots] && posix_memalign((void **)&arena, 64, offset[slots]*sizeof(float))) malloc_error();
+
+    for(i = 0; i < n; ++i){
+        layer *l = net->layers + i;
+        size_t at = offset[slot[root[i]]];
+        for(k = i; k != root[i]; k = alias[k]) at += within[k];
+        if(!in_arena(net, l->output)) free(l->output);
+        l->output = arena + at;
+    }
+    free(net->arena);
+    net->arena = arena;
+    net->arena_size = offset[slots];
+    net->output = get_network_output_layer(net).output;
+
+    fprintf(stderr, "activation arena: %d slots, %.1f MB for %.1f MB of outputs, %d of %d outputs shared\n",
+            slots, offset[slots]*sizeof(float)/1048576., before*sizeof(float)/1048576., n - roots, n);
+    free(alias);
+    free(within);
+    free(root);
+    free(first);
+    free(last);
+    free(order);
+    free(slot_size);
+    free(slot_free_at);
+    free(slot);
+    free(offset);
+}
+
+/* For free_network(): the planned outputs are all inside the arena. */
+void free_activation_arena(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        if(in_arena(net, net->layers[i].output)) net->layers[i].output = 0;
+    }
+    free(net->arena);
+    net->arena = 0;
+    net->arena_size = 0;
+}
@@ -0,0 +1,9 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include "darknet.h"
+
+void plan_activation_arena(network *net);
+void release_activation_arena(network *net);
+void free_activation_arena(network *net);
+
+#endif
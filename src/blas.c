@@ -1,4 +1,5 @@
 #include "blas.h"
+#include "parallel.h"
 
 #include <math.h>
 #include <assert.h>
@@ -65,32 +66,49 @@ void weighted_delta_cpu(float *a, float *b, float *s, float *da, float *db, floa
     }
 }
 
-void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float s1, float s2, float *out)
+typedef struct {
+    int w1, h1, c1;
+    float *add;
+    int w2, h2, c2;
+    float s1, s2;
+    float *out;
+} shortcut_args;
+
+static void shortcut_planes(int start, int end, void *ptr)
 {
+    shortcut_args a = *(shortcut_args *)ptr;
+    int w1 = a.w1, h1 = a.h1, c1 = a.c1, w2 = a.w2, h2 = a.h2, c2 = a.c2;
     int stride = w1/w2;
     int sample = w2/w1;
-    assert(stride == h1/h2);
-    assert(sample == h2/h1);
     if(stride < 1) stride = 1;
     if(sample < 1) sample = 1;
     int minw = (w1 < w2) ? w1 : w2;
     int minh = (h1 < h2) ? h1 : h2;
     int minc = (c1 < c2) ? c1 : c2;
 
-    int i,j,k,b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < minc; ++k){
-            for(j = 0; j < minh; ++j){
-                for(i = 0; i < minw; ++i){
-                    int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
-                    int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
-                    out[out_index] = s1*out[out_index] + s2*add[add_index];
-                }
+    int i,j,p;
+    for(p = start; p < end; ++p){
+        int b = p / minc;
+        int k = p % minc;
+        for(j = 0; j < minh; ++j){
+            for(i = 0; i < minw; ++i){
+                int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
+                int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
+                a.out[out_index] = a.s1*a.out[out_index] + a.s2*a.add[add_index];
             }
         }
     }
 }
 
+void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float s1, float s2, float *out)
+{
+    assert(w1/w2 == h1/h2);
+    assert(w2/w1 == h2/h1);
+    int minc = (c1 < c2) ? c1 : c2;
+    shortcut_args args = {w1, h1, c1, add, w2, h2, c2, s1, s2, out};
+    parallel_for(batch*minc, 1, shortcut_planes, &args);
+}
+
 void mean_cpu(float *x, int batch, int filters, int spatial, float *mean)
 {
     float scale = 1./(batch * spatial);
@@ -144,19 +162,30 @@ void l2normalize_cpu(float *x, float *dx, int batch, int filters, int spatial)
 }
 
 
-void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+typedef struct {
+    float *x, *mean, *variance;
+    int filters, spatial;
+} normalize_args;
+
+static void normalize_planes(int start, int end, void *ptr)
 {
-    int b, f, i;
-    for(b = 0; b < batch; ++b){
-        for(f = 0; f < filters; ++f){
-            for(i = 0; i < spatial; ++i){
-                int index = b*filters*spatial + f*spatial + i;
-                x[index] = (x[index] - mean[f])/(sqrt(variance[f]) + .000001f);
-            }
+    normalize_args a = *(normalize_args *)ptr;
+    int p, i;
+    for(p = start; p < end; ++p){
+        int f = p % a.filters;
+        float *x = a.x + p*a.spatial;
+        for(i = 0; i < a.spatial; ++i){
+            x[i] = (x[i] - a.mean[f])/(sqrt(a.variance[f]) + .000001f);
         }
     }
 }
 
+void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+{
+    normalize_args args = {x, mean, variance, filters, spatial};
+    parallel_for(batch*filters, 1, normalize_planes, &args);
+}
+
 void const_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
@@ -331,21 +360,36 @@ void softmax_cpu(float *input, int n, int batch, int batch_offset, int groups, i
     }
 }
 
-void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
+typedef struct {
+    float *in;
+    int w, h, stride, forward;
+    float scale;
+    float *out;
+} upsample_args;
+
+static void upsample_planes(int start, int end, void *ptr)
 {
-    int i, j, k, b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h*stride; ++j){
-                for(i = 0; i < w*stride; ++i){
-                    int in_index = b*w*h*c + k*w*h + (j/stride)*w + i/stride;
-                    int out_index = b*w*h*c*stride*stride + k*w*h*stride*stride + j*w*stride + i;
-                    if(forward) out[out_index] = scale*in[in_index];
-                    else in[in_index] += scale*out[out_index];
-                }
+    upsample_args a = *(upsample_args *)ptr;
+    int w = a.w, h = a.h, stride = a.stride;
+    int i, j, p;
+    for(p = start; p < end; ++p){
+        float *in = a.in + p*w*h;
+        float *out = a.out + p*w*h*stride*stride;
+        for(j = 0; j < h*stride; ++j){
+            for(i = 0; i < w*stride; ++i){
+                int in_index = (j/stride)*w + i/stride;
+                int out_index = j*w*stride + i;
+                if(a.forward) out[out_index] = a.scale*in[in_index];
+                else in[in_index] += a.scale*out[out_index];
             }
         }
     }
 }
 
+void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
+{
+    upsample_args args = {in, w, h, stride, forward, scale, out};
+    parallel_for(batch*c, 1, upsample_planes, &args);
+}
+
 
@@ -0,0 +1,652 @@
+#include "blocked.h"
+#include "activations.h"
+#include "parallel.h"
+#include "winograd.h"
+#include "utils.h"
+#include "weights_map.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <assert.h>
+
+/*
+ * Channel-blocked NCHW8c activations for CPU inference.
+ *
+ * A blocked tensor stores channels in groups of BLOCK_C: element (c, y, x)
+ * lives at ((c/BLOCK_C)*h*w + y*w + x)*BLOCK_C + c%BLOCK_C.  Every pixel of
+ * a block is then one vector, so 1x1 and strided convolutions, pooling and
+ * upsampling become straight vector code over contiguous memory, with no
+ * im2col and no transposes.
+ *
+ * plan_blocked_layout() decides per layer whether its output is blocked.
+ * Convolutional, maxpool, upsample, shortcut and route layers can run
+ * blocked when their channel counts are multiples of BLOCK_C; everything
+ * else (yolo, region, softmax, connected, ...) stays NCHW, and
+ * forward_network() reorders the input at each boundary between the two.
+ * Route and shortcut read other layers' outputs directly, and dropout
+ * passes its input's buffer on, so they have to agree with their sources;
+ * the planner falls back to NCHW until they do.
+ * The layout only applies while net->train is off: training always runs
+ * the NCHW kernels.
+ */
+
+/* The vector helpers are always inlined, so no vector ever crosses a call ABI. */
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef float v8sf __attribute__((vector_size(BLOCK_C*sizeof(float))));
+typedef int v8si __attribute__((vector_size(BLOCK_C*sizeof(int))));
+typedef float v16sf __attribute__((vector_size(2*BLOCK_C*sizeof(float))));
+
+static inline __attribute__((always_inline)) v8sf load8(const float *p)
+{
+    v8sf v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline __attribute__((always_inline)) v16sf load16(const float *p)
+{
+    v16sf v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline __attribute__((always_inline)) void store8(float *p, v8sf v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline __attribute__((always_inline)) v8sf select8(v8si mask, v8sf a, v8sf b)
+{
+    return (v8sf)(((v8si)a & mask) | ((v8si)b & ~mask));
+}
+
+/* Batchnorm / bias as scale*x + shift, followed by the activation. */
+static inline __attribute__((always_inline)) v8sf epilogue8(v8sf v, v8sf scale, v8sf shift, ACTIVATION a)
+{
+    int k;
+    v = v*scale + shift;
+    if(a == LINEAR) return v;
+    if(a == LEAKY) return select8(v > 0, v, v*.1f);
+    if(a == RELU) return select8(v > 0, v, v*0);
+    for(k = 0; k < BLOCK_C; ++k) v[k] = activate(v[k], a);
+    return v;
+}
+
+static int blocked_capable(network *net, layer l)
+{
+    int i;
+    switch(l.type){
+        case CONVOLUTIONAL:
+            return l.c % BLOCK_C == 0 && l.n % BLOCK_C == 0 && l.groups == 1 && !l.binary && !l.xnor;
+        case MAXPOOL:
+            return l.c % BLOCK_C == 0;
+        case UPSAMPLE:
+            return l.c % BLOCK_C == 0 && !l.reverse;
+        case SHORTCUT:
+            return l.out_c % BLOCK_C == 0 && l.c == l.out_c && l.w == l.out_w && l.h == l.out_h;
+        case ROUTE:
+            if(!l.out_c) return 0;
+            for(i = 0; i < l.n; ++i){
+                if(net->layers[l.input_layers[i]].out_c % BLOCK_C) return 0;
+            }
+            return 1;
+        case DROPOUT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void plan_blocked_layout(network *net)
+{
+    int i, j, changed, prev;
+    int count = 0;
+    int blocked = net->blocked;
+#ifdef GPU
+    if(net->gpu_index >= 0) blocked = 0;
+#endif
+    /* The int8 kernels read NCHW; mixing them with blocked layers would reorder at every layer. */
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].int8_weights) blocked = 0;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        l->blocked = blocked && i < net->n - 1 && blocked_capable(net, *l);
+    }
+    do{
+        changed = 0;
+        for(i = 0; i < net->n; ++i){
+            layer *l = net->layers + i;
+            int n = 0;
+            int *sources = 0;
+            if(l->type == ROUTE){
+                n = l->n;
+                sources = l->input_layers;
+            } else if(l->type == SHORTCUT){
+                n = 1;
+                sources = &l->index;
+            } else if(l->type == DROPOUT && i > 0){
+                /* Its output is its input's buffer. */
+                prev = i - 1;
+                n = 1;
+                sources = &prev;
+            }
+            for(j = 0; j < n; ++j){
+                layer *src = net->layers + sources[j];
+                if(src->blocked == l->blocked) continue;
+                if(l->blocked) l->blocked = 0;
+                else src->blocked = 0;
+                changed = 1;
+            }
+        }
+    } while(changed);
+
+    /* A conv with a fused shortcut writes the shortcut's output, so the two must agree. */
+    for(i = 0; i + 1 < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->fuse_shortcut && l->blocked != l[1].blocked){
+            l->fuse_shortcut = 0;
+            l[1].fused = 0;
+        }
+    }
+
+    /* Blocked weights already there stay: whatever changes the weights transforms them again. */
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        int wanted = l->blocked && l->type == CONVOLUTIONAL && !l->winograd_weights;
+        count += l->blocked;
+        if(wanted && l->blocked_weights) continue;
+        if(!in_weights_map(net, l->blocked_weights)) free(l->blocked_weights);
+        l->blocked_weights = 0;
+        if(wanted){
+            if(posix_memalign((void **)&l->blocked_weights, 64, l->nweights*sizeof(float))) malloc_error();
+            blocked_transform_weights(*l);
+        }
+    }
+    make_reorder_buffer(net);
+    if(blocked) fprintf(stderr, "nchw%dc layout: %d of %d layers\n", BLOCK_C, count, net->n);
+}
+
+typedef struct {
+    float *in;
+    float *out;
+    int spatial;
+    int c;
+} reorder_args;
+
+static void to_blocked_planes(int start, int end, void *ptr)
+{
+    reorder_args a = *(reorder_args *)ptr;
+    int b, i, k;
+    for(b = start; b < end; ++b){
+        float *in = a.in + b*BLOCK_C*a.spatial;
+        float *out = a.out + b*BLOCK_C*a.spatial;
+        for(i = 0; i < a.spatial; ++i){
+            for(k = 0; k < BLOCK_C; ++k){
+                out[i*BLOCK_C + k] = in[k*a.spatial + i];
+            }
+        }
+    }
+}
+
+static void to_nchw_planes(int start, int end, void *ptr)
+{
+    reorder_args a = *(reorder_args *)ptr;
+    int b, i, k;
+    for(b = start; b < end; ++b){
+        float *in = a.in + b*BLOCK_C*a.spatial;
+        float *out = a.out + b*BLOCK_C*a.spatial;
+        for(k = 0; k < BLOCK_C; ++k){
+            for(i = 0; i < a.spatial; ++i){
+                out[k*a.spatial + i] = in[i*BLOCK_C + k];
+            }
+        }
+    }
+}
+
+void nchw_to_blocked(float *in, int batch, int c, int h, int w, float *out)
+{
+    reorder_args args = {in, out, h*w, c};
+    parallel_for(batch*c/BLOCK_C, 1, to_blocked_planes, &args);
+}
+
+void blocked_to_nchw(float *in, int batch, int c, int h, int w, float *out)
+{
+    reorder_args args = {in, out, h*w, c};
+    parallel_for(batch*c/BLOCK_C, 1, to_nchw_planes, &args);
+}
+
+/* Floats a blocked convolution needs for its padded input and its per-filter scale and shift. */
+static size_t conv_scratch_size(layer l)
+{
+    size_t padded = l.pad ? (size_t)l.c*(l.h + 2*l.pad)*(l.w + 2*l.pad) : 0;
+    return padded + 2*l.n;
+}
+
+/*
+ * Sized up front rather than on demand: network_predict() restores the
+ * network struct afterwards, which would lose a buffer grown mid-forward.
+ * The blocked convolutions' scratch is sized here too, for the same reason.
+ */
+void make_reorder_buffer(network *net)
+{
+    int i;
+    size_t size = 0;
+    size_t scratch = 0;
+    free(net->reorder);
+    free(net->blocked_scratch);
+    net->reorder = 0;
+    net->reorder_size = 0;
+    net->blocked_scratch = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!l.blocked) continue;
+        if((size_t)l.inputs*l.batch > size) size = (size_t)l.inputs*l.batch;
+        if((size_t)l.outputs*l.batch > size) size = (size_t)l.outputs*l.batch;
+        if(l.type == CONVOLUTIONAL && conv_scratch_size(l) > scratch) scratch = conv_scratch_size(l);
+    }
+    if(!size) return;
+    net->reorder = calloc(size, sizeof(float));
+    if(!net->reorder) malloc_error();
+    net->reorder_size = size;
+    if(scratch){
+        net->blocked_scratch = calloc(scratch, sizeof(float));
+        if(!net->blocked_scratch) malloc_error();
+    }
+}
+
+float *reorder_network_input(network *net, float *input, int batch, int c, int h, int w, int to_blocked)
+{
+    assert((size_t)batch*c*h*w <= net->reorder_size);
+    if(to_blocked) nchw_to_blocked(input, batch, c, h, w, net->reorder);
+    else blocked_to_nchw(input, batch, c, h, w, net->reorder);
+    return net->reorder;
+}
+
+/* 1x1 stride-1 convolutions walk each plane as rows of this many pixels. */
+#define FLAT_ROW 96
+
+typedef struct {
+    layer l;
+    float *input;
+    int h, w;
+    int rows, width, in_row;
+    int lanes;
+    float *output;
+    float *scale;
+    float *shift;
+    float *add;
+    float alpha, beta;
+    ACTIVATION add_activation;
+} conv_blocked_args;
+
+/* The fused shortcut after the epilogue: add_activation(alpha*v + beta*res). */
+static inline __attribute__((always_inline)) v8sf residual8(v8sf v, const float *res, const conv_blocked_args *r)
+{
+    v8sf alpha = {0}, beta = {0};
+    alpha += r->alpha;
+    beta += r->beta;
+    return epilogue8(load8(res), beta, alpha*v, r->add_activation);
+}
+
+/*
+ * nx output pixels of one output block, kept in registers for the whole
+ * reduction over a chunk of input blocks and all kernel taps.  Chunks
+ * after the first add to what is already in out; the last one applies
+ * the epilogue (scale is null before that), and res, if set, the fused
+ * shortcut.
+ */
+static inline __attribute__((always_inline)) void conv_tile8(const int nx, const float *in, const float *w,
+        int blocks, int size, int cstride, int row, int step,
+        int accumulate, const float *scale, const float *shift, ACTIVATION a, float *out, int plane,
+        const float *res, const conv_blocked_args *r)
+{
+    v8sf acc[8];
+    int x, b, ky, kx, i;
+    for(x = 0; x < nx; ++x) acc[x] = accumulate ? load8(out + x*BLOCK_C) : (v8sf){0};
+    for(b = 0; b < blocks; ++b){
+        for(ky = 0; ky < size; ++ky){
+            for(kx = 0; kx < size; ++kx){
+                const float *p = in + b*cstride + ky*row + kx*BLOCK_C;
+                for(i = 0; i < BLOCK_C; ++i){
+                    v8sf wv = load8(w);
+                    w += BLOCK_C;
+                    for(x = 0; x < nx; ++x) acc[x] += p[x*step + i]*wv;
+                }
+            }
+        }
+    }
+    for(x = 0; x < nx; ++x){
+        if(scale){
+            acc[x] = epilogue8(acc[x], load8(scale), load8(shift), a);
+            if(res) acc[x] = residual8(acc[x], res + x*BLOCK_C, r);
+        }
+        store8(out + x*BLOCK_C, acc[x]);
+    }
+}
+
+/* Same for two output blocks at once, as 16 lane vectors (AVX-512). */
+static inline __attribute__((always_inline)) void conv_tile16(const int nx, const float *in, const float *w,
+        int blocks, int size, int cstride, int row, int step,
+        int accumulate, const float *scale, const float *shift, ACTIVATION a, float *out, int plane,
+        const float *res, const conv_blocked_args *r)
+{
+    v16sf acc[12];
+    float v[2*BLOCK_C];
+    int x, b, ky, kx, i;
+    for(x = 0; x < nx; ++x){
+        if(accumulate){
+            memcpy(v, out + x*BLOCK_C, sizeof(v)/2);
+            memcpy(v + BLOCK_C, out + plane + x*BLOCK_C, sizeof(v)/2);
+            acc[x] = load16(v);
+        } else {
+            acc[x] = (v16sf){0};
+        }
+    }
+    for(b = 0; b < blocks; ++b){
+        for(ky = 0; ky < size; ++ky){
+            for(kx = 0; kx < size; ++kx){
+                const float *p = in + b*cstride + ky*row + kx*BLOCK_C;
+                for(i = 0; i < BLOCK_C; ++i){
+                    v16sf wv = load16(w);
+                    w += 2*BLOCK_C;
+                    for(x = 0; x < nx; ++x) acc[x] += p[x*step + i]*wv;
+                }
+            }
+        }
+    }
+    for(x = 0; x < nx; ++x){
+        v8sf lo, hi;
+        memcpy(v, acc + x, sizeof(v));
+        lo = load8(v);
+        hi = load8(v + BLOCK_C);
+        if(scale){
+            lo = epilogue8(lo, load8(scale), load8(shift), a);
+            hi = epilogue8(hi, load8(scale + BLOCK_C), load8(shift + BLOCK_C), a);
+            if(res){
+                lo = residual8(lo, res + x*BLOCK_C, r);
+                hi = residual8(hi, res + plane + x*BLOCK_C, r);
+            }
+        }
+        store8(out + x*BLOCK_C, lo);
+        store8(out + plane + x*BLOCK_C, hi);
+    }
+}
+
+/* Input blocks per reduction chunk, so a group's weights for it stay in L1. */
+#define CHUNK_BLOCKS 32
+
+/*
+ * One task is one row of output pixels for one group of a->lanes output
+ * channels.  Wide register tiles cover the row, narrower ones the tail.
+ */
+static inline __attribute__((always_inline)) void conv_blocked_body(int start, int end, conv_blocked_args *a, const int lanes)
+{
+    layer l = a->l;
+    int blocks = l.c/BLOCK_C;
+    int cstride = a->h*a->w*BLOCK_C;
+    int row = a->w*BLOCK_C;
+    int step = l.stride*BLOCK_C;
+    int spatial = l.out_h*l.out_w;
+    int plane = spatial*BLOCK_C;
+    int kk = l.size*l.size;
+    int chunk = (CHUNK_BLOCKS/kk > 0) ? CHUNK_BLOCKS/kk : 1;
+    int t, x, nx, b;
+    for(t = start; t < end; ++t){
+        int g = t / a->rows;
+        int r = t % a->rows;
+        int width = (spatial - r*a->width < a->width) ? spatial - r*a->width : a->width;
+        float *out = a->output + ((size_t)g*lanes/BLOCK_C*spatial + r*a->width)*BLOCK_C;
+        for(b = 0; b < blocks; b += chunk){
+            int n = (blocks - b < chunk) ? blocks - b : chunk;
+            const float *in = a->input + r*a->in_row + b*cstride;
+            const float *w = l.blocked_weights + ((size_t)g*blocks + b)*kk*BLOCK_C*lanes;
+            const float *scale = (b + n == blocks) ? a->scale + g*lanes : 0;
+            const float *shift = a->shift + g*lanes;
+            for(x = 0; x < width; x += nx){
+                const float *p = in + x*step;
+                float *o = out + x*BLOCK_C;
+                const float *res = a->add ? a->add + (o - a->output) : 0;
+                nx = width - x;
+                if(lanes == 16){
+                    if(nx >= 12) conv_tile16(nx = 12, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else if(nx >= 8) conv_tile16(nx = 8, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else if(nx >= 4) conv_tile16(nx = 4, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else if(nx >= 2) conv_tile16(nx = 2, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else conv_tile16(nx = 1, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                } else {
+                    if(nx >= 8) conv_tile8(nx = 8, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else if(nx >= 4) conv_tile8(nx = 4, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else if(nx >= 2) conv_tile8(nx = 2, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                    else conv_tile8(nx = 1, p, w, n, l.size, cstride, row, step, b, scale, shift, l.activation, o, plane, res, a);
+                }
+            }
+        }
+    }
+}
+
+static void conv_blocked_rows(int start, int end, void *ptr)
+{
+    conv_blocked_body(start, end, ptr, 8);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLOCKED_X86
+
+__attribute__((target("avx2,fma")))
+static void conv_blocked_rows_avx2(int start, int end, void *ptr)
+{
+    conv_blocked_body(start, end, ptr, 8);
+}
+
+__attribute__((target("avx512f,fma")))
+static void conv_blocked_rows_avx512(int start, int end, void *ptr)
+{
+    conv_blocked_body(start, end, ptr, 16);
+}
+#endif
+
+static int has_avx512()
+{
+#ifdef BLOCKED_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#else
+    return 0;
+#endif
+}
+
+/* Output channels per weight vector of the direct kernel for this layer. */
+static int conv_lanes(layer l)
+{
+    static int avx512 = -1;
+    if(avx512 < 0) avx512 = has_avx512();
+    return (avx512 && l.n % 16 == 0) ? 16 : 8;
+}
+
+static parallel_func select_conv_kernel(int lanes)
+{
+#ifdef BLOCKED_X86
+    __builtin_cpu_init();
+    if(lanes == 16) return conv_blocked_rows_avx512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return conv_blocked_rows_avx2;
+#endif
+    return conv_blocked_rows;
+}
+
+/*
+ * Weights for the direct kernel: for every group of output channels, input
+ * block and kernel tap, BLOCK_C vectors (one per input channel) holding the
+ * group's outputs.
+ */
+void blocked_transform_weights(layer l)
+{
+    int o, c, k;
+    if(!l.blocked_weights) return;
+    int kk = l.size*l.size;
+    int lanes = conv_lanes(l);
+    for(o = 0; o < l.n; ++o){
+        for(c = 0; c < l.c; ++c){
+            for(k = 0; k < kk; ++k){
+                int dst = (((o/lanes*(l.c/BLOCK_C) + c/BLOCK_C)*kk + k)*BLOCK_C + c%BLOCK_C)*lanes + o%lanes;
+                l.blocked_weights[dst] = l.weights[(o*l.c + c)*kk + k];
+            }
+        }
+    }
+}
+
+static void epilogue_planes(int start, int end, void *ptr)
+{
+    conv_blocked_args a = *(conv_blocked_args *)ptr;
+    int spatial = a.l.out_h*a.l.out_w;
+    int b, i;
+    for(b = start; b < end; ++b){
+        float *out = a.output + (size_t)b*spatial*BLOCK_C;
+        float *res = a.add ? a.add + (size_t)b*spatial*BLOCK_C : 0;
+        v8sf scale = load8(a.scale + b*BLOCK_C);
+        v8sf shift = load8(a.shift + b*BLOCK_C);
+        for(i = 0; i < spatial; ++i){
+            v8sf v = epilogue8(load8(out + i*BLOCK_C), scale, shift, a.l.activation);
+            if(res) v = residual8(v, res + i*BLOCK_C, &a);
+            store8(out + i*BLOCK_C, v);
+        }
+    }
+}
+
+/* Zero-padded copy of a blocked image into padded, so the direct kernel needs no bounds checks. */
+static float *pad_blocked(float *in, int c, int h, int w, int pad, float *padded)
+{
+    int ph = h + 2*pad;
+    int pw = w + 2*pad;
+    size_t size = (size_t)c*ph*pw;
+    int b, y;
+    memset(padded, 0, size*sizeof(float));
+    for(b = 0; b < c/BLOCK_C; ++b){
+        for(y = 0; y < h; ++y){
+            memcpy(padded + ((size_t)(b*ph + y + pad)*pw + pad)*BLOCK_C,
+                    in + ((size_t)b*h + y)*w*BLOCK_C, w*BLOCK_C*sizeof(float));
+        }
+    }
+    return padded;
+}
+
+void forward_convolutional_blocked(layer l, network net)
+{
+    int i;
+    float *padded = net.blocked_scratch;
+    float *scale = padded + conv_scratch_size(l) - 2*l.n;
+    float *shift = scale + l.n;
+    assert(padded);
+    for(i = 0; i < l.n; ++i){
+        if(l.batch_normalize){
+            scale[i] = l.scales[i]/(sqrt(l.rolling_variance[i]) + .000001f);
+            shift[i] = l.biases[i] - l.rolling_mean[i]*scale[i];
+        } else {
+            scale[i] = 1;
+            shift[i] = l.biases[i];
+        }
+    }
+
+    conv_blocked_args args = {0};
+    args.l = l;
+    args.scale = scale;
+    args.shift = shift;
+    args.lanes = conv_lanes(l);
+    float *output = l.output;
+    float *residual = 0;
+    if(l.fuse_shortcut){
+        layer s = net.layers[net.index + 1];
+        output = s.output;
+        residual = net.layers[s.index].output;
+        args.alpha = s.alpha;
+        args.beta = s.beta;
+        args.add_activation = s.activation;
+    }
+    for(i = 0; i < l.batch; ++i){
+        float *input = net.input + i*l.inputs;
+        args.output = output + i*l.outputs;
+        if(residual) args.add = residual + i*l.outputs;
+        if(l.winograd_weights){
+            forward_winograd_convolution(l, input, args.output, 1, 0);
+            parallel_for(l.n/BLOCK_C, 1, epilogue_planes, &args);
+            continue;
+        }
+        args.input = l.pad ? pad_blocked(input, l.c, l.h, l.w, l.pad, padded) : input;
+        args.h = l.h + 2*l.pad;
+        args.w = l.w + 2*l.pad;
+        if(l.size == 1 && l.stride == 1 && l.pad == 0){
+            args.width = FLAT_ROW;
+            args.rows = (l.out_h*l.out_w + FLAT_ROW - 1)/FLAT_ROW;
+            args.in_row = FLAT_ROW*BLOCK_C;
+        } else {
+            args.width = l.out_w;
+            args.rows = l.out_h;
+            args.in_row = l.stride*args.w*BLOCK_C;
+        }
+        parallel_for(l.n/args.lanes*args.rows, 1, select_conv_kernel(args.lanes), &args);
+    }
+}
+
+typedef struct {
+    layer l;
+    float *input;
+} pool_blocked_args;
+
+static void maxpool_blocked_rows(int start, int end, void *ptr)
+{
+    pool_blocked_args a = *(pool_blocked_args *)ptr;
+    layer l = a.l;
+    int offset = -l.pad/2;
+    int t, x, n, m;
+    for(t = start; t < end; ++t){
+        int b = t / l.out_h;
+        int y = t % l.out_h;
+        float *in = a.input + (size_t)b*l.h*l.w*BLOCK_C;
+        float *out = l.output + ((size_t)b*l.out_h + y)*l.out_w*BLOCK_C;
+        for(x = 0; x < l.out_w; ++x){
+            v8sf max = (v8sf){0} - FLT_MAX;
+            for(n = 0; n < l.size; ++n){
+                int cur_h = offset + y*l.stride + n;
+                if(cur_h < 0 || cur_h >= l.h) continue;
+                for(m = 0; m < l.size; ++m){
+                    int cur_w = offset + x*l.stride + m;
+                    if(cur_w < 0 || cur_w >= l.w) continue;
+                    v8sf v = load8(in + (cur_h*l.w + cur_w)*BLOCK_C);
+                    max = select8(v > max, v, max);
+                }
+            }
+            store8(out + x*BLOCK_C, max);
+        }
+    }
+}
+
+void forward_maxpool_blocked(layer l, network net)
+{
+    pool_blocked_args args = {l, net.input};
+    parallel_for(l.batch*l.c/BLOCK_C*l.out_h, 1, maxpool_blocked_rows, &args);
+}
+
+static void upsample_blocked_rows(int start, int end, void *ptr)
+{
+    pool_blocked_args a = *(pool_blocked_args *)ptr;
+    layer l = a.l;
+    int t, x;
+    for(t = start; t < end; ++t){
+        int b = t / l.out_h;
+        int y = t % l.out_h;
+        float *in = a.input + ((size_t)b*l.h + y/l.stride)*l.w*BLOCK_C;
+        float *out = l.output + ((size_t)b*l.out_h + y)*l.out_w*BLOCK_C;
+        for(x = 0; x < l.out_w; ++x){
+            store8(out + x*BLOCK_C, load8(in + (x/l.stride)*BLOCK_C)*l.scale);
+        }
+    }
+}
+
+void forward_upsample_blocked(layer l, network net)
+{
+    pool_blocked_args args = {l, net.input};
+    parallel_for(l.batch*l.c/BLOCK_C*l.out_h, 1, upsample_blocked_rows, &args);
+}
@@ -0,0 +1,19 @@
+#ifndef BLOCKED_H
+#define BLOCKED_H
+#include "darknet.h"
+
+/* Channels interleaved per block in the NCHW8c layout. */
+#define BLOCK_C 8
+
+void plan_blocked_layout(network *net);
+void blocked_transform_weights(layer l);
+void make_reorder_buffer(network *net);
+float *reorder_network_input(network *net, float *input, int batch, int c, int h, int w, int to_blocked);
+void nchw_to_blocked(float *in, int batch, int c, int h, int w, float *out);
+void blocked_to_nchw(float *in, int batch, int c, int h, int w, float *out);
+
+void forward_convolutional_blocked(layer l, network net);
+void forward_maxpool_blocked(layer l, network net);
+void forward_upsample_blocked(layer l, network net);
+
+#endif
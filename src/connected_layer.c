@@ -5,6 +5,7 @@
 #include "cuda.h"
 #include "blas.h"
 #include "gemm.h"
+#include "quantize.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -30,10 +31,10 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     l.out_c = outputs;
 
     l.output = calloc(batch*outputs, sizeof(float));
-    l.delta = calloc(batch*outputs, sizeof(float));
+    l.delta = train_calloc(batch*outputs, sizeof(float));
 
-    l.weight_updates = calloc(inputs*outputs, sizeof(float));
-    l.bias_updates = calloc(outputs, sizeof(float));
+    l.weight_updates = train_calloc(inputs*outputs, sizeof(float));
+    l.bias_updates = train_calloc(outputs, sizeof(float));
 
     l.weights = calloc(outputs*inputs, sizeof(float));
     l.biases = calloc(outputs, sizeof(float));
@@ -44,8 +45,10 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
 
     //float scale = 1./sqrt(inputs);
     float scale = sqrt(2./inputs);
-    for(i = 0; i < outputs*inputs; ++i){
-        l.weights[i] = scale*rand_uniform(-1, 1);
+    if(init_random_weights()){
+        for(i = 0; i < outputs*inputs; ++i){
+            l.weights[i] = scale*rand_uniform(-1, 1);
+        }
     }
 
     for(i = 0; i < outputs; ++i){
@@ -53,8 +56,8 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     }
 
     if(adam){
-        l.m = calloc(l.inputs*l.outputs, sizeof(float));
-        l.v = calloc(l.inputs*l.outputs, sizeof(float));
+        l.m = train_calloc(l.inputs*l.outputs, sizeof(float));
+        l.v = train_calloc(l.inputs*l.outputs, sizeof(float));
         l.bias_m = calloc(l.outputs, sizeof(float));
         l.scale_m = calloc(l.outputs, sizeof(float));
         l.bias_v = calloc(l.outputs, sizeof(float));
@@ -62,21 +65,21 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     }
     if(batch_normalize){
         l.scales = calloc(outputs, sizeof(float));
-        l.scale_updates = calloc(outputs, sizeof(float));
+        l.scale_updates = train_calloc(outputs, sizeof(float));
         for(i = 0; i < outputs; ++i){
             l.scales[i] = 1;
         }
 
         l.mean = calloc(outputs, sizeof(float));
-        l.mean_delta = calloc(outputs, sizeof(float));
+        l.mean_delta = train_calloc(outputs, sizeof(float));
         l.variance = calloc(outputs, sizeof(float));
-        l.variance_delta = calloc(outputs, sizeof(float));
+        l.variance_delta = train_calloc(outputs, sizeof(float));
 
         l.rolling_mean = calloc(outputs, sizeof(float));
         l.rolling_variance = calloc(outputs, sizeof(float));
 
-        l.x = calloc(batch*outputs, sizeof(float));
-        l.x_norm = calloc(batch*outputs, sizeof(float));
+        l.x = train_calloc(batch*outputs, sizeof(float));
+        l.x_norm = train_calloc(batch*outputs, sizeof(float));
     }
 
 #ifdef GPU
@@ -150,6 +153,10 @@ void update_connected_layer(layer l, update_args a)
 
 void forward_connected_layer(layer l, network net)
 {
+    if(l.int8_weights && !net.train){
+        forward_connected_int8(l, net);
+        return;
+    }
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
     int m = l.batch;
     int k = l.inputs;
@@ -157,7 +164,12 @@ void forward_connected_layer(layer l, network net)
     float *a = net.input;
     float *b = l.weights;
     float *c = l.output;
-    gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
+    if(l.packed_weights && l.batch == 1){
+        /* output^T = weights * input^T is the same memory at batch 1, and takes the packed weights as A. */
+        gemm_prepacked(n,1,k,l.packed_weights,a,1,1,c,1,0);
+    } else {
+        gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
+    }
     if(l.batch_normalize){
         forward_batchnorm_layer(l, net);
     } else {
@@ -0,0 +1,137 @@
+#include "network.h"
+#include "arena.h"
+#include "blocked.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Execution contexts: one model, many forward passes at once.
+ *
+ * A context is a network whose layers share the model's weights, biases and
+ * kernel copies of them, but own their outputs and whatever else forward
+ * writes, along with an input, workspace, reorder buffer and scratch of
+ * their own.
+ * Contexts of one model can run network_predict() on different threads at
+ * the same time; the worker pool serves one of them at a time and the
+ * others run their loops inline. Each costs its activation arena, not a copy
+ * of the weights. The model must outlive its contexts and stay as it is
+ * (no resize or set_batch_network) while they exist.
+ */
+
+#define CONTEXT_BUFFERS 4
+
+/* Besides its output, what forward writes in l at test time, in floats. */
+static int context_buffers(layer *l, float **field[CONTEXT_BUFFERS], size_t count[CONTEXT_BUFFERS])
+{
+    int n = 0;
+    size_t outputs = (size_t)l->outputs*l->batch;
+    size_t inputs = (size_t)l->inputs*l->batch;
+    if(l->type == DROPOUT) return 0;
+    if(l->type == NORMALIZATION){
+        field[n] = &l->squared;
+        count[n++] = inputs;
+        field[n] = &l->norms;
+        count[n++] = inputs;
+    }
+    if(l->type == L2NORM){
+        field[n] = &l->scales;
+        count[n++] = inputs;
+    }
+    if(l->x){
+        field[n] = &l->x;
+        count[n++] = outputs;
+    }
+    if(l->indexes){
+        field[n] = (float **)&l->indexes;
+        count[n++] = outputs;
+    }
+    if(l->binary_input){
+        field[n] = &l->binary_input;
+        count[n++] = inputs;
+    }
+    if(l->binary_weights){
+        field[n] = &l->binary_weights;
+        count[n++] = l->nweights;
+    }
+    return n;
+}
+
+network *make_network_context(network *net)
+{
+    int i, j;
+    float **field[CONTEXT_BUFFERS];
+    size_t count[CONTEXT_BUFFERS];
+#ifdef GPU
+    if(net->gpu_index >= 0) error("Execution contexts run on the CPU");
+#endif
+    network *ctx = calloc(1, sizeof(network));
+    *ctx = *net;
+    ctx->layers = calloc(net->n, sizeof(layer));
+    memcpy(ctx->layers, net->layers, net->n*sizeof(layer));
+    ctx->input = calloc((size_t)net->inputs*net->batch, sizeof(float));
+    ctx->allocated_batch = net->batch;
+    ctx->truth = 0;
+    ctx->delta = 0;
+    ctx->cost = calloc(1, sizeof(float));
+    ctx->train = 0;
+    ctx->inference_only = 1;
+    ctx->workspace = 0;
+    ctx->workspace_size = 0;
+    ctx->reorder = 0;
+    ctx->blocked_scratch = 0;
+    ctx->arena = 0;
+    ctx->arena_size = 0;
+    ctx->weights_map = 0;
+
+    for(i = 0; i < ctx->n; ++i){
+        layer *l = ctx->layers + i;
+        if(l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN){
+            error("Execution contexts do not support recurrent layers");
+        }
+        int n = context_buffers(l, field, count);
+        for(j = 0; j < n; ++j){
+            *field[j] = calloc(count[j], sizeof(float));
+            if(!*field[j]) malloc_error();
+        }
+        /* Only training reads these; forward clears deltas it finds. */
+        l->delta = 0;
+        l->output = 0;
+    }
+    plan_activation_arena(ctx);
+    for(i = 0; i < ctx->n; ++i){
+        layer *l = ctx->layers + i;
+        if(l->output) continue;
+        if(l->type == DROPOUT && i > 0){
+            l->output = ctx->layers[i-1].output;
+            continue;
+        }
+        l->output = calloc((size_t)l->outputs*l->batch, sizeof(float));
+        if(!l->output) malloc_error();
+    }
+    ctx->output = get_network_output_layer(ctx).output;
+    make_network_workspace(ctx, 0);
+    make_reorder_buffer(ctx);
+    return ctx;
+}
+
+void free_network_context(network *ctx)
+{
+    int i, j;
+    float **field[CONTEXT_BUFFERS];
+    size_t count[CONTEXT_BUFFERS];
+    free_activation_arena(ctx);
+    for(i = 0; i < ctx->n; ++i){
+        layer *l = ctx->layers + i;
+        int n = context_buffers(l, field, count);
+        for(j = 0; j < n; ++j) free(*field[j]);
+        if(l->type != DROPOUT) free(l->output);
+    }
+    free(ctx->layers);
+    free(ctx->input);
+    free(ctx->cost);
+    free(ctx->workspace);
+    free(ctx->reorder);
+    free(ctx->blocked_scratch);
+    free(ctx);
+}
@@ -5,6 +5,10 @@
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "parallel.h"
+#include "winograd.h"
+#include "blocked.h"
+#include "quantize.h"
 #include <stdio.h>
 #include <time.h>
 
@@ -193,10 +197,10 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.batch_normalize = batch_normalize;
 
     l.weights = calloc(c/groups*n*size*size, sizeof(float));
-    l.weight_updates = calloc(c/groups*n*size*size, sizeof(float));
+    l.weight_updates = train_calloc(c/groups*n*size*size, sizeof(float));
 
     l.biases = calloc(n, sizeof(float));
-    l.bias_updates = calloc(n, sizeof(float));
+    l.bias_updates = train_calloc(n, sizeof(float));
 
     l.nweights = c/groups*n*size*size;
     l.nbiases = n;
@@ -206,7 +210,9 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     //printf("convscale %f\n", scale);
     //scale = .02;
     //for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_uniform(-1, 1);
-    for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
+    if(init_random_weights()){
+        for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
+    }
     int out_w = convolutional_out_width(l);
     int out_h = convolutional_out_height(l);
     l.out_h = out_h;
@@ -216,7 +222,7 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.inputs = l.w * l.h * l.c;
 
     l.output = calloc(l.batch*l.outputs, sizeof(float));
-    l.delta  = calloc(l.batch*l.outputs, sizeof(float));
+    l.delta  = train_calloc(l.batch*l.outputs, sizeof(float));
 
     l.forward = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
@@ -233,7 +239,7 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
 
     if(batch_normalize){
         l.scales = calloc(n, sizeof(float));
-        l.scale_updates = calloc(n, sizeof(float));
+        l.scale_updates = train_calloc(n, sizeof(float));
         for(i = 0; i < n; ++i){
             l.scales[i] = 1;
         }
@@ -241,17 +247,17 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
         l.mean = calloc(n, sizeof(float));
         l.variance = calloc(n, sizeof(float));
 
-        l.mean_delta = calloc(n, sizeof(float));
-        l.variance_delta = calloc(n, sizeof(float));
+        l.mean_delta = train_calloc(n, sizeof(float));
+        l.variance_delta = train_calloc(n, sizeof(float));
 
         l.rolling_mean = calloc(n, sizeof(float));
         l.rolling_variance = calloc(n, sizeof(float));
-        l.x = calloc(l.batch*l.outputs, sizeof(float));
-        l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
+        l.x = train_calloc(l.batch*l.outputs, sizeof(float));
+        l.x_norm = train_calloc(l.batch*l.outputs, sizeof(float));
     }
     if(adam){
-        l.m = calloc(l.nweights, sizeof(float));
-        l.v = calloc(l.nweights, sizeof(float));
+        l.m = train_calloc(l.nweights, sizeof(float));
+        l.v = train_calloc(l.nweights, sizeof(float));
         l.bias_m = calloc(n, sizeof(float));
         l.scale_m = calloc(n, sizeof(float));
         l.bias_v = calloc(n, sizeof(float));
@@ -381,10 +387,10 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->inputs = l->w * l->h * l->c;
 
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
-    l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
+    l->delta  = train_realloc(l->delta,  l->batch*l->outputs*sizeof(float));
     if(l->batch_normalize){
-        l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
-        l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
+        l->x = train_realloc(l->x, l->batch*l->outputs*sizeof(float));
+        l->x_norm  = train_realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
 
 #ifdef GPU
@@ -408,30 +414,45 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->workspace_size = get_workspace_size(*l);
 }
 
-void add_bias(float *output, float *biases, int batch, int n, int size)
+typedef struct {
+    float *output, *biases;
+    int n, size;
+} bias_args;
+
+static void add_bias_planes(int start, int end, void *ptr)
 {
-    int i,j,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] += biases[i];
-            }
-        }
+    bias_args a = *(bias_args *)ptr;
+    int p, j;
+    for(p = start; p < end; ++p){
+        float bias = a.biases[p % a.n];
+        float *out = a.output + p*a.size;
+        for(j = 0; j < a.size; ++j) out[j] += bias;
     }
 }
 
-void scale_bias(float *output, float *scales, int batch, int n, int size)
+static void scale_bias_planes(int start, int end, void *ptr)
 {
-    int i,j,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] *= scales[i];
-            }
-        }
+    bias_args a = *(bias_args *)ptr;
+    int p, j;
+    for(p = start; p < end; ++p){
+        float scale = a.biases[p % a.n];
+        float *out = a.output + p*a.size;
+        for(j = 0; j < a.size; ++j) out[j] *= scale;
     }
 }
 
+void add_bias(float *output, float *biases, int batch, int n, int size)
+{
+    bias_args args = {output, biases, n, size};
+    parallel_for(batch*n, 1, add_bias_planes, &args);
+}
+
+void scale_bias(float *output, float *scales, int batch, int n, int size)
+{
+    bias_args args = {output, scales, n, size};
+    parallel_for(batch*n, 1, scale_bias_planes, &args);
+}
+
 void backward_bias(float *bias_updates, float *delta, int batch, int n, int size)
 {
     int i,b;
@@ -446,7 +467,36 @@ void forward_convolutional_layer(convolutional_layer l, network net)
 {
     int i, j;
 
-    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    if(l.int8_weights && !net.train){
+        forward_convolutional_int8(l, net);
+        return;
+    }
+    if(l.blocked && !net.train){
+        forward_convolutional_blocked(l, net);
+        return;
+    }
+
+    /*
+     * Fused (see optimize_network): bias, activation and possibly the next
+     * shortcut layer run in the GEMM epilogue, writing the shortcut's output.
+     */
+    int fused = l.fused && !net.train;
+    float *output = l.output;
+    float *residual = 0;
+    gemm_epilogue ep = {0};
+    if(fused){
+        ep.activation = l.activation;
+        if(l.fuse_shortcut){
+            layer s = net.layers[net.index + 1];
+            output = s.output;
+            residual = net.layers[s.index].output;
+            ep.alpha = s.alpha;
+            ep.beta = s.beta;
+            ep.add_activation = s.activation;
+        }
+    }
+
+    fill_cpu(l.outputs*l.batch, 0, output, 1);
 
     if(l.xnor){
         binarize_weights(l.weights, l.n, l.c/l.groups*l.size*l.size, l.binary_weights);
@@ -459,20 +509,31 @@ void forward_convolutional_layer(convolutional_layer l, network net)
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_w*l.out_h;
     for(i = 0; i < l.batch; ++i){
+        if(l.winograd_weights){
+            ep.bias = l.biases;
+            if(residual) ep.add = residual + i*l.outputs;
+            forward_winograd_convolution(l, net.input + i*l.inputs, output + i*l.outputs, 0, fused ? &ep : 0);
+            continue;
+        }
         for(j = 0; j < l.groups; ++j){
             float *a = l.weights + j*l.nweights/l.groups;
-            float *b = net.workspace;
-            float *c = l.output + (i*l.groups + j)*n*m;
+            float *packed = l.packed_weights ? l.packed_weights + j*gemm_packed_size(m, k) : 0;
+            float *c = output + (i*l.groups + j)*n*m;
             float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
-
-            if (l.size == 1) {
-                b = im;
+            ep.bias = l.biases + j*m;
+            if(residual) ep.add = residual + (i*l.groups + j)*n*m;
+
+            if (l.size == 1 && l.stride == 1 && l.pad == 0) {
+                if(packed) gemm_prepacked(m,n,k,packed,im,n,1,c,n, fused ? &ep : 0);
+                else gemm_fused(m,n,k,a,k,im,n,c,n, fused ? &ep : 0);
+            } else if(packed) {
+                gemm_im2col_prepacked(m, packed, im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, c, n, fused ? &ep : 0);
             } else {
-                im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
+                gemm_im2col(m, 1, a, k, im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, c, n, fused ? &ep : 0);
             }
-            gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
         }
     }
+    if(fused) return;
 
     if(l.batch_normalize){
         forward_batchnorm_layer(l, net);
@@ -553,6 +614,8 @@ void update_convolutional_layer(convolutional_layer l, update_args a)
     axpy_cpu(l.nweights, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(l.nweights, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(l.nweights, momentum, l.weight_updates, 1);
+    winograd_transform_weights(l);
+    blocked_transform_weights(l);
 }
 
 
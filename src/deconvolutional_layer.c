@@ -50,14 +50,16 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
     l.nbiases = n;
 
     l.weights = calloc(c*n*size*size, sizeof(float));
-    l.weight_updates = calloc(c*n*size*size, sizeof(float));
+    l.weight_updates = train_calloc(c*n*size*size, sizeof(float));
 
     l.biases = calloc(n, sizeof(float));
-    l.bias_updates = calloc(n, sizeof(float));
+    l.bias_updates = train_calloc(n, sizeof(float));
     //float scale = n/(size*size*c);
     //printf("scale: %f\n", scale);
     float scale = .02;
-    for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
+    if(init_random_weights()){
+        for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
+    }
     //bilinear_init(l);
     for(i = 0; i < n; ++i){
         l.biases[i] = 0;
@@ -73,7 +75,7 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
     scal_cpu(l.nweights, (float)l.out_w*l.out_h/(l.w*l.h), l.weights, 1);
 
     l.output = calloc(l.batch*l.outputs, sizeof(float));
-    l.delta  = calloc(l.batch*l.outputs, sizeof(float));
+    l.delta  = train_calloc(l.batch*l.outputs, sizeof(float));
 
     l.forward = forward_deconvolutional_layer;
     l.backward = backward_deconvolutional_layer;
@@ -83,7 +85,7 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
 
     if(batch_normalize){
         l.scales = calloc(n, sizeof(float));
-        l.scale_updates = calloc(n, sizeof(float));
+        l.scale_updates = train_calloc(n, sizeof(float));
         for(i = 0; i < n; ++i){
             l.scales[i] = 1;
         }
@@ -91,17 +93,17 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
         l.mean = calloc(n, sizeof(float));
         l.variance = calloc(n, sizeof(float));
 
-        l.mean_delta = calloc(n, sizeof(float));
-        l.variance_delta = calloc(n, sizeof(float));
+        l.mean_delta = train_calloc(n, sizeof(float));
+        l.variance_delta = train_calloc(n, sizeof(float));
 
         l.rolling_mean = calloc(n, sizeof(float));
         l.rolling_variance = calloc(n, sizeof(float));
-        l.x = calloc(l.batch*l.outputs, sizeof(float));
-        l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
+        l.x = train_calloc(l.batch*l.outputs, sizeof(float));
+        l.x_norm = train_calloc(l.batch*l.outputs, sizeof(float));
     }
     if(adam){
-        l.m = calloc(c*n*size*size, sizeof(float));
-        l.v = calloc(c*n*size*size, sizeof(float));
+        l.m = train_calloc(c*n*size*size, sizeof(float));
+        l.v = train_calloc(c*n*size*size, sizeof(float));
         l.bias_m = calloc(n, sizeof(float));
         l.scale_m = calloc(n, sizeof(float));
         l.bias_v = calloc(n, sizeof(float));
@@ -191,10 +193,10 @@ void resize_deconvolutional_layer(layer *l, int h, int w)
     l->inputs = l->w * l->h * l->c;
 
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
-    l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
+    l->delta  = train_realloc(l->delta,  l->batch*l->outputs*sizeof(float));
     if(l->batch_normalize){
-        l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
-        l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
+        l->x = train_realloc(l->x, l->batch*l->outputs*sizeof(float));
+        l->x_norm  = train_realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
 
 #ifdef GPU
@@ -7,36 +7,89 @@
 #include "box.h"
 #include "image.h"
 #include "demo.h"
+#include <pthread.h>
 #include <sys/time.h>
 
 #define DEMO 1
 
 #ifdef OPENCV
 
-static char **demo_names;
-static image **demo_alphabet;
-static int demo_classes;
-
-static network *net;
-static image buff [3];
-static image buff_letter[3];
-static int buff_index = 0;
-static void * cap;
-static float fps = 0;
-static float demo_thresh = 0;
-static float demo_hier = .5;
-static int running = 0;
-
-static int demo_frame = 3;
-static int demo_index = 0;
-static float **predictions;
-static float *avg;
-static int demo_done = 0;
-static int demo_total = 0;
-static double start_time = 0;
-double demo_time;
-
-detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
+/*
+ * The demo as a pipeline of long-lived threads. Capture reads frames and
+ * letterboxes their bytes straight into the network input. Inference runs
+ * the network and finds the boxes. The calling thread renders, as OpenCV
+ * windows want it to. Frames travel in a ring of depth slots that bounded
+ * queues hand from stage to stage, so each stage works on a frame of its
+ * own while the others work on theirs. Nothing is allocated or started per
+ * frame.
+ *
+ * When inference or rendering falls behind a camera, the frames waiting
+ * for them go stale. With dropping on, the default for cameras, capture
+ * takes back the oldest frame still waiting for inference when it has no
+ * free slot, and inference skips ahead to the newest waiting frame, so what
+ * is shown is never more than the ring behind the camera. Video files
+ * default to keeping every frame, capture waiting for a slot instead.
+ *
+ * Every slot carries its timestamps along, and the render thread keeps the
+ * latency of each stage and from capture to result and to display.
+ *
+ * Given a latency target, a resolution controller picks the input size
+ * each frame runs at. Slots are letterboxed for the size current when they
+ * are captured and again, from their bytes, if it has changed by the time
+ * inference takes them. The predictions averaged over frames start over
+ * when the size changes, as the old ones no longer line up.
+ *
+ * Given a motion threshold, capture scores each frame against a background
+ * model first. Frames where nothing moved skip the network: their boxes
+ * come again from the predictions the last inference left in the output
+ * layers. With crop on, frames that moved are letterboxed from just the
+ * region that changed and their boxes mapped back onto the whole frame, so
+ * only what is in that region is found. Still frames are not letterboxed
+ * either, unless inference has nothing to reuse yet.
+ */
+
+#define DEMO_AVG_FRAMES 3
+
+typedef struct{
+    byte_image frame;
+    image letter;
+    image display;
+    detection *dets;
+    int nboxes;
+    int moved;
+    box region;
+    double read, captured, ready, infer_start, inferred;
+} demo_slot;
+
+typedef struct{
+    double sum, max, recent;
+    int n;
+} demo_latency;
+
+typedef struct{
+    network *net;
+    resolution_controller *rc;
+    motion_detector *motion;
+    int crop;
+    void *cap;
+    char **names;
+    image **alphabet;
+    int classes;
+    float thresh, hier, nms;
+    int drop;
+    int depth;
+    demo_slot *slots;
+    bounded_queue *free_slots;
+    bounded_queue *captured;
+    bounded_queue *detected;
+    int done;
+    int dropped;
+    int skipped;
+    int total;
+    int avg_index;
+    float *predictions[DEMO_AVG_FRAMES];
+    float *avg;
+} demo_state;
 
 int size_network(network *net)
 {
@@ -51,186 +104,339 @@ int size_network(network *net)
     return count;
 }
 
-void remember_network(network *net)
+/* Keeps net's predictions for averaging; after a resize, in place of all the earlier ones. */
+static void remember_network(demo_state *d, network *net, int resized)
 {
-    int i;
+    int i, j;
     int count = 0;
     for(i = 0; i < net->n; ++i){
         layer l = net->layers[i];
         if(l.type == YOLO || l.type == REGION || l.type == DETECTION){
-            memcpy(predictions[demo_index] + count, net->layers[i].output, sizeof(float) * l.outputs);
+            for(j = 0; j < DEMO_AVG_FRAMES; ++j){
+                if(resized || j == d->avg_index) memcpy(d->predictions[j] + count, l.output, sizeof(float) * l.outputs);
+            }
             count += l.outputs;
         }
     }
+    d->avg_index = (d->avg_index + 1)%DEMO_AVG_FRAMES;
 }
 
-detection *avg_predictions(network *net, int *nboxes)
+static void avg_predictions(demo_state *d, network *net)
 {
     int i, j;
     int count = 0;
-    fill_cpu(demo_total, 0, avg, 1);
-    for(j = 0; j < demo_frame; ++j){
-        axpy_cpu(demo_total, 1./demo_frame, predictions[j], 1, avg, 1);
+    fill_cpu(d->total, 0, d->avg, 1);
+    for(j = 0; j < DEMO_AVG_FRAMES; ++j){
+        axpy_cpu(d->total, 1./DEMO_AVG_FRAMES, d->predictions[j], 1, d->avg, 1);
     }
     for(i = 0; i < net->n; ++i){
         layer l = net->layers[i];
         if(l.type == YOLO || l.type == REGION || l.type == DETECTION){
-            memcpy(l.output, avg + count, sizeof(float) * l.outputs);
+            memcpy(l.output, d->avg + count, sizeof(float) * l.outputs);
             count += l.outputs;
         }
     }
-    detection *dets = get_network_boxes(net, buff[0].w, buff[0].h, demo_thresh, demo_hier, 0, 1, nboxes);
+}
+
+static void add_latency(demo_latency *l, double seconds)
+{
+    double ms = 1000*seconds;
+    l->sum += ms;
+    if(ms > l->max) l->max = ms;
+    l->recent = l->n ? .9*l->recent + .1*ms : ms;
+    ++l->n;
+}
+
+/* A free slot; with dropping on, the oldest frame waiting for inference if there is none. */
+static demo_slot *take_slot(demo_state *d)
+{
+    void *slot;
+    if(d->drop){
+        if(bounded_queue_try_pop(d->free_slots, &slot)) return slot;
+        if(bounded_queue_try_pop(d->captured, &slot)){
+            __atomic_add_fetch(&d->dropped, 1, __ATOMIC_SEQ_CST);
+            return slot;
+        }
+    }
+    return bounded_queue_pop(d->free_slots);
+}
+
+static network *current_network(demo_state *d)
+{
+    return d->rc ? resolution_network(d->rc) : d->net;
+}
+
+/* The pixels of a frame w by h that region covers, region relative to the frame. */
+static void crop_region(box region, int w, int h, int *left, int *top, int *cw, int *ch)
+{
+    *left = constrain_int((region.x - region.w/2)*w + .5, 0, w - 1);
+    *top = constrain_int((region.y - region.h/2)*h + .5, 0, h - 1);
+    *cw = constrain_int(region.w*w + .5, 1, w - *left);
+    *ch = constrain_int(region.h*h + .5, 1, h - *top);
+}
+
+/* Letterboxes the slot's region of its frame for net, into the slot's buffer sized for the largest input. */
+static void letterbox_slot(demo_slot *s, network *net)
+{
+    int left, top, cw, ch;
+    byte_image f = s->frame;
+    crop_region(s->region, f.w, f.h, &left, &top, &cw, &ch);
+    s->letter.w = net->w;
+    s->letter.h = net->h;
+    letterbox_bytes_into(f.data + (size_t)top*f.step + left*f.c, cw, ch, f.c, f.step, 1, s->letter);
+}
+
+/* Boxes from the predictions net holds, for region of the slot's frame, moved onto the whole frame. */
+static detection *region_boxes(demo_state *d, network *net, demo_slot *s, box region, int *nboxes)
+{
+    int i, left, top, cw, ch;
+    crop_region(region, s->frame.w, s->frame.h, &left, &top, &cw, &ch);
+    detection *dets = get_network_boxes(net, cw, ch, d->thresh, d->hier, 0, 1, nboxes);
+    if(cw == s->frame.w && ch == s->frame.h) return dets;
+    for(i = 0; i < *nboxes; ++i){
+        box *b = &dets[i].bbox;
+        b->x = (left + b->x*cw)/s->frame.w;
+        b->y = (top + b->y*ch)/s->frame.h;
+        b->w = b->w*cw/s->frame.w;
+        b->h = b->h*ch/s->frame.h;
+    }
     return dets;
 }
 
-void *detect_in_thread(void *ptr)
+static void *capture_loop(void *ptr)
 {
-    running = 1;
-    float nms = .4;
-
-    layer l = net->layers[net->n-1];
-    float *X = buff_letter[(buff_index+2)%3].data;
-    network_predict(net, X);
-
-    /*
-       if(l.type == DETECTION){
-       get_detection_boxes(l, 1, 1, demo_thresh, probs, boxes, 0);
-       } else */
-    remember_network(net);
-    detection *dets = 0;
-    int nboxes = 0;
-    dets = avg_predictions(net, &nboxes);
-
-    if (nms > 0) do_nms_obj(dets, nboxes, l.classes, nms);
-
-    printf("\033[2J");
-    printf("\033[1;1H");
-    printf("\nFPS:%.1f\n",fps);
-    printf("Objects:\n\n");
-    image display = buff[(buff_index+2) % 3];
-    double time_index = what_time_is_it_now() - start_time;
-    char* im_name = "test";
-    if (time_index - floor(time_index) > 0.8) {
-        draw_detections(display, im_name, dets, nboxes, demo_thresh, demo_names, demo_alphabet, demo_classes, time_index);
-        free_detections(dets, nboxes);
+    demo_state *d = ptr;
+    while(!__atomic_load_n(&d->done, __ATOMIC_SEQ_CST)){
+        demo_slot *s = take_slot(d);
+        s->read = what_time_is_it_now();
+        if(!read_stream_frame(d->cap, &s->frame)){
+            bounded_queue_push(d->free_slots, s);
+            break;
+        }
+        s->captured = what_time_is_it_now();
+        s->moved = 1;
+        s->region.x = s->region.y = .5;
+        s->region.w = s->region.h = 1;
+        if(d->motion){
+            box region;
+            s->moved = detect_motion(d->motion, s->frame, &region);
+            if(d->crop && s->moved) s->region = region;
+        }
+        s->letter.w = s->letter.h = 0;
+        if(s->moved) letterbox_slot(s, current_network(d));
+        s->ready = what_time_is_it_now();
+        bounded_queue_push(d->captured, s);
     }
-    demo_index = (demo_index + 1)%demo_frame;
-    running = 0;
+    bounded_queue_push(d->captured, 0);
     return 0;
 }
 
-void *fetch_in_thread(void *ptr)
+static void *detect_loop(void *ptr)
 {
-    free_image(buff[buff_index]);
-    buff[buff_index] = get_image_from_stream(cap);
-    if(buff[buff_index].data == 0) {
-        demo_done = 1;
-        return 0;
+    demo_state *d = ptr;
+    layer l = d->net->layers[d->net->n-1];
+    demo_slot *s;
+    int end = 0;
+    int resized = 0;
+    int inferred = 0;
+    box region = {0};
+    network *last = 0;
+    while(!end && (s = bounded_queue_pop(d->captured))){
+        void *newer;
+        while(d->drop && bounded_queue_try_pop(d->captured, &newer)){
+            if(!newer){
+                end = 1;
+                break;
+            }
+            bounded_queue_push(d->free_slots, s);
+            __atomic_add_fetch(&d->dropped, 1, __ATOMIC_SEQ_CST);
+            s = newer;
+        }
+        network *net = current_network(d);
+        s->infer_start = what_time_is_it_now();
+        int infer = s->moved || !inferred;
+        if(infer){
+            int recropped = region.x != s->region.x || region.y != s->region.y || region.w != s->region.w || region.h != s->region.h;
+            if(s->letter.w != net->w || s->letter.h != net->h) letterbox_slot(s, net);
+            network_predict(net, s->letter.data);
+            remember_network(d, net, resized || (inferred && recropped));
+            avg_predictions(d, net);
+            region = s->region;
+            last = net;
+            inferred = 1;
+        } else {
+            __atomic_add_fetch(&d->skipped, 1, __ATOMIC_SEQ_CST);
+        }
+        /* The outputs are laid out for the view that wrote them, which a resize since may not be. */
+        s->dets = region_boxes(d, last, s, region, &s->nboxes);
+        if(d->nms > 0) do_nms_obj(s->dets, s->nboxes, l.classes, d->nms);
+        s->inferred = what_time_is_it_now();
+        if(infer) resized = d->rc && control_resolution(d->rc, 1000*(s->inferred - s->infer_start));
+        bounded_queue_push(d->detected, s);
     }
-    letterbox_image_into(buff[buff_index], net->w, net->h, buff_letter[buff_index]);
+    bounded_queue_push(d->detected, 0);
     return 0;
 }
 
-void *display_in_thread(void *ptr)
+static int handle_key(demo_state *d, int c)
 {
-    int c = show_image(buff[(buff_index + 1)%3], "Demo", 1);
     if (c != -1) c = c%256;
     if (c == 27) {
-        demo_done = 1;
-        return 0;
+        return 1;
     } else if (c == 82) {
-        demo_thresh += .02;
+        d->thresh += .02;
     } else if (c == 84) {
-        demo_thresh -= .02;
-        if(demo_thresh <= .02) demo_thresh = .02;
+        d->thresh -= .02;
+        if(d->thresh <= .02) d->thresh = .02;
     } else if (c == 83) {
-        demo_hier += .02;
+        d->hier += .02;
     } else if (c == 81) {
-        demo_hier -= .02;
-        if(demo_hier <= .0) demo_hier = .0;
+        d->hier -= .02;
+        if(d->hier <= .0) d->hier = .0;
     }
     return 0;
 }
 
-void *display_loop(void *ptr)
+void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int delay, char *prefix, int avg_frames, float hier, int w, int h, int frames, int fullscreen, int depth, int drop, float slo, char *sizes, float motion, int crop)
 {
-    while(1){
-        display_in_thread(0);
+    int i;
+    demo_state d = {0};
+    d.alphabet = load_alphabet();
+    d.names = names;
+    d.classes = classes;
+    d.thresh = thresh;
+    d.hier = hier;
+    d.nms = .4;
+    printf("Demo\n");
+    d.net = load_network_inference(cfgfile, weightfile);
+    set_batch_network(d.net, 1);
+    if(slo > 0){
+        int n = 0;
+        int *widths = sizes ? read_intlist(sizes, &n, 0) : 0;
+        d.rc = make_resolution_controller(d.net, widths, n, slo);
+        free(widths);
     }
-}
-
-void *detect_loop(void *ptr)
-{
-    while(1){
-        detect_in_thread(0);
+    if(motion > 0){
+        d.motion = make_motion_detector(motion);
+        d.crop = crop;
     }
-}
-
-void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int delay, char *prefix, int avg_frames, float hier, int w, int h, int frames, int fullscreen)
-{
-    //demo_frame = avg_frames;
-    image **alphabet = load_alphabet();
-    demo_names = names;
-    demo_alphabet = alphabet;
-    demo_classes = classes;
-    demo_thresh = thresh;
-    demo_hier = hier;
-    printf("Demo\n");
-    net = load_network(cfgfile, weightfile, 0);
-    set_batch_network(net, 1);
-    pthread_t detect_thread;
-    pthread_t fetch_thread;
 
     srand(2222222);
 
-    int i;
-    demo_total = size_network(net);
-    predictions = calloc(demo_frame, sizeof(float*));
-    for (i = 0; i < demo_frame; ++i){
-        predictions[i] = calloc(demo_total, sizeof(float));
+    d.total = size_network(d.net);
+    for (i = 0; i < DEMO_AVG_FRAMES; ++i){
+        d.predictions[i] = calloc(d.total, sizeof(float));
     }
-    avg = calloc(demo_total, sizeof(float));
+    d.avg = calloc(d.total, sizeof(float));
 
     if(filename){
         printf("video file: %s\n", filename);
-        cap = open_video_stream(filename, 0, 0, 0, 0);
+        d.cap = open_video_stream(filename, 0, 0, 0, 0);
     }else{
-        cap = open_video_stream(0, cam_index, w, h, frames);
+        d.cap = open_video_stream(0, cam_index, w, h, frames);
     }
 
-    if(!cap) error("Couldn't connect to webcam.\n");
-
-    buff[0] = get_image_from_stream(cap);
-    buff[1] = copy_image(buff[0]);
-    buff[2] = copy_image(buff[0]);
-    buff_letter[0] = letterbox_image(buff[0], net->w, net->h);
-    buff_letter[1] = letterbox_image(buff[0], net->w, net->h);
-    buff_letter[2] = letterbox_image(buff[0], net->w, net->h);
+    if(!d.cap) error("Couldn't connect to webcam.\n");
+
+    d.depth = depth < 1 ? 1 : depth;
+    d.drop = drop < 0 ? !filename : drop;
+    d.slots = calloc(d.depth, sizeof(demo_slot));
+    d.free_slots = make_bounded_queue(d.depth);
+    d.captured = make_bounded_queue(d.depth + 1);
+    d.detected = make_bounded_queue(d.depth + 1);
+    for(i = 0; i < d.depth; ++i){
+        d.slots[i].letter = make_image(d.net->w, d.net->h, d.net->c);
+        bounded_queue_push(d.free_slots, d.slots + i);
+    }
 
-    int count = 0;
     if(!prefix){
         make_window("Demo", 1352, 1013, fullscreen);
     }
 
-    demo_time = start_time = what_time_is_it_now();
-
-    while(!demo_done){
-        buff_index = (buff_index + 1) %3;
-        if(pthread_create(&fetch_thread, 0, fetch_in_thread, 0)) error("Thread creation failed");
-        if(pthread_create(&detect_thread, 0, detect_in_thread, 0)) error("Thread creation failed");
-        if(!prefix){
-            fps = 1./(what_time_is_it_now() - demo_time);
-            demo_time = what_time_is_it_now();
-            display_in_thread(0);
-        }else{
-            char name[256];
-            sprintf(name, "%s_%08d", prefix, count);
-            save_image(buff[(buff_index + 1)%3], name);
+    pthread_t capture_thread;
+    pthread_t detect_thread;
+    if(pthread_create(&capture_thread, 0, capture_loop, &d)) error("Thread creation failed");
+    if(pthread_create(&detect_thread, 0, detect_loop, &d)) error("Thread creation failed");
+
+    demo_latency capture = {0}, queued = {0}, inference = {0}, render = {0}, result = {0}, shown = {0};
+    double start_time = what_time_is_it_now();
+    double last = start_time;
+    float fps = 0;
+    int count = 0;
+    demo_slot *s;
+    while((s = bounded_queue_pop(d.detected))){
+        if(!d.done){
+            double render_start = what_time_is_it_now();
+            fps = 1./(render_start - last);
+            last = render_start;
+            image *display = &s->display;
+            if(display->w != s->frame.w || display->h != s->frame.h || display->c != s->frame.c){
+                free_image(*display);
+                *display = make_image(s->frame.w, s->frame.h, s->frame.c);
+            }
+            bytes_to_image(s->frame.data, s->frame.step, 1, *display);
+
+            printf("\033[2J");
+            printf("\033[1;1H");
+            printf("\nFPS:%.1f\n", fps);
+            printf("Latency (ms): capture %.1f, queued %.1f, inference %.1f, render %.1f, capture to result %.1f, to display %.1f\n",
+                    capture.recent, queued.recent, inference.recent, render.recent, result.recent, shown.recent);
+            printf("Dropped: %d\n", __atomic_load_n(&d.dropped, __ATOMIC_SEQ_CST));
+            if(d.motion) printf("Still, not inferred: %d\n", __atomic_load_n(&d.skipped, __ATOMIC_SEQ_CST));
+            if(d.rc) printf("Input: %dx%d for %.0f ms\n", resolution_network(d.rc)->w, resolution_network(d.rc)->h, slo);
+            printf("Objects:\n\n");
+            double time_index = render_start - start_time;
+            char* im_name = "test";
+            if (time_index - floor(time_index) > 0.8) {
+                draw_detections(*display, im_name, s->dets, s->nboxes, d.thresh, d.names, d.alphabet, d.classes, time_index);
+            }
+            if(!prefix){
+                if(handle_key(&d, show_image(*display, "Demo", 1))){
+                    __atomic_store_n(&d.done, 1, __ATOMIC_SEQ_CST);
+                }
+            }else{
+                char name[256];
+                sprintf(name, "%s_%08d", prefix, count);
+                save_image(*display, name);
+            }
+            double rendered = what_time_is_it_now();
+            add_latency(&capture, s->ready - s->read);
+            add_latency(&queued, s->infer_start - s->ready);
+            add_latency(&inference, s->inferred - s->infer_start);
+            add_latency(&render, rendered - render_start);
+            add_latency(&result, s->inferred - s->captured);
+            add_latency(&shown, rendered - s->captured);
+            ++count;
         }
-        pthread_join(fetch_thread, 0);
-        pthread_join(detect_thread, 0);
-        ++count;
+        free_detections(s->dets, s->nboxes);
+        s->dets = 0;
+        bounded_queue_push(d.free_slots, s);
+    }
+    pthread_join(capture_thread, 0);
+    pthread_join(detect_thread, 0);
+    close_video_stream(d.cap);
+
+    double elapsed = what_time_is_it_now() - start_time;
+    fprintf(stderr, "Demo: %d frames shown in %.2f seconds, %.1f FPS, %d dropped, %d still\n", count, elapsed, count/elapsed, d.dropped, d.skipped);
+    demo_latency *stats[] = {&capture, &queued, &inference, &render, &result, &shown};
+    char *labels[] = {"capture", "queued", "inference", "render", "capture to result", "capture to display"};
+    for(i = 0; i < (int)(sizeof(stats)/sizeof(stats[0])); ++i){
+        if(stats[i]->n) fprintf(stderr, "%18s: %7.1f ms mean, %7.1f ms max\n", labels[i], stats[i]->sum/stats[i]->n, stats[i]->max);
+    }
+
+    for(i = 0; i < d.depth; ++i){
+        free_byte_image(d.slots[i].frame);
+        free_image(d.slots[i].letter);
+        free_image(d.slots[i].display);
     }
+    free(d.slots);
+    free_bounded_queue(d.free_slots);
+    free_bounded_queue(d.captured);
+    free_bounded_queue(d.detected);
+    for (i = 0; i < DEMO_AVG_FRAMES; ++i) free(d.predictions[i]);
+    free(d.avg);
+    free_resolution_controller(d.rc);
+    free_motion_detector(d.motion);
 }
 
 /*
@@ -323,7 +529,7 @@ pthread_join(detect_thread, 0);
 }
 */
 #else
-void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int delay, char *prefix, int avg, float hier, int w, int h, int frames, int fullscreen)
+void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const char *filename, char **names, int classes, int delay, char *prefix, int avg, float hier, int w, int h, int frames, int fullscreen, int depth, int drop, float slo, char *sizes, float motion, int crop)
 {
     fprintf(stderr, "Demo needs OpenCV for webcam images.\n");
 }
@@ -1,8 +1,11 @@
 #include "gemm.h"
 #include "utils.h"
+#include "activations.h"
+#include "parallel.h"
 #include "cuda.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
@@ -77,7 +80,6 @@ void gemm_nn(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(k = 0; k < K; ++k){
             register float A_PART = ALPHA*A[i*lda+k];
@@ -94,7 +96,6 @@ void gemm_nt(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(j = 0; j < N; ++j){
             register float sum = 0;
@@ -112,7 +113,6 @@ void gemm_tn(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(k = 0; k < K; ++k){
             register float A_PART = ALPHA*A[k*lda+i];
@@ -129,7 +129,6 @@ void gemm_tt(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(j = 0; j < N; ++j){
             register float sum = 0;
@@ -142,6 +141,469 @@ void gemm_tt(int M, int N, int K, float ALPHA,
 }
 
 
+/*
+ * Packed, cache-blocked SGEMM.
+ *
+ * C is walked in NC wide column blocks, K in KC deep slices and A in MC
+ * tall row blocks (the usual Goto/BLIS loop order).  Each KC x NC slice of
+ * B is packed into NR wide panels that stay in L3, the matching KC deep
+ * slice of A is packed into MR tall panels of which one MC block stays in
+ * L2, and a register-blocked MR x NR micro-kernel streams one panel of each
+ * out of L1.  Packing also takes care of the transposes and folds ALPHA
+ * into A, so every kernel only ever computes C += A*B on contiguous memory.
+ * Packing and the MC x column-chunk tiles of C are spread over the thread
+ * pool.
+ *
+ * The micro-kernel is picked once at runtime from what the CPU supports, so
+ * a generic build still uses AVX-512 / AVX2 / SSE when they are available.
+ */
+
+typedef void (*gemm_micro_kernel)(int k, const float *a, const float *b, float *c, int ldc);
+
+typedef struct {
+    const char *name;
+    int mr, nr;
+    int mc, kc, nc;
+    gemm_micro_kernel kernel;
+} gemm_kernel;
+
+static void micro_kernel_generic(int k, const float *a, const float *b, float *c, int ldc)
+{
+    float acc[4][4] = {{0}};
+    int i, j, p;
+    for(p = 0; p < k; ++p){
+        for(i = 0; i < 4; ++i){
+            for(j = 0; j < 4; ++j){
+                acc[i][j] += a[i]*b[j];
+            }
+        }
+        a += 4;
+        b += 4;
+    }
+    for(i = 0; i < 4; ++i){
+        for(j = 0; j < 4; ++j){
+            c[i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+
+__attribute__((target("sse4.1")))
+static void micro_kernel_sse_4x8(int k, const float *a, const float *b, float *c, int ldc)
+{
+    __m128 c00 = _mm_loadu_ps(c + 0*ldc), c01 = _mm_loadu_ps(c + 0*ldc + 4);
+    __m128 c10 = _mm_loadu_ps(c + 1*ldc), c11 = _mm_loadu_ps(c + 1*ldc + 4);
+    __m128 c20 = _mm_loadu_ps(c + 2*ldc), c21 = _mm_loadu_ps(c + 2*ldc + 4);
+    __m128 c30 = _mm_loadu_ps(c + 3*ldc), c31 = _mm_loadu_ps(c + 3*ldc + 4);
+    int p;
+    for(p = 0; p < k; ++p){
+        __m128 b0 = _mm_loadu_ps(b);
+        __m128 b1 = _mm_loadu_ps(b + 4);
+        __m128 a0 = _mm_set1_ps(a[0]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(a0, b0));
+        c01 = _mm_add_ps(c01, _mm_mul_ps(a0, b1));
+        a0 = _mm_set1_ps(a[1]);
+        c10 = _mm_add_ps(c10, _mm_mul_ps(a0, b0));
+        c11 = _mm_add_ps(c11, _mm_mul_ps(a0, b1));
+        a0 = _mm_set1_ps(a[2]);
+        c20 = _mm_add_ps(c20, _mm_mul_ps(a0, b0));
+        c21 = _mm_add_ps(c21, _mm_mul_ps(a0, b1));
+        a0 = _mm_set1_ps(a[3]);
+        c30 = _mm_add_ps(c30, _mm_mul_ps(a0, b0));
+        c31 = _mm_add_ps(c31, _mm_mul_ps(a0, b1));
+        a += 4;
+        b += 8;
+    }
+    _mm_storeu_ps(c + 0*ldc, c00); _mm_storeu_ps(c + 0*ldc + 4, c01);
+    _mm_storeu_ps(c + 1*ldc, c10); _mm_storeu_ps(c + 1*ldc + 4, c11);
+    _mm_storeu_ps(c + 2*ldc, c20); _mm_storeu_ps(c + 2*ldc + 4, c21);
+    _mm_storeu_ps(c + 3*ldc, c30); _mm_storeu_ps(c + 3*ldc + 4, c31);
+}
+
+__attribute__((target("avx2,fma")))
+static void micro_kernel_avx2_6x16(int k, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_loadu_ps(c + 0*ldc), c01 = _mm256_loadu_ps(c + 0*ldc + 8);
+    __m256 c10 = _mm256_loadu_ps(c + 1*ldc), c11 = _mm256_loadu_ps(c + 1*ldc + 8);
+    __m256 c20 = _mm256_loadu_ps(c + 2*ldc), c21 = _mm256_loadu_ps(c + 2*ldc + 8);
+    __m256 c30 = _mm256_loadu_ps(c + 3*ldc), c31 = _mm256_loadu_ps(c + 3*ldc + 8);
+    __m256 c40 = _mm256_loadu_ps(c + 4*ldc), c41 = _mm256_loadu_ps(c + 4*ldc + 8);
+    __m256 c50 = _mm256_loadu_ps(c + 5*ldc), c51 = _mm256_loadu_ps(c + 5*ldc + 8);
+    int p;
+    for(p = 0; p < k; ++p){
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        __m256 a0 = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(a0, b0, c00);
+        c01 = _mm256_fmadd_ps(a0, b1, c01);
+        a0 = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(a0, b0, c10);
+        c11 = _mm256_fmadd_ps(a0, b1, c11);
+        a0 = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(a0, b0, c20);
+        c21 = _mm256_fmadd_ps(a0, b1, c21);
+        a0 = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(a0, b0, c30);
+        c31 = _mm256_fmadd_ps(a0, b1, c31);
+        a0 = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(a0, b0, c40);
+        c41 = _mm256_fmadd_ps(a0, b1, c41);
+        a0 = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(a0, b0, c50);
+        c51 = _mm256_fmadd_ps(a0, b1, c51);
+        a += 6;
+        b += 16;
+    }
+    _mm256_storeu_ps(c + 0*ldc, c00); _mm256_storeu_ps(c + 0*ldc + 8, c01);
+    _mm256_storeu_ps(c + 1*ldc, c10); _mm256_storeu_ps(c + 1*ldc + 8, c11);
+    _mm256_storeu_ps(c + 2*ldc, c20); _mm256_storeu_ps(c + 2*ldc + 8, c21);
+    _mm256_storeu_ps(c + 3*ldc, c30); _mm256_storeu_ps(c + 3*ldc + 8, c31);
+    _mm256_storeu_ps(c + 4*ldc, c40); _mm256_storeu_ps(c + 4*ldc + 8, c41);
+    _mm256_storeu_ps(c + 5*ldc, c50); _mm256_storeu_ps(c + 5*ldc + 8, c51);
+}
+
+__attribute__((target("avx512f")))
+static void micro_kernel_avx512_8x32(int k, const float *a, const float *b, float *c, int ldc)
+{
+    __m512 acc[8][2];
+    int i, p;
+    for(i = 0; i < 8; ++i){
+        acc[i][0] = _mm512_loadu_ps(c + i*ldc);
+        acc[i][1] = _mm512_loadu_ps(c + i*ldc + 16);
+    }
+    for(p = 0; p < k; ++p){
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        for(i = 0; i < 8; ++i){
+            __m512 a0 = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(a0, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(a0, b1, acc[i][1]);
+        }
+        a += 8;
+        b += 32;
+    }
+    for(i = 0; i < 8; ++i){
+        _mm512_storeu_ps(c + i*ldc, acc[i][0]);
+        _mm512_storeu_ps(c + i*ldc + 16, acc[i][1]);
+    }
+}
+#endif
+
+/* name, MR, NR, MC (L2), KC (L1), NC (L3) */
+static gemm_kernel gemm_kernels[] = {
+#ifdef GEMM_X86
+    {"avx512", 8, 32, 128, 256, 3072, micro_kernel_avx512_8x32},
+    {"avx2",   6, 16, 144, 256, 4080, micro_kernel_avx2_6x16},
+    {"sse4",   4,  8, 128, 256, 2048, micro_kernel_sse_4x8},
+#endif
+    {"generic", 4, 4,  64, 256, 1024, micro_kernel_generic},
+};
+
+static gemm_kernel *gemm_selected = 0;
+
+static gemm_kernel *select_gemm_kernel()
+{
+    if(gemm_selected) return gemm_selected;
+    gemm_kernel *k = &gemm_kernels[sizeof(gemm_kernels)/sizeof(gemm_kernels[0]) - 1];
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) k = &gemm_kernels[0];
+    else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) k = &gemm_kernels[1];
+    else if(__builtin_cpu_supports("sse4.1")) k = &gemm_kernels[2];
+#endif
+    gemm_selected = k;
+    return k;
+}
+
+const char *gemm_kernel_name()
+{
+    return select_gemm_kernel()->name;
+}
+
+static float *gemm_scratch(float **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        free(*buf);
+        *buf = 0;
+        if(posix_memalign((void **)buf, 64, n*sizeof(float))) malloc_error();
+        *size = n;
+    }
+    return *buf;
+}
+
+/* Packs A[i0:i0+mc, p0:p0+kc] into MR tall panels, k-major inside a panel. */
+static void pack_a(int TA, int mc, int kc, float ALPHA, float *A, int lda, int mr, float *pa)
+{
+    int i, p, ir;
+    for(ir = 0; ir < mc; ir += mr){
+        int m = (mc - ir < mr) ? mc - ir : mr;
+        for(p = 0; p < kc; ++p){
+            if(!TA){
+                for(i = 0; i < m; ++i) pa[i] = ALPHA*A[(ir+i)*lda + p];
+            } else {
+                float *a = A + p*lda + ir;
+                for(i = 0; i < m; ++i) pa[i] = ALPHA*a[i];
+            }
+            for(; i < mr; ++i) pa[i] = 0;
+            pa += mr;
+        }
+    }
+}
+
+/*
+ * Implicit GEMM operand: B is the im2col matrix of a CHW image, one row per
+ * (channel, ky, kx) and one column per output pixel.  It is never stored;
+ * pack_b_im2col gathers the needed rows straight from the image instead.
+ */
+typedef struct {
+    float *im;
+    int channels, height, width;
+    int ksize, stride, pad;
+    int out_w;
+} im2col_source;
+
+/* Packs rows [p0, p0+kc) and columns [j0, j0+nc) of im2col(im) into NR wide panels. */
+static void pack_b_im2col(const im2col_source *s, int p0, int kc, int j0, int nc, int nr, float *pb)
+{
+    int j, p, q, jr;
+    int ks = s->ksize, w = s->width, h = s->height, stride = s->stride;
+    for(jr = 0; jr < nc; jr += nr){
+        int n = (nc - jr < nr) ? nc - jr : nr;
+        int oy0 = (j0 + jr) / s->out_w;
+        int ox0 = (j0 + jr) % s->out_w;
+        for(p = 0; p < kc; ++p){
+            int r = p0 + p;
+            int kx = r % ks;
+            int ky = (r / ks) % ks;
+            float *im = s->im + (r / ks / ks)*h*w;
+            int oy = oy0, ox = ox0;
+            /* Walk the panel one output row at a time so stride 1 rows are plain copies. */
+            for(j = 0; j < n; j += q){
+                int run = (s->out_w - ox < n - j) ? s->out_w - ox : n - j;
+                int iy = oy*stride + ky - s->pad;
+                int ix = ox*stride + kx - s->pad;
+                float *out = pb + j;
+                if(iy < 0 || iy >= h){
+                    for(q = 0; q < run; ++q) out[q] = 0;
+                } else if(stride == 1){
+                    float *row = im + iy*w;
+                    int lim = (w - ix < run) ? w - ix : run;
+                    for(q = 0; q < run && ix + q < 0; ++q) out[q] = 0;
+                    for(; q < lim; ++q) out[q] = row[ix + q];
+                    for(; q < run; ++q) out[q] = 0;
+                } else {
+                    float *row = im + iy*w;
+                    for(q = 0; q < run; ++q, ix += stride) out[q] = (ix >= 0 && ix < w) ? row[ix] : 0;
+                }
+                ox = 0;
+                ++oy;
+            }
+            for(; j < nr; ++j) pb[j] = 0;
+            pb += nr;
+        }
+    }
+}
+
+/* Packs B[p0:p0+kc, j0:j0+nc] into NR wide panels, k-major inside a panel. */
+static void pack_b(int TB, int kc, int nc, float *B, int ldb, int nr, float *pb)
+{
+    int j, p, jr;
+    for(jr = 0; jr < nc; jr += nr){
+        int n = (nc - jr < nr) ? nc - jr : nr;
+        for(p = 0; p < kc; ++p){
+            if(!TB){
+                float *b = B + p*ldb + jr;
+                for(j = 0; j < n; ++j) pb[j] = b[j];
+            } else {
+                for(j = 0; j < n; ++j) pb[j] = B[(jr+j)*ldb + p];
+            }
+            for(; j < nr; ++j) pb[j] = 0;
+            pb += nr;
+        }
+    }
+}
+
+void gemm_epilogue_apply(const gemm_epilogue *ep, int row, size_t offset, float *C, int n)
+{
+    int j;
+    float *c = C + offset;
+    float bias = ep->bias ? ep->bias[row] : 0;
+    for(j = 0; j < n; ++j) c[j] += bias;
+    if(ep->activation == LEAKY){
+        for(j = 0; j < n; ++j) c[j] = (c[j] > 0) ? c[j] : .1f*c[j];
+    } else if(ep->activation == RELU){
+        for(j = 0; j < n; ++j) c[j] = (c[j] > 0) ? c[j] : 0;
+    } else if(ep->activation != LINEAR){
+        activate_array(c, n, ep->activation);
+    }
+    if(!ep->add) return;
+    float *add = ep->add + offset;
+    for(j = 0; j < n; ++j) c[j] = ep->alpha*c[j] + ep->beta*add[j];
+    if(ep->add_activation != LINEAR) activate_array(c, n, ep->add_activation);
+}
+
+/* C here is the tile's corner; row0 and offset locate it in the whole of C for ep. */
+static void gemm_macro_kernel(gemm_kernel *gk, int mc, int nc, int kc, float *pa, float *pb, float *C, int ldc,
+        const gemm_epilogue *ep, int row0, size_t offset)
+{
+    float tile[16*32];
+    int mr = gk->mr, nr = gk->nr;
+    int ir, jr, i, j;
+    for(jr = 0; jr < nc; jr += nr){
+        int n = (nc - jr < nr) ? nc - jr : nr;
+        for(ir = 0; ir < mc; ir += mr){
+            int m = (mc - ir < mr) ? mc - ir : mr;
+            float *a = pa + ir*kc;
+            float *b = pb + jr*kc;
+            float *c = C + ir*ldc + jr;
+            if(m == mr && n == nr){
+                gk->kernel(kc, a, b, c, ldc);
+            } else {
+                memset(tile, 0, mr*nr*sizeof(float));
+                gk->kernel(kc, a, b, tile, nr);
+                for(i = 0; i < m; ++i){
+                    for(j = 0; j < n; ++j){
+                        c[i*ldc + j] += tile[i*nr + j];
+                    }
+                }
+            }
+            if(ep){
+                for(i = 0; i < m; ++i){
+                    gemm_epilogue_apply(ep, row0 + ir + i, offset + (size_t)(ir + i)*ldc + jr, C - offset, n);
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    gemm_kernel *gk;
+    int TA, TB;
+    float ALPHA;
+    float *A; int lda;
+    float *B; int ldb;
+    float *C; int ldc;
+    int M, jc, nc, pc, kc;
+    int col_chunk, col_chunks;
+    float *packed_a, *packed_b;
+    float *prepacked_a;
+    im2col_source *im2col;
+    const gemm_epilogue *ep;
+    int last;
+} gemm_args;
+
+static void pack_a_panels(int start, int end, void *ptr)
+{
+    gemm_args g = *(gemm_args *)ptr;
+    int i0 = start*g.gk->mr;
+    int i1 = (end*g.gk->mr < g.M) ? end*g.gk->mr : g.M;
+    float *a = g.TA ? g.A + g.pc*g.lda + i0 : g.A + i0*g.lda + g.pc;
+    pack_a(g.TA, i1 - i0, g.kc, g.ALPHA, a, g.lda, g.gk->mr, g.packed_a + i0*g.kc);
+}
+
+static void pack_b_panels(int start, int end, void *ptr)
+{
+    gemm_args g = *(gemm_args *)ptr;
+    int j0 = start*g.gk->nr;
+    int j1 = (end*g.gk->nr < g.nc) ? end*g.gk->nr : g.nc;
+    if(g.im2col){
+        pack_b_im2col(g.im2col, g.pc, g.kc, g.jc + j0, j1 - j0, g.gk->nr, g.packed_b + j0*g.kc);
+        return;
+    }
+    float *b = g.TB ? g.B + (g.jc + j0)*g.ldb + g.pc : g.B + g.pc*g.ldb + g.jc + j0;
+    pack_b(g.TB, g.kc, j1 - j0, b, g.ldb, g.gk->nr, g.packed_b + j0*g.kc);
+}
+
+/* One task is an MC x col_chunk tile of C; tiles sharing an A block are adjacent. */
+static void gemm_tiles(int start, int end, void *ptr)
+{
+    gemm_args g = *(gemm_args *)ptr;
+    int t;
+    for(t = start; t < end; ++t){
+        int ic = (t / g.col_chunks)*g.gk->mc;
+        int j0 = (t % g.col_chunks)*g.col_chunk;
+        int mc = (g.M - ic < g.gk->mc) ? g.M - ic : g.gk->mc;
+        int nc = (g.nc - j0 < g.col_chunk) ? g.nc - j0 : g.col_chunk;
+        size_t offset = (size_t)ic*g.ldc + g.jc + j0;
+        gemm_macro_kernel(g.gk, mc, nc, g.kc, g.packed_a + ic*g.kc, g.packed_b + j0*g.kc, g.C + offset, g.ldc,
+                g.last ? g.ep : 0, ic, offset);
+    }
+}
+
+/* Runs C += op(A)*op(B) for the operands described in g (C, M and one A and one B source set). */
+static void gemm_packed(gemm_args g, int N, int K)
+{
+    static __thread float *pa = 0, *pb = 0;
+    static __thread size_t pa_size = 0, pb_size = 0;
+    gemm_kernel *gk = select_gemm_kernel();
+    int mr = gk->mr, nr = gk->nr;
+    int M = g.M;
+    int m_panels = (M + mr - 1)/mr;
+    int nc_max = (N < gk->nc) ? N : gk->nc;
+    int kc_max = (K < gk->kc) ? K : gk->kc;
+    int m_blocks = (M + gk->mc - 1)/gk->mc;
+    int threads = get_num_threads();
+
+    g.gk = gk;
+    if(!g.prepacked_a) g.packed_a = gemm_scratch(&pa, &pa_size, (size_t)kc_max*m_panels*mr);
+    g.packed_b = gemm_scratch(&pb, &pb_size, (size_t)kc_max*((nc_max + nr - 1)/nr*nr));
+
+    for(g.jc = 0; g.jc < N; g.jc += gk->nc){
+        g.nc = (N - g.jc < gk->nc) ? N - g.jc : gk->nc;
+
+        /* Split columns so there are a few tiles per thread to balance. */
+        int chunks = (4*threads + m_blocks - 1)/m_blocks;
+        int panels = (g.nc + nr - 1)/nr;
+        g.col_chunk = (panels + chunks - 1)/chunks*nr;
+        g.col_chunks = (g.nc + g.col_chunk - 1)/g.col_chunk;
+
+        for(g.pc = 0; g.pc < K; g.pc += gk->kc){
+            g.kc = (K - g.pc < gk->kc) ? K - g.pc : gk->kc;
+            g.last = g.pc + g.kc >= K;
+            parallel_for(panels, 4, pack_b_panels, &g);
+            if(g.prepacked_a) g.packed_a = g.prepacked_a + (size_t)g.pc*m_panels*mr;
+            else parallel_for(m_panels, 4, pack_a_panels, &g);
+            parallel_for(m_blocks*g.col_chunks, 1, gemm_tiles, &g);
+        }
+    }
+}
+
+size_t gemm_packed_size(int M, int K)
+{
+    gemm_kernel *gk = select_gemm_kernel();
+    return (size_t)(M + gk->mr - 1)/gk->mr*gk->mr*K;
+}
+
+void gemm_pack(int TA, int M, int K, float *A, int lda, float *packed)
+{
+    gemm_kernel *gk = select_gemm_kernel();
+    int m_panels = (M + gk->mr - 1)/gk->mr;
+    gemm_args g = {0};
+    g.gk = gk;
+    g.TA = TA; g.ALPHA = 1;
+    g.A = A; g.lda = lda;
+    g.M = M;
+    for(g.pc = 0; g.pc < K; g.pc += gk->kc){
+        g.kc = (K - g.pc < gk->kc) ? K - g.pc : gk->kc;
+        g.packed_a = packed + (size_t)g.pc*m_panels*gk->mr;
+        parallel_for(m_panels, 4, pack_a_panels, &g);
+    }
+}
+
+static void scale_c(int M, int N, float BETA, float *C, int ldc)
+{
+    int i, j;
+    if(BETA == 1) return;
+    for(i = 0; i < M; ++i){
+        for(j = 0; j < N; ++j){
+            C[i*ldc + j] *= BETA;
+        }
+    }
+}
+
 void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
@@ -149,20 +611,108 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
-    int i, j;
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            C[i*ldc + j] *= BETA;
-        }
+    scale_c(M, N, BETA, C, ldc);
+    if(M <= 0 || N <= 0 || K <= 0) return;
+
+    /* Packing is not worth it for tiny products. */
+    if((double)M*N*K < 4096){
+        if(!TA && !TB)
+            gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+        else if(TA && !TB)
+            gemm_tn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+        else if(!TA && TB)
+            gemm_nt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+        else
+            gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+        return;
     }
-    if(!TA && !TB)
-        gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(TA && !TB)
-        gemm_tn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(!TA && TB)
-        gemm_nt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else
-        gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+    gemm_args g = {0};
+    g.TA = TA; g.TB = TB; g.ALPHA = ALPHA;
+    g.A = A; g.lda = lda;
+    g.B = B; g.ldb = ldb;
+    g.C = C; g.ldc = ldc;
+    g.M = M;
+    gemm_packed(g, N, K);
+}
+
+void gemm_prepacked(int M, int N, int K,
+        float *packed_a,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc, const gemm_epilogue *ep)
+{
+    scale_c(M, N, BETA, C, ldc);
+    if(M <= 0 || N <= 0 || K <= 0) return;
+    gemm_args g = {0};
+    g.prepacked_a = packed_a;
+    g.B = B; g.ldb = ldb;
+    g.C = C; g.ldc = ldc;
+    g.M = M;
+    g.ep = ep;
+    gemm_packed(g, N, K);
+}
+
+void gemm_fused(int M, int N, int K,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc, const gemm_epilogue *ep)
+{
+    int i;
+    if(M <= 0 || N <= 0 || K <= 0) return;
+    if((double)M*N*K < 4096){
+        gemm_nn(M, N, K, 1, A, lda, B, ldb, C, ldc);
+        for(i = 0; i < M && ep; ++i) gemm_epilogue_apply(ep, i, (size_t)i*ldc, C, N);
+        return;
+    }
+    gemm_args g = {0};
+    g.ALPHA = 1;
+    g.A = A; g.lda = lda;
+    g.B = B; g.ldb = ldb;
+    g.C = C; g.ldc = ldc;
+    g.M = M;
+    g.ep = ep;
+    gemm_packed(g, N, K);
+}
+
+static void im2col_packed(gemm_args g,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad)
+{
+    im2col_source src = {im, channels, height, width, ksize, stride, pad};
+    int out_h = (height + 2*pad - ksize) / stride + 1;
+    src.out_w = (width + 2*pad - ksize) / stride + 1;
+    if(g.M <= 0 || out_h <= 0 || src.out_w <= 0) return;
+    g.im2col = &src;
+    gemm_packed(g, out_h*src.out_w, channels*ksize*ksize);
+}
+
+void gemm_im2col(int M, float ALPHA,
+        float *A, int lda,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *ep)
+{
+    gemm_args g = {0};
+    g.ALPHA = ALPHA;
+    g.A = A; g.lda = lda;
+    g.C = C; g.ldc = ldc;
+    g.M = M;
+    g.ep = ep;
+    im2col_packed(g, im, channels, height, width, ksize, stride, pad);
+}
+
+void gemm_im2col_prepacked(int M,
+        float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *ep)
+{
+    gemm_args g = {0};
+    g.prepacked_a = packed_a;
+    g.C = C; g.ldc = ldc;
+    g.M = M;
+    g.ep = ep;
+    im2col_packed(g, im, channels, height, width, ksize, stride, pad);
 }
 
 #ifdef GPU
@@ -1,5 +1,23 @@
 #ifndef GEMM_H
 #define GEMM_H
+#include <stddef.h>
+#include "darknet.h"
+
+/*
+ * Work done on each finished tile of C while it is still in cache:
+ * C = activation(C + bias[row]), then, when add is set (a residual with
+ * C's shape and ldc), C = add_activation(alpha*C + beta*add).
+ */
+typedef struct {
+    float *bias;
+    ACTIVATION activation;
+    float *add;
+    float alpha, beta;
+    ACTIVATION add_activation;
+} gemm_epilogue;
+
+/* Applies ep to the n elements at C + offset, all in the given row of C. */
+void gemm_epilogue_apply(const gemm_epilogue *ep, int row, size_t offset, float *C, int n);
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -18,6 +36,40 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+/* C += ALPHA * A * im2col(im), gathering patches while packing instead of materializing them. */
+void gemm_im2col(int M, float ALPHA,
+        float *A, int lda,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *ep);
+
+/* C += A * B, then ep (may be null) on every tile. */
+void gemm_fused(int M, int N, int K,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc, const gemm_epilogue *ep);
+
+/*
+ * A can be packed once up front (e.g. weights at load time) and reused:
+ * gemm_pack fills gemm_packed_size(M, K) floats, gemm_prepacked then
+ * computes C = BETA*C + A*B.  The layout depends on the CPU kernel in use.
+ */
+size_t gemm_packed_size(int M, int K);
+void gemm_pack(int TA, int M, int K, float *A, int lda, float *packed);
+void gemm_prepacked(int M, int N, int K,
+        float *packed_a,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc, const gemm_epilogue *ep);
+/* gemm_im2col with A packed by gemm_pack. */
+void gemm_im2col_prepacked(int M,
+        float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *ep);
+
+const char *gemm_kernel_name();
+
 #ifdef GPU
 void gemm_gpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
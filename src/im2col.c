@@ -1,4 +1,5 @@
 #include "im2col.h"
+#include "parallel.h"
 #include <stdio.h>
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
@@ -13,16 +14,24 @@ float im2col_get_pixel(float *im, int height, int width, int channels,
 
 //From Berkeley Vision's Caffe!
 //https://github.com/BVLC/caffe/blob/master/LICENSE
-void im2col_cpu(float* data_im,
-     int channels,  int height,  int width,
-     int ksize,  int stride, int pad, float* data_col) 
+typedef struct {
+    float *data_im;
+    int channels, height, width;
+    int ksize, stride, pad;
+    float *data_col;
+} im2col_args;
+
+static void im2col_rows(int start, int end, void *ptr)
 {
+    im2col_args a = *(im2col_args *)ptr;
     int c,h,w;
+    int height = a.height, width = a.width, channels = a.channels;
+    int ksize = a.ksize, stride = a.stride, pad = a.pad;
+    float *data_im = a.data_im, *data_col = a.data_col;
     int height_col = (height + 2*pad - ksize) / stride + 1;
     int width_col = (width + 2*pad - ksize) / stride + 1;
 
-    int channels_col = channels * ksize * ksize;
-    for (c = 0; c < channels_col; ++c) {
+    for (c = start; c < end; ++c) {
         int w_offset = c % ksize;
         int h_offset = (c / ksize) % ksize;
         int c_im = c / ksize / ksize;
@@ -38,3 +47,11 @@ void im2col_cpu(float* data_im,
     }
 }
 
+void im2col_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_col) 
+{
+    im2col_args args = {data_im, channels, height, width, ksize, stride, pad, data_col};
+    parallel_for(channels * ksize * ksize, 1, im2col_rows, &args);
+}
+
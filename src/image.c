@@ -2,8 +2,11 @@
 #include "cuda.h"
 #include "image.h"
 #include "utils.h"
+#include "parallel.h"
 
+#include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -78,11 +81,6 @@ static void set_pixel(image m, int x, int y, int c, float val) {
   m.data[c * m.h * m.w + y * m.w + x] = val;
 }
 
-static void add_pixel(image m, int x, int y, int c, float val) {
-  assert(x < m.w && y < m.h && c < m.c);
-  m.data[c * m.h * m.w + y * m.w + x] += val;
-}
-
 static float bilinear_interpolate(image im, float x, float y, int c) {
   int ix = (int) floorf(x);
   int iy = (int) floorf(y);
@@ -666,6 +664,68 @@ int find_prev_center(float x, float y, float max_mov, bool * prev_assigned) {
   return assigned_prev_index;
 }
 
+/* The corners of a box relative to im, in pixels and kept inside it. */
+static void detection_corners(image im, box b, int * left, int * top, int * right, int * bot) {
+  *left = (b.x - b.w / 2.) * im.w;
+  *right = (b.x + b.w / 2.) * im.w;
+  *top = (b.y - b.h / 2.) * im.h;
+  *bot = (b.y + b.h / 2.) * im.h;
+
+  if ( * left < 0)
+    *left = 0;
+  if ( * right > im.w - 1)
+    *right = im.w - 1;
+  if ( * top < 0)
+    *top = 0;
+  if ( * bot > im.h - 1)
+    *bot = im.h - 1;
+}
+
+/* Draws a box relative to im in the color of class id, labeled with its name. */
+void draw_class_box(image im, box b, int id, int classes, char ** names, image ** alphabet) {
+  int left, top, right, bot;
+  int width = im.h * .006;
+  int offset = id * 123457 % classes;
+  float rgb[3];
+  rgb[0] = get_color(2, offset, classes);
+  rgb[1] = get_color(1, offset, classes);
+  rgb[2] = get_color(0, offset, classes);
+  detection_corners(im, b, &left, &top, &right, &bot);
+  draw_box_width(im, left, top, right, bot, width, rgb[0], rgb[1], rgb[2]);
+  if (alphabet) {
+    image label = get_label(alphabet, names[id], (im.h * .03));
+    draw_label(im, top + width, left, label, rgb);
+    free_image(label);
+  }
+}
+
+/*
+ * An array with an object for every class of every detection over thresh:
+ * its name, class_id, prob and box, in the units of the detections.
+ */
+struct json_object * detections_to_json(detection * dets, int num, float thresh, char ** names, int classes) {
+  struct json_object * objects = json_object_new_array();
+  for (int i = 0; i < num; ++i) {
+    box b = dets[i].bbox;
+    for (int j = 0; j < classes; ++j) {
+      if (dets[i].prob[j] <= thresh)
+        continue;
+      struct json_object * object = json_object_new_object();
+      struct json_object * bbox = json_object_new_array();
+      json_object_array_add(bbox, json_object_new_double(b.x));
+      json_object_array_add(bbox, json_object_new_double(b.y));
+      json_object_array_add(bbox, json_object_new_double(b.w));
+      json_object_array_add(bbox, json_object_new_double(b.h));
+      json_object_object_add(object, "name", json_object_new_string(names[j]));
+      json_object_object_add(object, "class_id", json_object_new_int(j));
+      json_object_object_add(object, "prob", json_object_new_double(dets[i].prob[j]));
+      json_object_object_add(object, "box", bbox);
+      json_object_array_add(objects, object);
+    }
+  }
+  return objects;
+}
+
 void draw_detections(image im, char* im_name, detection * dets, int num, float thresh,
   char ** names, image ** alphabet, int classes,
   double time_index) {
@@ -705,21 +765,8 @@ void draw_detections(image im, char* im_name, detection * dets, int num, float t
     }
 
     if (class >= 0) {
-      box b = dets[i].bbox;
-
-      int left = (b.x - b.w / 2.) * im.w;
-      int right = (b.x + b.w / 2.) * im.w;
-      int top = (b.y - b.h / 2.) * im.h;
-      int bot = (b.y + b.h / 2.) * im.h;
-
-      if (left < 0)
-        left = 0;
-      if (right > im.w - 1)
-        right = im.w - 1;
-      if (top < 0)
-        top = 0;
-      if (bot > im.h - 1)
-        bot = im.h - 1;
+      int left, top, right, bot;
+      detection_corners(im, dets[i].bbox, &left, &top, &right, &bot);
 
       char * output = NULL;
       output = strstr(labelstr, "person");
@@ -1335,28 +1382,226 @@ void letterbox_image_into(image im, int w, int h, image boxed) {
     new_h = h;
     new_w = (im.w * h) / im.h;
   }
-  image resized = resize_image(im, new_w, new_h);
-  embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-  free_image(resized);
+  resize_image_region(im, boxed, (w - new_w) / 2, (h - new_h) / 2, new_w, new_h, RESIZE_BILINEAR);
 }
 
-image letterbox_image(image im, int w, int h) {
-  int new_w = im.w;
-  int new_h = im.h;
-  if (((float) w / im.w) < ((float) h / im.h)) {
-    new_w = w;
-    new_h = (im.h * w) / im.w;
+static float byte_scale[256];
+static pthread_once_t byte_scale_once = PTHREAD_ONCE_INIT;
+
+static void make_byte_scale(void) {
+  int i;
+  for (i = 0; i < 256; ++i)
+    byte_scale[i] = (float) i / 255.;
+}
+
+/* Sets every pixel of im outside the w by h region at dx, dy to v. */
+static void fill_outside(image im, int dx, int dy, int w, int h, float v) {
+  int k, y, x;
+  for (k = 0; k < im.c; ++k) {
+    for (y = 0; y < im.h; ++y) {
+      float * row = im.data + ((size_t) k * im.h + y) * im.w;
+      if (y < dy || y >= dy + h) {
+        for (x = 0; x < im.w; ++x)
+          row[x] = v;
+        continue;
+      }
+      for (x = 0; x < dx; ++x)
+        row[x] = v;
+      for (x = dx + w; x < im.w; ++x)
+        row[x] = v;
+    }
+  }
+}
+
+/*
+ * Letterboxing straight from decoded bytes: interleaved uint8 rows, RGB or
+ * BGR, step bytes apart, go to the planar float network input in one pass
+ * of the resize engine, without a full-resolution float copy or a separate
+ * embed, so the input matches letterbox_image(load_image(...)) to rounding.
+ */
+void letterbox_bytes_into(const unsigned char * data, int w, int h, int c, int step, int bgr, image boxed) {
+  assert(boxed.c <= c);
+  int new_w = w;
+  int new_h = h;
+  if (((float) boxed.w / w) < ((float) boxed.h / h)) {
+    new_w = boxed.w;
+    new_h = (h * boxed.w) / w;
   } else {
-    new_h = h;
-    new_w = (im.w * h) / im.h;
+    new_h = boxed.h;
+    new_w = (w * boxed.h) / h;
+  }
+  int left = (boxed.w - new_w) / 2;
+  int top = (boxed.h - new_h) / 2;
+  fill_outside(boxed, left, top, new_w, new_h, .5);
+  resize_bytes_region(data, w, h, c, step, bgr, boxed, left, top, new_w, new_h, RESIZE_BILINEAR);
+}
+
+/* Decodes an encoded image into boxed; 0 if it cannot. *w and *h get its size. */
+int letterbox_image_memory(unsigned char * buf, int len, image boxed, int * w, int * h) {
+  int c;
+  unsigned char * data = stbi_load_from_memory(buf, len, w, h, & c, boxed.c);
+  if (!data)
+    return 0;
+  letterbox_bytes_into(data, * w, * h, boxed.c, * w * boxed.c, 0, boxed);
+  free(data);
+  return 1;
+}
+
+/*
+ * Conversions between interleaved uint8 pixels, as decoders and OpenCV hold
+ * them, and planar float images, both ways in one pass over memory the
+ * caller owns. bgr swaps the first and third channels on the way. Three
+ * channel rows, the common case, go to or from all three planes at once in
+ * loops the compiler vectorizes; their deinterleaving needs AVX2 shuffles,
+ * so they are built again for it and picked at runtime, as resize.c does.
+ * Bytes scale as byte_scale does, bit for bit. Rows are spread over the
+ * worker pool.
+ */
+
+typedef struct {
+  const unsigned char * src;
+  unsigned char * dst;
+  int step;
+  int bgr;
+  image im;
+} bytes_args;
+
+static inline void bytes_to_image_body(int start, int end, void * ptr) {
+  const bytes_args * a = ptr;
+  image im = a->im;
+  size_t plane = (size_t) im.w * im.h;
+  int y, x, k;
+  for (y = start; y < end; ++y) {
+    const unsigned char * restrict row = a->src + (size_t) y * a->step;
+    float * dst = im.data + (size_t) y * im.w;
+    if (im.c == 3) {
+      float * restrict p0 = dst + (a->bgr ? 2 * plane : 0);
+      float * restrict p1 = dst + plane;
+      float * restrict p2 = dst + (a->bgr ? 0 : 2 * plane);
+      for (x = 0; x < im.w; ++x) {
+        p0[x] = row[3 * x] * (1. / 255);
+        p1[x] = row[3 * x + 1] * (1. / 255);
+        p2[x] = row[3 * x + 2] * (1. / 255);
+      }
+      continue;
+    }
+    for (k = 0; k < im.c; ++k) {
+      int src_k = (a->bgr && im.c >= 3 && k < 3) ? 2 - k : k;
+      float * p = dst + k * plane;
+      for (x = 0; x < im.w; ++x)
+        p[x] = byte_scale[row[x * im.c + src_k]];
+    }
+  }
+}
+
+static inline unsigned char float_to_byte(float val) {
+  val = (val < 0) ? 0 : (val > 1) ? 1 : val;
+  return (unsigned char)(val * 255);
+}
+
+static inline void image_to_bytes_body(int start, int end, void * ptr) {
+  const bytes_args * a = ptr;
+  image im = a->im;
+  size_t plane = (size_t) im.w * im.h;
+  int y, x, k;
+  for (y = start; y < end; ++y) {
+    unsigned char * restrict row = a->dst + (size_t) y * a->step;
+    const float * src = im.data + (size_t) y * im.w;
+    if (im.c == 3) {
+      const float * restrict p0 = src + (a->bgr ? 2 * plane : 0);
+      const float * restrict p1 = src + plane;
+      const float * restrict p2 = src + (a->bgr ? 0 : 2 * plane);
+      for (x = 0; x < im.w; ++x) {
+        row[3 * x] = float_to_byte(p0[x]);
+        row[3 * x + 1] = float_to_byte(p1[x]);
+        row[3 * x + 2] = float_to_byte(p2[x]);
+      }
+      continue;
+    }
+    for (k = 0; k < im.c; ++k) {
+      int dst_k = (a->bgr && im.c >= 3 && k < 3) ? 2 - k : k;
+      const float * p = src + k * plane;
+      for (x = 0; x < im.w; ++x)
+        row[x * im.c + dst_k] = float_to_byte(p[x]);
+    }
   }
-  image resized = resize_image(im, new_w, new_h);
+}
+
+static void bytes_to_image_rows(int start, int end, void * ptr) {
+  bytes_to_image_body(start, end, ptr);
+}
+
+static void image_to_bytes_rows(int start, int end, void * ptr) {
+  image_to_bytes_body(start, end, ptr);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTES_X86
+
+__attribute__((target("avx2")))
+static void bytes_to_image_rows_avx2(int start, int end, void * ptr) {
+  bytes_to_image_body(start, end, ptr);
+}
+
+__attribute__((target("avx2")))
+static void image_to_bytes_rows_avx2(int start, int end, void * ptr) {
+  image_to_bytes_body(start, end, ptr);
+}
+#endif
+
+/* Fills im from h rows of w * c interleaved bytes, step bytes apart; im gives w, h and c. */
+void bytes_to_image(const unsigned char * data, int step, int bgr, image im) {
+  bytes_args a = {0};
+  parallel_func rows = bytes_to_image_rows;
+  pthread_once( & byte_scale_once, make_byte_scale);
+  a.src = data;
+  a.step = step;
+  a.bgr = bgr;
+  a.im = im;
+  #ifdef BYTES_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    rows = bytes_to_image_rows_avx2;
+  #endif
+  parallel_for(im.h, 8, rows, & a);
+}
+
+/* Writes im as interleaved bytes, clamped to [0, 1] and scaled, rows step bytes apart. */
+void image_to_bytes(image im, unsigned char * data, int step, int bgr) {
+  bytes_args a = {0};
+  parallel_func rows = image_to_bytes_rows;
+  a.dst = data;
+  a.step = step;
+  a.bgr = bgr;
+  a.im = im;
+  #ifdef BYTES_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    rows = image_to_bytes_rows_avx2;
+  #endif
+  parallel_for(im.h, 8, rows, & a);
+}
+
+byte_image make_byte_image(int w, int h, int c) {
+  byte_image out;
+  out.w = w;
+  out.h = h;
+  out.c = c;
+  out.step = w * c;
+  out.data = calloc((size_t) h * out.step, 1);
+  if (!out.data)
+    malloc_error();
+  return out;
+}
+
+void free_byte_image(byte_image m) {
+  free(m.data);
+}
+
+image letterbox_image(image im, int w, int h) {
   image boxed = make_image(w, h, im.c);
   fill_image(boxed, .5);
-  //int i;
-  //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-  embed_image(resized, boxed, (w - new_w) / 2, (h - new_h) / 2);
-  free_image(resized);
+  letterbox_image_into(im, w, h, boxed);
   return boxed;
 }
 
@@ -1735,45 +1980,7 @@ void saturate_exposure_image(image im, float sat, float exposure) {
 
 image resize_image(image im, int w, int h) {
   image resized = make_image(w, h, im.c);
-  image part = make_image(w, im.h, im.c);
-  int r, c, k;
-  float w_scale = (float)(im.w - 1) / (w - 1);
-  float h_scale = (float)(im.h - 1) / (h - 1);
-  for (k = 0; k < im.c; ++k) {
-    for (r = 0; r < im.h; ++r) {
-      for (c = 0; c < w; ++c) {
-        float val = 0;
-        if (c == w - 1 || im.w == 1) {
-          val = get_pixel(im, im.w - 1, r, k);
-        } else {
-          float sx = c * w_scale;
-          int ix = (int) sx;
-          float dx = sx - ix;
-          val = (1 - dx) * get_pixel(im, ix, r, k) + dx * get_pixel(im, ix + 1, r, k);
-        }
-        set_pixel(part, c, r, k, val);
-      }
-    }
-  }
-  for (k = 0; k < im.c; ++k) {
-    for (r = 0; r < h; ++r) {
-      float sy = r * h_scale;
-      int iy = (int) sy;
-      float dy = sy - iy;
-      for (c = 0; c < w; ++c) {
-        float val = (1 - dy) * get_pixel(part, c, iy, k);
-        set_pixel(resized, c, r, k, val);
-      }
-      if (r == h - 1 || im.h == 1)
-        continue;
-      for (c = 0; c < w; ++c) {
-        float val = dy * get_pixel(part, c, iy + 1, k);
-        add_pixel(resized, c, r, k, val);
-      }
-    }
-  }
-
-  free_image(part);
+  resize_image_into(im, resized, RESIZE_BILINEAR);
   return resized;
 }
 
@@ -1822,6 +2029,13 @@ void test_resize(char * filename) {
   #endif
 }
 
+static image stb_to_image(unsigned char * data, int w, int h, int c) {
+  image im = make_image(w, h, c);
+  bytes_to_image(data, w * c, 0, im);
+  free(data);
+  return im;
+}
+
 image load_image_stb(char * filename, int channels) {
   int w, h, c;
   unsigned char * data = stbi_load(filename, & w, & h, & c, channels);
@@ -1831,19 +2045,20 @@ image load_image_stb(char * filename, int channels) {
   }
   if (channels)
     c = channels;
-  int i, j, k;
-  image im = make_image(w, h, c);
-  for (k = 0; k < c; ++k) {
-    for (j = 0; j < h; ++j) {
-      for (i = 0; i < w; ++i) {
-        int dst_index = i + w * j + w * h * k;
-        int src_index = k + c * i + c * w * j;
-        im.data[dst_index] = (float) data[src_index] / 255.;
-      }
-    }
+  return stb_to_image(data, w, h, c);
+}
+
+/* Decodes an encoded image held in memory; an image without data if it cannot. */
+image load_image_memory(unsigned char * buf, int len, int channels) {
+  int w, h, c;
+  unsigned char * data = stbi_load_from_memory(buf, len, & w, & h, & c, channels);
+  if (!data) {
+    image empty = {0};
+    return empty;
   }
-  free(data);
-  return im;
+  if (channels)
+    c = channels;
+  return stb_to_image(data, w, h, c);
 }
 
 image load_image(char * filename, int w, int h, int c) {
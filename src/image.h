@@ -15,7 +15,10 @@ extern "C" {
 
 #ifdef OPENCV
 void *open_video_stream(const char *f, int c, int w, int h, int fps);
+void close_video_stream(void *p);
 image get_image_from_stream(void *p);
+int read_stream_image(void *p, image *im);
+int read_stream_frame(void *p, byte_image *frame);
 image load_image_cv(char *filename, int channels);
 int show_image_cv(image im, const char* name, int ms);
 #endif
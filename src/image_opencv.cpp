@@ -43,76 +43,102 @@ image ipl_to_image(IplImage* src)
     return im;
 }*/
  
+/*
+ * Frames cross between cv::Mat and darknet buffers through bytes_to_image()
+ * and image_to_bytes(): one pass, channels swapped on the way, into memory
+ * that is reused from call to call. read_stream_frame() goes further and
+ * hands over the decoded bytes themselves, so the capture path can
+ * letterbox them with letterbox_bytes_into() and never build a
+ * full-resolution float image at all.
+ */
+
+struct video_stream{
+    VideoCapture cap;
+    Mat frame;
+};
+
 Mat image_to_mat(image im)
 {
-    image copy = copy_image(im);
-    constrain_image(copy);
-    if(im.c == 3) rgbgr_image(copy);
- 
-	int x, y, c;
-	Mat m = Mat(Size(im.w, im.h), CV_8UC(im.c));
-	int step = m.step;
- 
-	for (y = 0; y < im.h; ++y) {
-			for (x = 0; x < im.w; ++x) {
-					for (c = 0; c < im.c; ++c) {
-							float val = copy.data[c*im.h*im.w + y * im.w + x];
-							m.data[y*step + x * im.c + c] = (unsigned char)(val * 255);
-					}
-			}
-	}
- 
-/*    IplImage *ipl = image_to_ipl(copy);
-    Mat m = cvarrToMat(ipl, true);
-    cvReleaseImage(&ipl);*/
-    free_image(copy);
+    Mat m(im.h, im.w, CV_8UC(im.c));
+    image_to_bytes(im, m.data, m.step, im.c == 3);
     return m;
 }
- 
+
+static void mat_into_image(Mat m, image im)
+{
+    bytes_to_image(m.data, m.step, m.channels() == 3, im);
+}
+
 image mat_to_image(Mat m)
 {
-/*    IplImage ipl = m;
-    image im = ipl_to_image(&ipl);
-    rgbgr_image(im);*/
-	int h = m.rows;
-	int w = m.cols;
-	int c = m.channels();
-	image im = make_image(w, h, c);
-	unsigned char *data = (unsigned char *)m.data;
-	int step = m.step;
-	int i, j, k;
- 
-	for (i = 0; i < h; ++i) {
-			for (k = 0; k < c; ++k) {
-					for (j = 0; j < w; ++j) {
-							im.data[k*w*h + i * w + j] = data[i*step + j * c + k] / 255.;
-					}
-			}
-	}
-    if (im.c == 3) rgbgr_image(im);
-	
+    image im = make_image(m.cols, m.rows, m.channels());
+    mat_into_image(m, im);
     return im;
 }
- 
+
 void *open_video_stream(const char *f, int c, int w, int h, int fps)
 {
-    VideoCapture *cap;
-    if(f) cap = new VideoCapture(f);
-    else cap = new VideoCapture(c);
-    if(!cap->isOpened()) return 0;
-    if(w) cap->set(CAP_PROP_FRAME_WIDTH, w);
-    if(h) cap->set(CAP_PROP_FRAME_HEIGHT, w);
-    if(fps) cap->set(CAP_PROP_FPS, w);
-    return (void *) cap;
+    video_stream *s = new video_stream;
+    if(f) s->cap.open(f);
+    else s->cap.open(c);
+    if(!s->cap.isOpened()){
+        delete s;
+        return 0;
+    }
+    if(w) s->cap.set(CAP_PROP_FRAME_WIDTH, w);
+    if(h) s->cap.set(CAP_PROP_FRAME_HEIGHT, h);
+    if(fps) s->cap.set(CAP_PROP_FPS, fps);
+    return (void *) s;
 }
- 
+
+void close_video_stream(void *p)
+{
+    delete (video_stream *)p;
+}
+
 image get_image_from_stream(void *p)
 {
-    VideoCapture *cap = (VideoCapture *)p;
+    video_stream *s = (video_stream *)p;
+    if(!s->cap.read(s->frame) || s->frame.empty()) return make_empty_image(0,0,0);
+    return mat_to_image(s->frame);
+}
+
+/* Reads the next frame into *im, reallocating it only when the size changes. 0 at the end. */
+int read_stream_image(void *p, image *im)
+{
+    video_stream *s = (video_stream *)p;
+    if(!s->cap.read(s->frame) || s->frame.empty()) return 0;
+    Mat &m = s->frame;
+    if(!im->data || im->w != m.cols || im->h != m.rows || im->c != m.channels()){
+        free_image(*im);
+        *im = make_image(m.cols, m.rows, m.channels());
+    }
+    mat_into_image(m, *im);
+    return 1;
+}
+
+/*
+ * Reads the next frame's bytes into *frame, as the capture decoded them
+ * (BGR for color), reallocating it only when the size changes. The
+ * decoder writes straight into frame's memory when it can. 0 at the end.
+ */
+int read_stream_frame(void *p, byte_image *frame)
+{
+    video_stream *s = (video_stream *)p;
     Mat m;
-    *cap >> m;
-    if(m.empty()) return make_empty_image(0,0,0);
-    return mat_to_image(m);
+    if(frame->data) m = Mat(frame->h, frame->w, CV_8UC(frame->c), frame->data, frame->step);
+    if(!s->cap.read(m) || m.empty()) return 0;
+    if(m.data != frame->data){
+        int y;
+        if(!frame->data || frame->w != m.cols || frame->h != m.rows || frame->c != m.channels()){
+            free_byte_image(*frame);
+            *frame = make_byte_image(m.cols, m.rows, m.channels());
+        }
+        for(y = 0; y < m.rows; ++y){
+            memcpy(frame->data + (size_t)y*frame->step, m.ptr(y), (size_t)m.cols*m.channels());
+        }
+    }
+    return 1;
 }
  
 image load_image_cv(char *filename, int channels)
@@ -140,7 +166,9 @@ image load_image_cv(char *filename, int channels)
  
 int show_image_cv(image im, const char* name, int ms)
 {
-    Mat m = image_to_mat(im);
+    static thread_local Mat m;
+    m.create(im.h, im.w, CV_8UC(im.c));
+    image_to_bytes(im, m.data, m.step, im.c == 3);
     imshow(name, m);
     int c = waitKey(ms);
     if (c != -1) c = c%256;
@@ -19,7 +19,7 @@ layer make_l2norm_layer(int batch, int inputs)
     l.outputs = inputs;
     l.output = calloc(inputs*batch, sizeof(float));
     l.scales = calloc(inputs*batch, sizeof(float));
-    l.delta = calloc(inputs*batch, sizeof(float));
+    l.delta = train_calloc(inputs*batch, sizeof(float));
 
     l.forward = forward_l2norm_layer;
     l.backward = backward_l2norm_layer;
@@ -1,5 +1,6 @@
 #include "layer.h"
 #include "cuda.h"
+#include "gemm.h"
 
 #include <stdlib.h>
 
@@ -32,6 +33,12 @@ void free_layer(layer l)
     if(l.scales)             free(l.scales);
     if(l.scale_updates)      free(l.scale_updates);
     if(l.weights)            free(l.weights);
+    if(l.winograd_weights)   free(l.winograd_weights);
+    if(l.packed_weights)     free(l.packed_weights);
+    if(l.blocked_weights)    free(l.blocked_weights);
+    if(l.int8_weights)       free(l.int8_weights);
+    if(l.weight_scales)      free(l.weight_scales);
+    if(l.weight_sums)        free(l.weight_sums);
     if(l.weight_updates)     free(l.weight_updates);
     if(l.delta)              free(l.delta);
     if(l.output)             free(l.output);
@@ -95,3 +102,140 @@ void free_layer(layer l)
     if(l.norms_gpu)               cuda_free(l.norms_gpu);
 #endif
 }
+
+/* Cleared while parse_network_cfg_inference builds its layers. */
+static __thread int training_buffers = 1;
+
+void set_training_buffers(int on)
+{
+    training_buffers = on;
+}
+
+/*
+ * Whether constructors should draw random initial weights. Inference
+ * networks always load theirs, and leaving the buffers untouched until then
+ * costs no memory for those mapped weights replace.
+ */
+int init_random_weights()
+{
+    return training_buffers;
+}
+
+/* calloc for buffers only backward and update use. */
+void *train_calloc(size_t nmemb, size_t size)
+{
+    if(!training_buffers) return 0;
+    return calloc(nmemb, size);
+}
+
+/* calloc for copies of the weights only inference keeps, as training would have to rebuild them after every update. */
+void *inference_calloc(size_t nmemb, size_t size)
+{
+    if(training_buffers) return 0;
+    return calloc(nmemb, size);
+}
+
+/* realloc that leaves a buffer the network was built without unallocated. */
+void *train_realloc(void *ptr, size_t size)
+{
+    if(!ptr) return 0;
+    return realloc(ptr, size);
+}
+
+#define FREE_TRAINING(p) do{ if(p) free(p); p = 0; }while(0)
+#define CUDA_FREE_TRAINING(p) do{ if(p) cuda_free(p); p = 0; }while(0)
+
+/*
+ * Releases what only backward and update use and train_calloc did not catch,
+ * the GPU copies above all. Recurrent layers share these buffers with their
+ * sub-layers and keep them.
+ */
+void free_layer_training(layer *l)
+{
+    if(l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN || l->type == ISEG) return;
+    if(l->type == DROPOUT){
+        /* delta is the previous layer's. */
+        FREE_TRAINING(l->rand);
+#ifdef GPU
+        CUDA_FREE_TRAINING(l->rand_gpu);
+#endif
+        return;
+    }
+    FREE_TRAINING(l->delta);
+    FREE_TRAINING(l->weight_updates);
+    FREE_TRAINING(l->bias_updates);
+    FREE_TRAINING(l->scale_updates);
+    FREE_TRAINING(l->mean_delta);
+    FREE_TRAINING(l->variance_delta);
+    FREE_TRAINING(l->x);
+    FREE_TRAINING(l->x_norm);
+    FREE_TRAINING(l->m);
+    FREE_TRAINING(l->v);
+    FREE_TRAINING(l->bias_m);
+    FREE_TRAINING(l->bias_v);
+    FREE_TRAINING(l->scale_m);
+    FREE_TRAINING(l->scale_v);
+#ifdef GPU
+    CUDA_FREE_TRAINING(l->delta_gpu);
+    CUDA_FREE_TRAINING(l->weight_updates_gpu);
+    CUDA_FREE_TRAINING(l->bias_updates_gpu);
+    CUDA_FREE_TRAINING(l->scale_updates_gpu);
+    CUDA_FREE_TRAINING(l->mean_delta_gpu);
+    CUDA_FREE_TRAINING(l->variance_delta_gpu);
+    CUDA_FREE_TRAINING(l->x_gpu);
+    CUDA_FREE_TRAINING(l->x_norm_gpu);
+    CUDA_FREE_TRAINING(l->m_gpu);
+    CUDA_FREE_TRAINING(l->v_gpu);
+    CUDA_FREE_TRAINING(l->bias_m_gpu);
+    CUDA_FREE_TRAINING(l->bias_v_gpu);
+    CUDA_FREE_TRAINING(l->scale_m_gpu);
+    CUDA_FREE_TRAINING(l->scale_v_gpu);
+#endif
+}
+
+/* The GEMM shape behind a conv or connected layer's weights: groups products of m x k. */
+static int packed_shape(layer l, int *m, int *k)
+{
+    if(l.type == CONNECTED){
+        *m = l.outputs;
+        *k = l.inputs;
+        return 1;
+    }
+    *m = l.n/l.groups;
+    *k = l.size*l.size*l.c/l.groups;
+    return l.groups;
+}
+
+/*
+ * Weights packed once for gemm_prepacked, a panel set per group, so forward
+ * passes skip repacking them on every call. Only inference networks have
+ * them; conv layers with Winograd weights pack those instead.
+ */
+void make_packed_weights(layer *l)
+{
+    int m, k;
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    if(l->type == CONVOLUTIONAL && (l->winograd_weights || l->binary || l->xnor)) return;
+    int groups = packed_shape(*l, &m, &k);
+    l->packed_weights = inference_calloc(groups*gemm_packed_size(m, k), sizeof(float));
+}
+
+size_t packed_weights_size(layer l)
+{
+    int m, k;
+    if(!l.packed_weights) return 0;
+    int groups = packed_shape(l, &m, &k);
+    return groups*gemm_packed_size(m, k);
+}
+
+void pack_weights(layer l)
+{
+    int m, k, j;
+    if(!l.packed_weights) return;
+    int groups = packed_shape(l, &m, &k);
+    for(j = 0; j < groups; ++j){
+        gemm_pack(0, m, k, l.weights + (size_t)j*m*k, k, l.packed_weights + j*gemm_packed_size(m, k));
+    }
+}
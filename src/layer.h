@@ -1 +1,13 @@
 #include "darknet.h"
+
+#include <stddef.h>
+
+void set_training_buffers(int on);
+int init_random_weights();
+void *train_calloc(size_t nmemb, size_t size);
+void *train_realloc(void *ptr, size_t size);
+void free_layer_training(layer *l);
+void *inference_calloc(size_t nmemb, size_t size);
+void make_packed_weights(layer *l);
+size_t packed_weights_size(layer l);
+void pack_weights(layer l);
@@ -48,19 +48,21 @@ local_layer make_local_layer(int batch, int h, int w, int c, int n, int size, in
     l.inputs = l.w * l.h * l.c;
 
     l.weights = calloc(c*n*size*size*locations, sizeof(float));
-    l.weight_updates = calloc(c*n*size*size*locations, sizeof(float));
+    l.weight_updates = train_calloc(c*n*size*size*locations, sizeof(float));
 
     l.biases = calloc(l.outputs, sizeof(float));
-    l.bias_updates = calloc(l.outputs, sizeof(float));
+    l.bias_updates = train_calloc(l.outputs, sizeof(float));
 
     // float scale = 1./sqrt(size*size*c);
     float scale = sqrt(2./(size*size*c));
-    for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_uniform(-1,1);
+    if(init_random_weights()){
+        for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_uniform(-1,1);
+    }
 
     l.output = calloc(l.batch*out_h * out_w * n, sizeof(float));
-    l.delta  = calloc(l.batch*out_h * out_w * n, sizeof(float));
+    l.delta  = train_calloc(l.batch*out_h * out_w * n, sizeof(float));
 
-    l.workspace_size = out_h*out_w*size*size*c;
+    l.workspace_size = (size_t)out_h*out_w*size*size*c*sizeof(float);
     
     l.forward = forward_local_layer;
     l.backward = backward_local_layer;
@@ -0,0 +1,146 @@
+#include "darknet.h"
+#include "utils.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Telling frames where something moved from frames where nothing did, for
+ * fixed cameras, at a small fraction of what the network costs.
+ *
+ * A frame is scored on a grid MOTION_CELLS cells across, each cell the
+ * mean brightness of every other pixel of every other row under it. The
+ * background is a running average of the grid, so lighting that drifts and
+ * objects that come to rest fade into it over a few seconds. A cell
+ * changed if it is more than MOTION_DELTA levels off the background, and
+ * the scene changed if more than the threshold fraction of cells did. The
+ * region is the box around the changed cells, a cell wider on every side
+ * and at least MOTION_MIN_REGION of the frame each way so what moved keeps
+ * some context.
+ */
+
+#define MOTION_CELLS 64
+#define MOTION_DELTA 16
+#define MOTION_RATE .05
+#define MOTION_MIN_REGION .25
+
+struct motion_detector{
+    float threshold;
+    int w, h;
+    int gw, gh;
+    float *background;
+    float *current;
+    int frames;
+};
+
+motion_detector *make_motion_detector(float threshold)
+{
+    motion_detector *m = calloc(1, sizeof(motion_detector));
+    m->threshold = threshold;
+    return m;
+}
+
+void free_motion_detector(motion_detector *m)
+{
+    if(!m) return;
+    free(m->background);
+    free(m->current);
+    free(m);
+}
+
+/* Starts over with a grid for frames of w by h. */
+static void reset_motion(motion_detector *m, int w, int h)
+{
+    m->w = w;
+    m->h = h;
+    m->gw = w < MOTION_CELLS ? w : MOTION_CELLS;
+    m->gh = (h*m->gw + w/2)/w;
+    if(m->gh < 1) m->gh = 1;
+    if(m->gh > h) m->gh = h;
+    free(m->background);
+    free(m->current);
+    m->background = calloc(m->gw*m->gh, sizeof(float));
+    m->current = calloc(m->gw*m->gh, sizeof(float));
+    m->frames = 0;
+}
+
+static void sample_frame(motion_detector *m, byte_image f)
+{
+    int gx, gy, x, y;
+    for(gy = 0; gy < m->gh; ++gy){
+        int y0 = gy*f.h/m->gh;
+        int y1 = (gy + 1)*f.h/m->gh;
+        for(gx = 0; gx < m->gw; ++gx){
+            int x0 = gx*f.w/m->gw;
+            int x1 = (gx + 1)*f.w/m->gw;
+            int sum = 0;
+            int count = 0;
+            for(y = y0; y < y1; y += 2){
+                const unsigned char *p = f.data + (size_t)y*f.step;
+                if(f.c >= 3){
+                    for(x = x0; x < x1; x += 2) sum += (p[x*f.c] + 2*p[x*f.c + 1] + p[x*f.c + 2]) >> 2;
+                } else {
+                    for(x = x0; x < x1; x += 2) sum += p[x*f.c];
+                }
+                count += (x1 - x0 + 1)/2;
+            }
+            m->current[gy*m->gw + gx] = count ? (float)sum/count : 0;
+        }
+    }
+}
+
+/*
+ * 1 if frame differs from the background by more than the threshold; the
+ * first frame, and the first after the size changes, always does. region
+ * gets the part of the frame that changed, relative to its size, centered
+ * as detections are.
+ */
+int detect_motion(motion_detector *m, byte_image frame, box *region)
+{
+    int i, x, y;
+    if(frame.w != m->w || frame.h != m->h) reset_motion(m, frame.w, frame.h);
+    sample_frame(m, frame);
+    region->x = region->y = .5;
+    region->w = region->h = 1;
+    if(!m->frames++){
+        memcpy(m->background, m->current, m->gw*m->gh*sizeof(float));
+        return 1;
+    }
+    int changed = 0;
+    int left = m->gw, right = -1, top = m->gh, bottom = -1;
+    for(y = 0; y < m->gh; ++y){
+        for(x = 0; x < m->gw; ++x){
+            i = y*m->gw + x;
+            float delta = m->current[i] - m->background[i];
+            if(fabs(delta) > MOTION_DELTA){
+                ++changed;
+                if(x < left) left = x;
+                if(x > right) right = x;
+                if(y < top) top = y;
+                if(y > bottom) bottom = y;
+            }
+            m->background[i] += MOTION_RATE*delta;
+        }
+    }
+    if(!changed || changed <= m->threshold*m->gw*m->gh) return 0;
+
+    float x0 = (float)constrain_int(left - 1, 0, m->gw)/m->gw;
+    float x1 = (float)constrain_int(right + 2, 0, m->gw)/m->gw;
+    float y0 = (float)constrain_int(top - 1, 0, m->gh)/m->gh;
+    float y1 = (float)constrain_int(bottom + 2, 0, m->gh)/m->gh;
+    if(x1 - x0 < MOTION_MIN_REGION){
+        float c = constrain(MOTION_MIN_REGION/2, 1 - MOTION_MIN_REGION/2, (x0 + x1)/2);
+        x0 = c - MOTION_MIN_REGION/2;
+        x1 = c + MOTION_MIN_REGION/2;
+    }
+    if(y1 - y0 < MOTION_MIN_REGION){
+        float c = constrain(MOTION_MIN_REGION/2, 1 - MOTION_MIN_REGION/2, (y0 + y1)/2);
+        y0 = c - MOTION_MIN_REGION/2;
+        y1 = c + MOTION_MIN_REGION/2;
+    }
+    region->x = (x0 + x1)/2;
+    region->y = (y0 + y1)/2;
+    region->w = x1 - x0;
+    region->h = y1 - y0;
+    return 1;
+}
@@ -6,6 +6,11 @@
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "blocked.h"
+#include "quantize.h"
+#include "layer.h"
+#include "arena.h"
+#include "weights_map.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -60,6 +65,25 @@ network *load_network(char *cfg, char *weights, int clear)
     return net;
 }
 
+/*
+ * Loads a network for forward passes only. Training buffers are never
+ * allocated, the result is run through optimize_network, so it can be
+ * neither trained nor saved back, and layer outputs share one arena: only
+ * those of the output and detection layers are valid after a forward pass.
+ */
+network *load_network_inference(char *cfg, char *weights)
+{
+    /* A snapshot from darknet compile is its own weights. */
+    if(is_mapped_weights(cfg)) weights = cfg;
+    network *net = parse_network_cfg_inference(cfg);
+    if(weights && weights[0] != 0){
+        load_weights(net, weights);
+    }
+    optimize_network(net);
+    plan_activation_arena(net);
+    return net;
+}
+
 size_t get_current_batch(network *net)
 {
     size_t batch_num = (*net->seen)/(net->batch*net->subdivisions);
@@ -195,13 +219,23 @@ void forward_network(network *netp)
 #endif
     network net = *netp;
     int i;
+    int blocked = 0;
     for(i = 0; i < net.n; ++i){
         net.index = i;
         layer l = net.layers[i];
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
+        if(!net.train && l.type != ROUTE && l.blocked != blocked){
+            if(blocked){
+                layer prev = net.layers[i-1];
+                net.input = reorder_network_input(netp, net.input, l.batch, prev.out_c, prev.out_h, prev.out_w, 0);
+            } else {
+                net.input = reorder_network_input(netp, net.input, l.batch, l.c, l.h, l.w, 1);
+            }
+        }
         l.forward(l, net);
+        blocked = l.blocked && !net.train;
         net.input = l.output;
         if(l.truth) {
             net.truth = l.output;
@@ -260,14 +294,38 @@ int get_predicted_class_network(network *net)
     return max_index(net->output, net->outputs);
 }
 
+/*
+ * Convolutions gather their patches while packing the GEMM operands, so on
+ * the CPU they only need scratch space for the backward pass.  Inference
+ * gets by with whatever the remaining layers (deconv, local) ask for and
+ * the full workspace is allocated the first time the network trains.
+ */
+void make_network_workspace(network *net, int train)
+{
+    int i;
+    size_t size = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!train && l.type == CONVOLUTIONAL) continue;
+        if(l.workspace_size > size) size = l.workspace_size;
+    }
+    if(size <= net->workspace_size) return;
+    free(net->workspace);
+    net->workspace = calloc(1, size);
+    if(!net->workspace) malloc_error();
+    net->workspace_size = size;
+}
+
 void backward_network(network *netp)
 {
+    if(netp->inference_only) error("Cannot run backward on a network loaded for inference");
 #ifdef GPU
     if(netp->gpu_index >= 0){
         backward_network_gpu(netp);   
         return;
     }
 #endif
+    make_network_workspace(netp, 1);
     network net = *netp;
     int i;
     network orig = net;
@@ -288,6 +346,7 @@ void backward_network(network *netp)
 
 float train_network_datum(network *net)
 {
+    if(net->inference_only) error("Cannot train a network loaded for inference");
     *net->seen += net->batch;
     net->train = 1;
     forward_network(net);
@@ -335,6 +394,95 @@ void set_temp_network(network *net, float t)
     }
 }
 
+void set_network_layout(network *net, int blocked)
+{
+    net->blocked = blocked;
+    plan_blocked_layout(net);
+}
+
+
+#define BATCH_BUFFERS 10
+
+/* The buffers of l that hold a value per image, and how many floats each holds per image. */
+static int batch_buffers(layer *l, float **field[BATCH_BUFFERS], size_t count[BATCH_BUFFERS])
+{
+    int n = 0;
+    /* A dropout layer's output and delta are its input's. */
+    if(l->type == DROPOUT){
+        field[n] = &l->rand;
+        count[n++] = l->inputs;
+        return n;
+    }
+    field[n] = &l->output;
+    count[n++] = l->outputs;
+    field[n] = &l->delta;
+    count[n++] = l->outputs;
+    field[n] = &l->x;
+    count[n++] = l->outputs;
+    field[n] = &l->x_norm;
+    count[n++] = l->outputs;
+    field[n] = (float **)&l->indexes;
+    count[n++] = l->outputs;
+    field[n] = &l->binary_input;
+    count[n++] = l->inputs;
+    if(l->type == NORMALIZATION){
+        field[n] = &l->squared;
+        count[n++] = l->inputs;
+        field[n] = &l->norms;
+        count[n++] = l->inputs;
+    }
+    if(l->type == L2NORM){
+        field[n] = &l->scales;
+        count[n++] = l->inputs;
+    }
+    if(l->type == SOFTMAX || l->type == LOGXENT){
+        field[n] = &l->loss;
+        count[n++] = l->inputs;
+    }
+    return n;
+}
+
+/*
+ * Reallocates every buffer that holds a value per image for b images.
+ * Outputs in the activation arena are left to plan_activation_arena().
+ * Recurrent layers keep state for the batch they were built for, so those
+ * cannot grow.
+ */
+static void grow_batch_buffers(network *net, int b)
+{
+    int i, j;
+    float **field[BATCH_BUFFERS];
+    size_t count[BATCH_BUFFERS];
+#ifdef GPU
+    if(net->gpu_index >= 0) error("A GPU network can't run more images at once than it was built for");
+#endif
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN || l->type == ISEG){
+            error("This network can't run more images at once than its cfg batch");
+        }
+        int n = batch_buffers(l, field, count);
+        for(j = 0; j < n; ++j){
+            if(!*field[j]) continue;
+            if(field[j] == &l->output && net->arena) continue;
+            free(*field[j]);
+            *field[j] = calloc(count[j]*b, sizeof(float));
+            if(!*field[j]) malloc_error();
+        }
+        if(l->type == DROPOUT && i > 0){
+            l->output = net->layers[i-1].output;
+            l->delta = net->layers[i-1].delta;
+        }
+    }
+    free(net->input);
+    net->input = calloc((size_t)net->inputs*b, sizeof(float));
+    if(net->truth){
+        free(net->truth);
+        net->truth = calloc((size_t)net->truths*b, sizeof(float));
+    }
+    net->output = get_network_output_layer(net).output;
+    net->allocated_batch = b;
+}
 
 void set_batch_network(network *net, int b)
 {
@@ -353,6 +501,18 @@ void set_batch_network(network *net, int b)
         }
 #endif
     }
+    if(b > net->allocated_batch) grow_batch_buffers(net, b);
+    /* Slot sizes follow the batch, and so does the reorder buffer. */
+    if(net->arena) plan_activation_arena(net);
+    if(net->reorder) make_reorder_buffer(net);
+}
+
+/* The buffers stay planned for the batch set last; a smaller one just runs fewer images. */
+void set_active_batch(network *net, int b)
+{
+    int i;
+    net->batch = b;
+    for(i = 0; i < net->n; ++i) net->layers[i].batch = b;
 }
 
 int resize_network(network *net, int w, int h)
@@ -362,6 +522,8 @@ int resize_network(network *net, int w, int h)
     cuda_free(net->workspace);
 #endif
     int i;
+    int planned = net->arena != 0;
+    release_activation_arena(net);
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
@@ -398,6 +560,7 @@ int resize_network(network *net, int w, int h)
         }else{
             error("Cannot resize this type of layer");
         }
+        if(net->inference_only) free_layer_training(&l);
         if(l.workspace_size > workspace_size) workspace_size = l.workspace_size;
         if(l.workspace_size > 2000000000) assert(0);
         inputs = l.outputs;
@@ -415,24 +578,32 @@ int resize_network(network *net, int w, int h)
     free(net->input);
     free(net->truth);
     net->input = calloc(net->inputs*net->batch, sizeof(float));
-    net->truth = calloc(net->truths*net->batch, sizeof(float));
+    net->truth = net->inference_only ? 0 : calloc(net->truths*net->batch, sizeof(float));
+    net->allocated_batch = net->batch;
 #ifdef GPU
     if(gpu_index >= 0){
         cuda_free(net->input_gpu);
-        cuda_free(net->truth_gpu);
+        if(net->truth_gpu) cuda_free(net->truth_gpu);
         net->input_gpu = cuda_make_array(net->input, net->inputs*net->batch);
-        net->truth_gpu = cuda_make_array(net->truth, net->truths*net->batch);
+        net->truth_gpu = net->inference_only ? 0 : cuda_make_array(net->truth, net->truths*net->batch);
         if(workspace_size){
             net->workspace = cuda_make_array(0, (workspace_size-1)/sizeof(float)+1);
         }
+        net->workspace_size = workspace_size;
     }else {
         free(net->workspace);
-        net->workspace = calloc(1, workspace_size);
+        net->workspace = 0;
+        net->workspace_size = 0;
+        make_network_workspace(net, net->train);
     }
 #else
     free(net->workspace);
-    net->workspace = calloc(1, workspace_size);
+    net->workspace = 0;
+    net->workspace_size = 0;
+    make_network_workspace(net, net->train);
 #endif
+    make_reorder_buffer(net);
+    if(planned) plan_activation_arena(net);
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -507,14 +678,42 @@ float *network_predict(network *net, float *input)
     return out;
 }
 
-int num_detections(network *net, float thresh)
+/*
+ * Runs input through the net and widens ranges[i] to the largest input
+ * magnitude seen by every int8-eligible layer i, the activation range
+ * save_weights_int8 quantizes with.  ranges holds net->n entries and
+ * should start out zeroed.
+ */
+void calibrate_network(network *net, float *input, float *ranges)
+{
+    int i, j;
+    network_predict(net, input);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!int8_eligible(l)) continue;
+        float *x = i ? net->layers[i-1].output : input;
+        for(j = 0; j < l.inputs*l.batch; ++j){
+            if(fabs(x[j]) > ranges[i]) ranges[i] = fabs(x[j]);
+        }
+    }
+}
+
+/* Layer l as it is for image b of the batch alone. */
+static layer batch_item(layer l, int b)
+{
+    l.output += (size_t)b*l.outputs;
+    l.batch = 1;
+    return l;
+}
+
+static int num_detections_batch(network *net, int b, float thresh)
 {
     int i;
     int s = 0;
     for(i = 0; i < net->n; ++i){
         layer l = net->layers[i];
         if(l.type == YOLO){
-            s += yolo_num_detections(l, thresh);
+            s += yolo_num_detections(b < 0 ? l : batch_item(l, b), thresh);
         }
         if(l.type == DETECTION || l.type == REGION){
             s += l.w*l.h*l.n;
@@ -523,12 +722,15 @@ int num_detections(network *net, float thresh)
     return s;
 }
 
-detection *make_network_boxes(network *net, float thresh, int *num)
+int num_detections(network *net, float thresh)
+{
+    return num_detections_batch(net, -1, thresh);
+}
+
+static detection *make_boxes(network *net, int nboxes)
 {
     layer l = net->layers[net->n - 1];
     int i;
-    int nboxes = num_detections(net, thresh);
-    if(num) *num = nboxes;
     detection *dets = calloc(nboxes, sizeof(detection));
     for(i = 0; i < nboxes; ++i){
         dets[i].prob = calloc(l.classes, sizeof(float));
@@ -539,11 +741,21 @@ detection *make_network_boxes(network *net, float thresh, int *num)
     return dets;
 }
 
-void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
+detection *make_network_boxes(network *net, float thresh, int *num)
+{
+    int nboxes = num_detections(net, thresh);
+    if(num) *num = nboxes;
+    return make_boxes(net, nboxes);
+}
+
+static void fill_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
 {
     int j;
     for(j = 0; j < net->n; ++j){
         layer l = net->layers[j];
+        if(l.type != YOLO && l.type != REGION && l.type != DETECTION) continue;
+        /* b < 0 keeps the layers' own batch, where 2 means an image and its mirror. */
+        if(b >= 0) l = batch_item(l, b);
         if(l.type == YOLO){
             int count = get_yolo_detections(l, w, h, net->w, net->h, thresh, map, relative, dets);
             dets += count;
@@ -559,6 +771,11 @@ void fill_network_boxes(network *net, int w, int h, float thresh, float hier, in
     }
 }
 
+void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
+{
+    fill_network_boxes_batch(net, -1, w, h, thresh, hier, map, relative, dets);
+}
+
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num)
 {
     detection *dets = make_network_boxes(net, thresh, num);
@@ -566,6 +783,16 @@ detection *get_network_boxes(network *net, int w, int h, float thresh, float hie
     return dets;
 }
 
+/* The boxes of image b of the last batch, which was w by h before letterboxing. */
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, int *num)
+{
+    int nboxes = num_detections_batch(net, b, thresh);
+    if(num) *num = nboxes;
+    detection *dets = make_boxes(net, nboxes);
+    fill_network_boxes_batch(net, b, w, h, thresh, hier, map, relative, dets);
+    return dets;
+}
+
 void free_detections(detection *dets, int n)
 {
     int i;
@@ -716,6 +943,8 @@ float network_accuracy_multi(network *net, data d, int n)
 void free_network(network *net)
 {
     int i;
+    free_activation_arena(net);
+    unmap_network_weights(net);
     for(i = 0; i < net->n; ++i){
         free_layer(net->layers[i]);
     }
@@ -725,7 +954,15 @@ void free_network(network *net)
 #ifdef GPU
     if(net->input_gpu) cuda_free(net->input_gpu);
     if(net->truth_gpu) cuda_free(net->truth_gpu);
+    if(net->workspace){
+        if(net->gpu_index >= 0) cuda_free(net->workspace);
+        else free(net->workspace);
+    }
+#else
+    if(net->workspace) free(net->workspace);
 #endif
+    if(net->reorder) free(net->reorder);
+    if(net->blocked_scratch) free(net->blocked_scratch);
     free(net);
 }
 
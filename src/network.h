@@ -23,6 +23,7 @@ float network_accuracy_multi(network *net, data d, int n);
 int get_predicted_class_network(network *net);
 void print_network(network *net);
 int resize_network(network *net, int w, int h);
+void make_network_workspace(network *net, int train);
 void calc_network_cost(network *net);
 
 #endif
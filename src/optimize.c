@@ -0,0 +1,144 @@
+#include "darknet.h"
+#include "layer.h"
+#include "quantize.h"
+#include "winograd.h"
+#include "blocked.h"
+#include "convolutional_layer.h"
+#include "connected_layer.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Inference-time rewrites of a loaded network:
+ *
+ *  - batchnorm is folded into the weights and biases of convolutional and
+ *    connected layers, w' = w*s, b' = b - mean*s with
+ *    s = scale/(sqrt(variance) + .000001), so forward skips it;
+ *  - dropout layers, which only pass their input on at test time, are
+ *    removed and the route/shortcut indices after them renumbered;
+ *  - convolutions without batchnorm apply bias and activation in the GEMM
+ *    epilogue, while each output tile is still in cache, and a shortcut
+ *    layer right after one is computed there too when nothing else reads
+ *    the convolution's output.
+ *
+ * The result is for inference only: it no longer trains, and save_weights
+ * would write it without the batchnorm statistics its cfg expects.
+ */
+
+static int fold_layer_batchnorm(layer *l)
+{
+    if(l->type != CONVOLUTIONAL && l->type != CONNECTED) return 0;
+    if(!l->batch_normalize || l->binary || l->xnor) return 0;
+    fold_batchnorm(*l, l->weights, l->biases);
+    l->batch_normalize = 0;
+    winograd_transform_weights(*l);
+    blocked_transform_weights(*l);
+    pack_weights(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        if(l->type == CONNECTED) push_connected_layer(*l);
+        else push_convolutional_layer(*l);
+    }
+#endif
+    return 1;
+}
+
+static int drop_dropout_layers(network *net)
+{
+    int i, j;
+    int n = 0;
+    int *map = calloc(net->n, sizeof(int));
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == DROPOUT && i > 0 && i < net->n - 1){
+            /* Its output is the previous layer's. */
+            map[i] = map[i-1];
+            free_layer(l);
+            continue;
+        }
+        map[i] = n;
+        net->layers[n++] = l;
+    }
+    for(i = 0; i < n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == ROUTE){
+            for(j = 0; j < l->n; ++j) l->input_layers[j] = map[l->input_layers[j]];
+        } else if(l->type == SHORTCUT){
+            l->index = map[l->index];
+        }
+    }
+    int dropped = net->n - n;
+    net->n = n;
+    free(map);
+    return dropped;
+}
+
+/* Whether a route or shortcut other than layer except reads layer i's output. */
+static int output_read_elsewhere(network *net, int i, int except)
+{
+    int j, k;
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        if(j == except) continue;
+        if(l.type == SHORTCUT && l.index == i) return 1;
+        if(l.type == ROUTE){
+            for(k = 0; k < l.n; ++k){
+                if(l.input_layers[k] == i) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int can_fuse_shortcut(network *net, int i)
+{
+    if(i + 1 >= net->n) return 0;
+    layer l = net->layers[i];
+    layer s = net->layers[i + 1];
+    if(s.type != SHORTCUT || s.index == i || s.batch != l.batch) return 0;
+    if(s.w != s.out_w || s.h != s.out_h || s.c != s.out_c) return 0;
+    if(l.out_w != s.out_w || l.out_h != s.out_h || l.out_c != s.out_c) return 0;
+    if(l.blocked != s.blocked) return 0;
+    return !output_read_elsewhere(net, i, i + 1);
+}
+
+static int fuse_epilogues(network *net)
+{
+    int i;
+    int count = 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        l->fused = 0;
+        l->fuse_shortcut = 0;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type != CONVOLUTIONAL || l->batch_normalize || l->binary || l->xnor || l->int8_weights) continue;
+        l->fused = 1;
+        if(can_fuse_shortcut(net, i)){
+            l->fuse_shortcut = 1;
+            l[1].fused = 1;
+            ++count;
+        }
+    }
+    return count;
+}
+
+int fold_network_batchnorm(network *net)
+{
+    int i;
+    int folded = 0;
+    for(i = 0; i < net->n; ++i){
+        folded += fold_layer_batchnorm(net->layers + i);
+    }
+    return folded;
+}
+
+void optimize_network(network *net)
+{
+    int folded = fold_network_batchnorm(net);
+    int dropped = drop_dropout_layers(net);
+    plan_blocked_layout(net);
+    int shortcuts = fuse_epilogues(net);
+    fprintf(stderr, "optimize: folded %d batchnorms, dropped %d dropouts, fused %d shortcuts\n", folded, dropped, shortcuts);
+}
@@ -0,0 +1,185 @@
+#include "parallel.h"
+#include "utils.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Persistent worker pool for the data-parallel loops inside layer kernels.
+ *
+ * parallel_for() cuts [0, n) into one contiguous segment per thread.  Every
+ * thread takes grain sized chunks off its own segment and, once that runs
+ * dry, steals chunks from the other segments, so uneven work (edge tiles,
+ * ragged channel counts, a core busy with something else) still balances.
+ * Workers spin for a short while between jobs before sleeping, which keeps
+ * the per-layer dispatch cost low without pinning idle cores.
+ *
+ * One loop owns the pool at a time.  A parallel_for issued from inside a
+ * worker, or while another thread is using the pool, simply runs inline on
+ * the calling thread.
+ */
+
+#define MAX_THREADS 256
+#define SPIN_COUNT 2000
+
+typedef struct {
+    int next;
+    int end;
+    char pad[56];
+} segment;
+
+typedef struct {
+    int threads;
+    pthread_t *workers;
+    segment *segments;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int generation;
+    int start_generation;
+    int pending;
+    int shutdown;
+
+    parallel_func func;
+    void *args;
+    int grain;
+} thread_pool;
+
+static thread_pool pool = {0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_config = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread int in_parallel = 0;
+
+static void run_segments(int id)
+{
+    int t;
+    for(t = 0; t < pool.threads; ++t){
+        segment *s = pool.segments + (id + t) % pool.threads;
+        while(1){
+            int start = __atomic_fetch_add(&s->next, pool.grain, __ATOMIC_RELAXED);
+            if(start >= s->end) break;
+            int end = (s->end - start < pool.grain) ? s->end : start + pool.grain;
+            pool.func(start, end, pool.args);
+        }
+    }
+}
+
+static void *pool_worker(void *ptr)
+{
+    int id = (int)(size_t)ptr;
+    int seen = pool.start_generation;
+    in_parallel = 1;
+    while(1){
+        int i;
+        for(i = 0; i < SPIN_COUNT && __atomic_load_n(&pool.generation, __ATOMIC_ACQUIRE) == seen; ++i) sched_yield();
+        pthread_mutex_lock(&pool.mutex);
+        while(pool.generation == seen) pthread_cond_wait(&pool.wake, &pool.mutex);
+        seen = pool.generation;
+        int shutdown = pool.shutdown;
+        pthread_mutex_unlock(&pool.mutex);
+        if(shutdown) break;
+
+        run_segments(id);
+        if(__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_ACQ_REL) == 0){
+            pthread_mutex_lock(&pool.mutex);
+            pthread_cond_signal(&pool.done);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+    }
+    return 0;
+}
+
+/* Tears the pool down, segments included; a pool of one thread has no workers to join. */
+static void stop_workers()
+{
+    int i;
+    pthread_mutex_lock(&pool.mutex);
+    pool.shutdown = 1;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+    for(i = 0; i < pool.threads - 1; ++i) pthread_join(pool.workers[i], 0);
+    free(pool.workers);
+    free(pool.segments);
+    pool.workers = 0;
+    pool.segments = 0;
+    pool.shutdown = 0;
+}
+
+void set_num_threads(int threads)
+{
+    int i;
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+
+    pthread_mutex_lock(&pool_config);
+    pthread_mutex_lock(&pool_busy);
+    if(threads != pool.threads){
+        if(pool.threads) stop_workers();
+        pool.segments = calloc(threads, sizeof(segment));
+        if(threads > 1) pool.workers = calloc(threads - 1, sizeof(pthread_t));
+        pool.start_generation = pool.generation;
+        for(i = 0; i < threads - 1; ++i){
+            if(pthread_create(pool.workers + i, 0, pool_worker, (void *)(size_t)(i + 1))) error("Thread creation failed");
+        }
+        __atomic_store_n(&pool.threads, threads, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool_busy);
+    pthread_mutex_unlock(&pool_config);
+}
+
+static void default_pool()
+{
+    if(!__atomic_load_n(&pool.threads, __ATOMIC_ACQUIRE)) set_num_threads(0);
+}
+
+int get_num_threads()
+{
+    pthread_once(&pool_once, default_pool);
+    return pool.threads;
+}
+
+void parallel_for(int n, int grain, parallel_func func, void *args)
+{
+    int t, i;
+    if(n <= 0) return;
+    if(grain < 1) grain = 1;
+    if(n <= grain || in_parallel || get_num_threads() < 2 || pthread_mutex_trylock(&pool_busy)){
+        func(0, n, args);
+        return;
+    }
+    in_parallel = 1;
+
+    int threads = pool.threads;
+    int per = (n + threads - 1)/threads;
+    per = (per + grain - 1)/grain*grain;
+    for(t = 0; t < threads; ++t){
+        int start = t*per;
+        pool.segments[t].next = (start < n) ? start : n;
+        pool.segments[t].end = (start + per < n) ? start + per : n;
+    }
+    pool.func = func;
+    pool.args = args;
+    pool.grain = grain;
+    pool.pending = threads - 1;
+
+    pthread_mutex_lock(&pool.mutex);
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+
+    run_segments(0);
+
+    for(i = 0; i < SPIN_COUNT && __atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE); ++i) sched_yield();
+    pthread_mutex_lock(&pool.mutex);
+    while(__atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE)) pthread_cond_wait(&pool.done, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+
+    in_parallel = 0;
+    pthread_mutex_unlock(&pool_busy);
+}
@@ -0,0 +1,11 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include "darknet.h"
+
+/* Body of a parallel loop: handles indices [start, end). */
+typedef void (*parallel_func)(int start, int end, void *args);
+
+int get_num_threads();
+void parallel_for(int n, int grain, parallel_func func, void *args);
+
+#endif
@@ -36,6 +36,11 @@
 #include "softmax_layer.h"
 #include "lstm_layer.h"
 #include "utils.h"
+#include "winograd.h"
+#include "blocked.h"
+#include "quantize.h"
+#include "layer.h"
+#include "weights_map.h"
 
 typedef struct{
     char *type;
@@ -202,6 +207,8 @@ convolutional_layer parse_convolutional(list *options, size_params params)
     convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
+    if(option_find_int_quiet(options, "winograd", params.net->winograd)) make_winograd_weights(&layer);
+    make_packed_weights(&layer);
 
     return layer;
 }
@@ -264,6 +271,7 @@ layer parse_connected(list *options, size_params params)
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
     layer l = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.net->adam);
+    make_packed_weights(&l);
     return l;
 }
 
@@ -690,6 +698,16 @@ void parse_net_options(list *options, network *net)
     net->exposure = option_find_float_quiet(options, "exposure", 1);
     net->hue = option_find_float_quiet(options, "hue", 0);
 
+    int threads = option_find_int_quiet(options, "threads", 0);
+    if(threads) set_num_threads(threads);
+
+    char *layout = option_find(options, "layout");
+    if(layout && strcmp(layout, "nchw8c") == 0) net->blocked = 1;
+    else if(layout && strcmp(layout, "nchw") != 0) fprintf(stderr, "Couldn't find layout %s, going with nchw\n", layout);
+
+    /* Winograd keeps its transformed weights, four times the originals, beside them; opt in. */
+    net->winograd = option_find_int_quiet(options, "winograd", 0);
+
     if(!net->inputs && !(net->h && net->w && net->c)) error("No input parameters supplied");
 
     char *policy_s = option_find_str(options, "policy", "constant");
@@ -739,13 +757,15 @@ int is_network(section *s)
             || strcmp(s->type, "[network]")==0);
 }
 
-network *parse_network_cfg(char *filename)
+static network *parse_network(char *filename, int inference_only)
 {
     list *sections = read_cfg(filename);
     node *n = sections->front;
     if(!n) error("Config file has no sections");
     network *net = make_network(sections->size - 1);
     net->gpu_index = gpu_index;
+    net->inference_only = inference_only;
+    set_training_buffers(!inference_only);
     size_params params;
 
     section *s = (section *)n->val;
@@ -837,6 +857,7 @@ network *parse_network_cfg(char *filename)
         }else{
             fprintf(stderr, "Type not recognized: %s\n", s->type);
         }
+        if(inference_only) free_layer_training(&l);
         l.clip = net->clip;
         l.truth = option_find_int_quiet(options, "truth", 0);
         l.onlyforward = option_find_int_quiet(options, "onlyforward", 0);
@@ -861,37 +882,52 @@ network *parse_network_cfg(char *filename)
         }
     }
     free_list(sections);
+    set_training_buffers(1);
     layer out = get_network_output_layer(net);
     net->outputs = out.outputs;
     net->truths = out.outputs;
     if(net->layers[net->n-1].truths) net->truths = net->layers[net->n-1].truths;
     net->output = out.output;
     net->input = calloc(net->inputs*net->batch, sizeof(float));
-    net->truth = calloc(net->truths*net->batch, sizeof(float));
+    if(!inference_only) net->truth = calloc(net->truths*net->batch, sizeof(float));
+    net->allocated_batch = net->batch;
 #ifdef GPU
     net->output_gpu = out.output_gpu;
     net->input_gpu = cuda_make_array(net->input, net->inputs*net->batch);
-    net->truth_gpu = cuda_make_array(net->truth, net->truths*net->batch);
+    if(!inference_only) net->truth_gpu = cuda_make_array(net->truth, net->truths*net->batch);
 #endif
-    if(workspace_size){
-        //printf("%ld\n", workspace_size);
 #ifdef GPU
-        if(gpu_index >= 0){
+    if(gpu_index >= 0){
+        if(workspace_size){
             net->workspace = cuda_make_array(0, (workspace_size-1)/sizeof(float)+1);
-        }else {
-            net->workspace = calloc(1, workspace_size);
+            net->workspace_size = workspace_size;
         }
+    }else {
+        make_network_workspace(net, 0);
+    }
 #else
-        net->workspace = calloc(1, workspace_size);
+    make_network_workspace(net, 0);
 #endif
-    }
+    plan_blocked_layout(net);
     return net;
 }
 
+network *parse_network_cfg(char *filename)
+{
+    return parse_network(filename, 0);
+}
+
+/* A network that can only run forward: no deltas, updates or optimizer state. */
+network *parse_network_cfg_inference(char *filename)
+{
+    return parse_network(filename, 1);
+}
+
 list *read_cfg(char *filename)
 {
     FILE *file = fopen(filename, "r");
     if(file == 0) file_error(filename);
+    seek_snapshot_cfg(file);
     char *line;
     int nu = 0;
     list *options = make_list();
@@ -1004,7 +1040,7 @@ void save_connected_weights(layer l, FILE *fp)
     }
 }
 
-void save_weights_upto(network *net, char *filename, int cutoff)
+static FILE *create_weights_file(network *net, char *filename, int revision)
 {
 #ifdef GPU
     if(net->gpu_index >= 0){
@@ -1017,66 +1053,101 @@ void save_weights_upto(network *net, char *filename, int cutoff)
 
     int major = 0;
     int minor = 2;
-    int revision = 0;
     fwrite(&major, sizeof(int), 1, fp);
     fwrite(&minor, sizeof(int), 1, fp);
     fwrite(&revision, sizeof(int), 1, fp);
     fwrite(net->seen, sizeof(size_t), 1, fp);
+    return fp;
+}
 
+static void save_layer_weights(layer l, FILE *fp)
+{
+    if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
+        save_convolutional_weights(l, fp);
+    } if(l.type == CONNECTED){
+        save_connected_weights(l, fp);
+    } if(l.type == BATCHNORM){
+        save_batchnorm_weights(l, fp);
+    } if(l.type == RNN){
+        save_connected_weights(*(l.input_layer), fp);
+        save_connected_weights(*(l.self_layer), fp);
+        save_connected_weights(*(l.output_layer), fp);
+    } if (l.type == LSTM) {
+        save_connected_weights(*(l.wi), fp);
+        save_connected_weights(*(l.wf), fp);
+        save_connected_weights(*(l.wo), fp);
+        save_connected_weights(*(l.wg), fp);
+        save_connected_weights(*(l.ui), fp);
+        save_connected_weights(*(l.uf), fp);
+        save_connected_weights(*(l.uo), fp);
+        save_connected_weights(*(l.ug), fp);
+    } if (l.type == GRU) {
+        if(1){
+            save_connected_weights(*(l.wz), fp);
+            save_connected_weights(*(l.wr), fp);
+            save_connected_weights(*(l.wh), fp);
+            save_connected_weights(*(l.uz), fp);
+            save_connected_weights(*(l.ur), fp);
+            save_connected_weights(*(l.uh), fp);
+        }else{
+            save_connected_weights(*(l.reset_layer), fp);
+            save_connected_weights(*(l.update_layer), fp);
+            save_connected_weights(*(l.state_layer), fp);
+        }
+    }  if(l.type == CRNN){
+        save_convolutional_weights(*(l.input_layer), fp);
+        save_convolutional_weights(*(l.self_layer), fp);
+        save_convolutional_weights(*(l.output_layer), fp);
+    } if(l.type == LOCAL){
+#ifdef GPU
+        if(gpu_index >= 0){
+            pull_local_layer(l);
+        }
+#endif
+        int locations = l.out_w*l.out_h;
+        int size = l.size*l.size*l.c*l.n*locations;
+        fwrite(l.biases, sizeof(float), l.outputs, fp);
+        fwrite(l.weights, sizeof(float), size, fp);
+    }
+}
+
+void save_weights_upto(network *net, char *filename, int cutoff)
+{
+    FILE *fp = create_weights_file(net, filename, 0);
     int i;
     for(i = 0; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontsave) continue;
-        if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
-            save_convolutional_weights(l, fp);
-        } if(l.type == CONNECTED){
-            save_connected_weights(l, fp);
-        } if(l.type == BATCHNORM){
-            save_batchnorm_weights(l, fp);
-        } if(l.type == RNN){
-            save_connected_weights(*(l.input_layer), fp);
-            save_connected_weights(*(l.self_layer), fp);
-            save_connected_weights(*(l.output_layer), fp);
-        } if (l.type == LSTM) {
-            save_connected_weights(*(l.wi), fp);
-            save_connected_weights(*(l.wf), fp);
-            save_connected_weights(*(l.wo), fp);
-            save_connected_weights(*(l.wg), fp);
-            save_connected_weights(*(l.ui), fp);
-            save_connected_weights(*(l.uf), fp);
-            save_connected_weights(*(l.uo), fp);
-            save_connected_weights(*(l.ug), fp);
-        } if (l.type == GRU) {
-            if(1){
-                save_connected_weights(*(l.wz), fp);
-                save_connected_weights(*(l.wr), fp);
-                save_connected_weights(*(l.wh), fp);
-                save_connected_weights(*(l.uz), fp);
-                save_connected_weights(*(l.ur), fp);
-                save_connected_weights(*(l.uh), fp);
-            }else{
-                save_connected_weights(*(l.reset_layer), fp);
-                save_connected_weights(*(l.update_layer), fp);
-                save_connected_weights(*(l.state_layer), fp);
-            }
-        }  if(l.type == CRNN){
-            save_convolutional_weights(*(l.input_layer), fp);
-            save_convolutional_weights(*(l.self_layer), fp);
-            save_convolutional_weights(*(l.output_layer), fp);
-        } if(l.type == LOCAL){
-#ifdef GPU
-            if(gpu_index >= 0){
-                pull_local_layer(l);
+        save_layer_weights(l, fp);
+    }
+    fclose(fp);
+}
+
+/*
+ * Same layout as save_weights, except that every int8-eligible layer is
+ * preceded by a flag: layers with a calibrated range (ranges[i] > 0) are
+ * stored quantized, the rest in float as usual.
+ */
+void save_weights_int8(network *net, float *ranges, char *filename)
+{
+    FILE *fp = create_weights_file(net, filename, INT8_WEIGHTS_REVISION);
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if (l.dontsave) continue;
+        if(int8_eligible(l)){
+            int quantized = ranges[i] > 0;
+            fwrite(&quantized, sizeof(int), 1, fp);
+            if(quantized){
+                save_int8_weights(l, ranges[i], fp);
+                continue;
             }
-#endif
-            int locations = l.out_w*l.out_h;
-            int size = l.size*l.size*l.c*l.n*locations;
-            fwrite(l.biases, sizeof(float), l.outputs, fp);
-            fwrite(l.weights, sizeof(float), size, fp);
         }
+        save_layer_weights(l, fp);
     }
     fclose(fp);
 }
+
 void save_weights(network *net, char *filename)
 {
     save_weights_upto(net, filename, net->n);
@@ -1222,6 +1293,11 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         cuda_set_device(net->gpu_index);
     }
 #endif
+    if(is_mapped_weights(filename)){
+        fprintf(stderr, "Loading mapped weights from %s\n", filename);
+        load_mapped_weights(net, filename, start, cutoff);
+        return;
+    }
     fprintf(stderr, "Loading weights from %s...", filename);
     fflush(stdout);
     FILE *fp = fopen(filename, "rb");
@@ -1242,15 +1318,29 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
     }
     int transpose = (major > 1000) || (minor > 1000);
 
+    int int8_layers = 0;
     int i;
     for(i = start; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontload) continue;
+        if(revision == INT8_WEIGHTS_REVISION && int8_eligible(l)){
+            int quantized = 0;
+            fread(&quantized, sizeof(int), 1, fp);
+            if(quantized){
+                load_int8_weights(net->layers + i, fp);
+                ++int8_layers;
+                continue;
+            }
+        }
         if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
             load_convolutional_weights(l, fp);
+            winograd_transform_weights(l);
+            blocked_transform_weights(l);
+            pack_weights(l);
         }
         if(l.type == CONNECTED){
             load_connected_weights(l, fp, transpose);
+            pack_weights(l);
         }
         if(l.type == BATCHNORM){
             load_batchnorm_weights(l, fp);
@@ -1303,6 +1393,10 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
     }
     fprintf(stderr, "Done!\n");
     fclose(fp);
+    if(int8_layers){
+        fprintf(stderr, "int8: %d layers\n", int8_layers);
+        plan_blocked_layout(net);
+    }
 }
 
 void load_weights(network *net, char *filename)
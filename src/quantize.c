@@ -0,0 +1,537 @@
+#include "quantize.h"
+#include "activations.h"
+#include "parallel.h"
+#include "utils.h"
+#include "convolutional_layer.h"
+#include "connected_layer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Post-training int8 inference for convolutional and connected layers.
+ *
+ * Weights are quantized symmetrically per output channel,
+ * w ~= weight_scales[m]*q[m][k] with q in [-127, 127], after batchnorm has
+ * been folded into them.  Activations get one symmetric scale per layer,
+ * input_scale = range/127, from the ranges calibrate_network() records.
+ *
+ * The kernels multiply unsigned by signed bytes (vpmaddubsw, vpdpbusd), so
+ * the quantized input is shifted by 128 into [1, 255] and the shift is
+ * removed again in the epilogue with weight_sums[m] = 128*sum_k q[m][k]:
+ *
+ *     y[m][p] = (acc[m][p] - weight_sums[m])*input_scale*weight_scales[m] + bias[m]
+ *
+ * The convolution is the usual GEMM of the weights with the im2col matrix.
+ * The input is quantized once into a zero-padded byte image, then the
+ * columns are packed a panel of INT8_NR pixels at a time as [k/4][pixel][k%4]
+ * bytes, the operand layout of the dot-product instructions, so im2col never
+ * exists in full.  Connected layers are the same GEMM with one column per
+ * batch item.
+ *
+ * vpmaddubsw adds pairs of u8*s8 products into saturating 16-bit lanes, and
+ * 255*127*2 overflows them.  The AVX2 kernel therefore runs on weights
+ * requantized to 7 bits; VNNI and the generic kernel accumulate straight
+ * into 32 bits and keep the full range.
+ */
+
+#define INT8_MR 8
+#define INT8_NR 32
+
+typedef void (*int8_micro_kernel)(int k4, const signed char *a, int lda, const unsigned char *b, int *c);
+
+typedef struct {
+    const char *name;
+    int weight_bits;
+    int8_micro_kernel kernel;
+} int8_kernel;
+
+static inline int load_int(const void *p)
+{
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* c[INT8_MR][INT8_NR] = a[INT8_MR][4*k4] * b[k4][INT8_NR][4] */
+static void int8_kernel_generic(int k4, const signed char *a, int lda, const unsigned char *b, int *c)
+{
+    int i, j, k;
+    memset(c, 0, INT8_MR*INT8_NR*sizeof(int));
+    for(k = 0; k < k4; ++k){
+        for(i = 0; i < INT8_MR; ++i){
+            const signed char *w = a + i*lda + 4*k;
+            int *ci = c + i*INT8_NR;
+            for(j = 0; j < INT8_NR; ++j){
+                const unsigned char *x = b + 4*j;
+                ci[j] += w[0]*x[0] + w[1]*x[1] + w[2]*x[2] + w[3]*x[3];
+            }
+        }
+        b += 4*INT8_NR;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INT8_X86
+
+__attribute__((target("avx2")))
+static void int8_kernel_avx2(int k4, const signed char *a, int lda, const unsigned char *b, int *c)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    int i, j, k;
+    for(i = 0; i < INT8_MR; i += 2){
+        __m256i acc[2][4];
+        const unsigned char *bk = b;
+        for(j = 0; j < 4; ++j){
+            acc[0][j] = _mm256_setzero_si256();
+            acc[1][j] = _mm256_setzero_si256();
+        }
+        for(k = 0; k < k4; ++k){
+            __m256i w0 = _mm256_set1_epi32(load_int(a + i*lda + 4*k));
+            __m256i w1 = _mm256_set1_epi32(load_int(a + (i + 1)*lda + 4*k));
+            for(j = 0; j < 4; ++j){
+                __m256i x = _mm256_loadu_si256((const __m256i *)(bk + 32*j));
+                acc[0][j] = _mm256_add_epi32(acc[0][j], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w0), ones));
+                acc[1][j] = _mm256_add_epi32(acc[1][j], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w1), ones));
+            }
+            bk += 4*INT8_NR;
+        }
+        for(j = 0; j < 4; ++j){
+            _mm256_storeu_si256((__m256i *)(c + i*INT8_NR + 8*j), acc[0][j]);
+            _mm256_storeu_si256((__m256i *)(c + (i + 1)*INT8_NR + 8*j), acc[1][j]);
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void int8_kernel_vnni(int k4, const signed char *a, int lda, const unsigned char *b, int *c)
+{
+    __m512i acc[INT8_MR][2];
+    int i, k;
+    for(i = 0; i < INT8_MR; ++i){
+        acc[i][0] = _mm512_setzero_si512();
+        acc[i][1] = _mm512_setzero_si512();
+    }
+    for(k = 0; k < k4; ++k){
+        __m512i x0 = _mm512_loadu_si512(b);
+        __m512i x1 = _mm512_loadu_si512(b + 64);
+        for(i = 0; i < INT8_MR; ++i){
+            __m512i w = _mm512_set1_epi32(load_int(a + i*lda + 4*k));
+            acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], x0, w);
+            acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], x1, w);
+        }
+        b += 4*INT8_NR;
+    }
+    for(i = 0; i < INT8_MR; ++i){
+        _mm512_storeu_si512(c + i*INT8_NR, acc[i][0]);
+        _mm512_storeu_si512(c + i*INT8_NR + 16, acc[i][1]);
+    }
+}
+#endif
+
+static int8_kernel int8_kernels[] = {
+#ifdef INT8_X86
+    {"vnni", 8, int8_kernel_vnni},
+    {"avx2", 7, int8_kernel_avx2},
+#endif
+    {"generic", 8, int8_kernel_generic},
+};
+
+static int8_kernel *int8_selected = 0;
+
+static int8_kernel *select_int8_kernel()
+{
+    if(int8_selected) return int8_selected;
+    int8_kernel *k = &int8_kernels[sizeof(int8_kernels)/sizeof(int8_kernels[0]) - 1];
+#ifdef INT8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) k = &int8_kernels[0];
+    else if(__builtin_cpu_supports("avx2")) k = &int8_kernels[1];
+#endif
+    int8_selected = k;
+    return k;
+}
+
+int int8_eligible(layer l)
+{
+    if(l.type == CONVOLUTIONAL) return l.groups == 1 && !l.binary && !l.xnor;
+    return l.type == CONNECTED;
+}
+
+static int int8_rows(layer l)
+{
+    return (l.type == CONNECTED) ? l.outputs : l.n;
+}
+
+static int int8_cols(layer l)
+{
+    return (l.type == CONNECTED) ? l.inputs : l.nweights/l.n;
+}
+
+void fold_batchnorm(layer l, float *weights, float *biases)
+{
+    int i, j;
+    int rows = int8_rows(l);
+    int cols = int8_cols(l);
+    if(weights != l.weights) memcpy(weights, l.weights, rows*cols*sizeof(float));
+    if(biases != l.biases) memcpy(biases, l.biases, rows*sizeof(float));
+    if(!l.batch_normalize) return;
+    for(i = 0; i < rows; ++i){
+        float s = l.scales[i]/(sqrtf(l.rolling_variance[i]) + .000001f);
+        for(j = 0; j < cols; ++j){
+            weights[i*cols + j] *= s;
+        }
+        biases[i] -= l.rolling_mean[i]*s;
+    }
+}
+
+void quantize_weights(float *weights, int rows, int cols, signed char *q, float *scales)
+{
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        float *w = weights + i*cols;
+        float max = 0;
+        for(j = 0; j < cols; ++j){
+            if(fabsf(w[j]) > max) max = fabsf(w[j]);
+        }
+        scales[i] = (max > 0) ? max/127 : 1;
+        for(j = 0; j < cols; ++j){
+            q[i*cols + j] = constrain_int(lrintf(w[j]/scales[i]), -127, 127);
+        }
+    }
+}
+
+void make_int8_weights(layer *l, signed char *q, float *scales, float input_scale)
+{
+    int i, j;
+    int8_kernel *k = select_int8_kernel();
+    int rows = int8_rows(*l);
+    int cols = int8_cols(*l);
+    int lda = (cols + 3)/4*4;
+    int mpad = (rows + INT8_MR - 1)/INT8_MR*INT8_MR;
+
+    free(l->int8_weights);
+    free(l->weight_scales);
+    free(l->weight_sums);
+    l->int8_weights = calloc((size_t)mpad*lda, sizeof(signed char));
+    l->weight_scales = calloc(rows, sizeof(float));
+    l->weight_sums = calloc(rows, sizeof(int));
+    l->input_scale = input_scale;
+
+    for(i = 0; i < rows; ++i){
+        signed char *a = l->int8_weights + (size_t)i*lda;
+        int sum = 0;
+        l->weight_scales[i] = scales[i];
+        for(j = 0; j < cols; ++j){
+            int v = q[i*cols + j];
+            l->weights[i*cols + j] = v*scales[i];
+            if(k->weight_bits < 8) v = constrain_int(lrintf(v/2.f), -63, 63);
+            a[j] = v;
+            sum += v;
+        }
+        if(k->weight_bits < 8) l->weight_scales[i] *= 2;
+        l->weight_sums[i] = 128*sum;
+    }
+}
+
+/* Folded biases, weight scales, input scale, then the row-major int8 weights. */
+void save_int8_weights(layer l, float range, FILE *fp)
+{
+    int rows = int8_rows(l);
+    int cols = int8_cols(l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        if(l.type == CONNECTED) pull_connected_layer(l);
+        else pull_convolutional_layer(l);
+    }
+#endif
+    float *weights = calloc((size_t)rows*cols, sizeof(float));
+    float *biases = calloc(rows, sizeof(float));
+    float *scales = calloc(rows, sizeof(float));
+    signed char *q = calloc((size_t)rows*cols, sizeof(signed char));
+    float input_scale = range/127;
+
+    fold_batchnorm(l, weights, biases);
+    quantize_weights(weights, rows, cols, q, scales);
+    fwrite(biases, sizeof(float), rows, fp);
+    fwrite(scales, sizeof(float), rows, fp);
+    fwrite(&input_scale, sizeof(float), 1, fp);
+    fwrite(q, sizeof(signed char), (size_t)rows*cols, fp);
+
+    free(weights);
+    free(biases);
+    free(scales);
+    free(q);
+}
+
+void load_int8_weights(layer *l, FILE *fp)
+{
+    int rows = int8_rows(*l);
+    int cols = int8_cols(*l);
+    float *scales = calloc(rows, sizeof(float));
+    signed char *q = calloc((size_t)rows*cols, sizeof(signed char));
+    float input_scale = 0;
+
+    fread(l->biases, sizeof(float), rows, fp);
+    fread(scales, sizeof(float), rows, fp);
+    fread(&input_scale, sizeof(float), 1, fp);
+    fread(q, sizeof(signed char), (size_t)rows*cols, fp);
+    make_int8_weights(l, q, scales, input_scale);
+    free(scales);
+    free(q);
+
+    /* Batchnorm is folded into the biases; the float paths must not apply it again. */
+    l->batch_normalize = 0;
+    free(l->winograd_weights);
+    l->winograd_weights = 0;
+#ifdef GPU
+    if(gpu_index >= 0){
+        if(l->type == CONNECTED) push_connected_layer(*l);
+        else push_convolutional_layer(*l);
+    }
+#endif
+}
+
+typedef struct {
+    layer l;
+    unsigned char *input;
+    int *koff;
+    float *output;
+    int cols;
+    int ldm, ldp;
+    int mchunk, mtasks;
+    int8_micro_kernel kernel;
+} int8_args;
+
+/*
+ * Quantized input values sit at input[koff[k] + pixel_offset(p)], so the
+ * same packing serves convolution (koff walks channel/ky/kx, the pixel
+ * offset the output position) and connected layers (koff = k, pixel
+ * offset = batch item).
+ */
+static int pixel_offset(layer l, int p)
+{
+    if(l.type == CONNECTED) return p*l.inputs;
+    int wp = l.w + 2*l.pad;
+    return (p / l.out_w)*l.stride*wp + (p % l.out_w)*l.stride;
+}
+
+/*
+ * Panel of INT8_NR columns as [k/4][pixel][k%4].  When the panel's pixels
+ * are consecutive in the input (stride 1, no row wrap) every group of four
+ * k reads four contiguous runs, which vectorizes; otherwise it gathers.
+ */
+static void pack_panel(unsigned char *input, int *koff, int cols, int *off, int contiguous, unsigned char *panel)
+{
+    int j, k;
+    int k4 = (cols + 3)/4;
+    memset(panel + (size_t)(k4 - 1)*4*INT8_NR, 128, 4*INT8_NR);
+    k = 0;
+    if(contiguous){
+        for(; k + 4 <= cols; k += 4){
+            unsigned char *s0 = input + koff[k] + off[0];
+            unsigned char *s1 = input + koff[k+1] + off[0];
+            unsigned char *s2 = input + koff[k+2] + off[0];
+            unsigned char *s3 = input + koff[k+3] + off[0];
+            unsigned char *dst = panel + k*INT8_NR;
+            for(j = 0; j < INT8_NR; ++j){
+                dst[4*j + 0] = s0[j];
+                dst[4*j + 1] = s1[j];
+                dst[4*j + 2] = s2[j];
+                dst[4*j + 3] = s3[j];
+            }
+        }
+    }
+    for(; k < cols; ++k){
+        unsigned char *src = input + koff[k];
+        unsigned char *dst = panel + (k/4)*4*INT8_NR + k%4;
+        for(j = 0; j < INT8_NR; ++j){
+            dst[4*j] = src[off[j]];
+        }
+    }
+}
+
+/* Undo the input shift, rescale, add the bias; contiguous rows get the activation too. */
+static void int8_epilogue(layer l, int m, int *c, int np, float *out, int ldp)
+{
+    int j;
+    float scale = l.input_scale*l.weight_scales[m];
+    float bias = l.biases[m];
+    int sum = l.weight_sums[m];
+    if(ldp != 1){
+        for(j = 0; j < np; ++j) out[j*ldp] = (c[j] - sum)*scale + bias;
+        return;
+    }
+    for(j = 0; j < np; ++j) out[j] = (c[j] - sum)*scale + bias;
+    if(l.activation == LEAKY){
+        for(j = 0; j < np; ++j) out[j] = (out[j] > 0) ? out[j] : .1f*out[j];
+    } else if(l.activation != LINEAR){
+        activate_array(out, np, l.activation);
+    }
+}
+
+static void int8_gemm_tasks(int start, int end, void *ptr)
+{
+    static __thread unsigned char *panel = 0;
+    static __thread size_t panel_size = 0;
+    int8_args a = *(int8_args *)ptr;
+    layer l = a.l;
+    int rows = int8_rows(l);
+    int k4 = (int8_cols(l) + 3)/4;
+    int lda = 4*k4;
+    int off[INT8_NR];
+    int c[INT8_MR*INT8_NR];
+    int t, i, j, m;
+
+    if((size_t)k4*4*INT8_NR > panel_size){
+        free(panel);
+        panel_size = (size_t)k4*4*INT8_NR;
+        if(posix_memalign((void **)&panel, 64, panel_size)) malloc_error();
+    }
+    for(t = start; t < end; ++t){
+        int p0 = (t / a.mtasks)*INT8_NR;
+        int m0 = (t % a.mtasks)*a.mchunk;
+        int m1 = (m0 + a.mchunk < rows) ? m0 + a.mchunk : rows;
+        int np = (a.cols - p0 < INT8_NR) ? a.cols - p0 : INT8_NR;
+        for(j = 0; j < INT8_NR; ++j){
+            off[j] = pixel_offset(l, p0 + ((j < np) ? j : np - 1));
+        }
+        pack_panel(a.input, a.koff, int8_cols(l), off, off[INT8_NR-1] - off[0] == INT8_NR - 1, panel);
+        for(m = m0; m < m1; m += INT8_MR){
+            a.kernel(k4, l.int8_weights + (size_t)m*lda, lda, panel, c);
+            for(i = 0; i < INT8_MR && m + i < m1; ++i){
+                float *out = a.output + (m + i)*a.ldm + p0*a.ldp;
+                int8_epilogue(l, m + i, c + i*INT8_NR, np, out, a.ldp);
+            }
+        }
+        if(a.ldp != 1){
+            for(j = 0; j < np; ++j) activate_array(a.output + (p0 + j)*a.ldp + m0, m1 - m0, l.activation);
+        }
+    }
+}
+
+typedef struct {
+    float *in;
+    unsigned char *out;
+    float inv;
+    int h, w, pad;
+} quantize_args;
+
+/* One padded plane per index: q = round(x/scale) + 128, padding reads as 0. */
+static void quantize_planes(int start, int end, void *ptr)
+{
+    quantize_args a = *(quantize_args *)ptr;
+    int wp = a.w + 2*a.pad;
+    int hp = a.h + 2*a.pad;
+    int c, y, x;
+    for(c = start; c < end; ++c){
+        float *in = a.in + (size_t)c*a.h*a.w;
+        unsigned char *out = a.out + (size_t)c*hp*wp;
+        if(a.pad) memset(out, 128, (size_t)hp*wp);
+        for(y = 0; y < a.h; ++y){
+            unsigned char *row = out + (y + a.pad)*wp + a.pad;
+            for(x = 0; x < a.w; ++x){
+                float v = in[y*a.w + x]*a.inv;
+                v = (v > 127) ? 127 : (v < -127) ? -127 : v;
+                row[x] = (int)lrintf(v) + 128;
+            }
+        }
+    }
+}
+
+static unsigned char *quantize_input(layer l, float *input, int planes, int h, int w, int pad)
+{
+    static __thread unsigned char *buf = 0;
+    static __thread size_t buf_size = 0;
+    size_t size = (size_t)planes*(h + 2*pad)*(w + 2*pad);
+    if(size > buf_size){
+        free(buf);
+        buf = calloc(size, 1);
+        if(!buf) malloc_error();
+        buf_size = size;
+    }
+    quantize_args args = {0};
+    args.in = input;
+    args.out = buf;
+    args.inv = 1./l.input_scale;
+    args.h = h;
+    args.w = w;
+    args.pad = pad;
+    parallel_for(planes, 1, quantize_planes, &args);
+    return buf;
+}
+
+static int *int8_offsets(layer l)
+{
+    static __thread int *koff = 0;
+    static __thread int koff_size = 0;
+    int cols = int8_cols(l);
+    int k, c, ky, kx;
+    if(cols > koff_size){
+        free(koff);
+        koff = calloc(cols, sizeof(int));
+        if(!koff) malloc_error();
+        koff_size = cols;
+    }
+    if(l.type == CONNECTED){
+        for(k = 0; k < cols; ++k) koff[k] = k;
+        return koff;
+    }
+    int wp = l.w + 2*l.pad;
+    int hp = l.h + 2*l.pad;
+    k = 0;
+    for(c = 0; c < l.c; ++c){
+        for(ky = 0; ky < l.size; ++ky){
+            for(kx = 0; kx < l.size; ++kx){
+                koff[k++] = (c*hp + ky)*wp + kx;
+            }
+        }
+    }
+    return koff;
+}
+
+static void int8_gemm(layer l, unsigned char *input, int *koff, float *output, int cols, int ldm, int ldp)
+{
+    int rows = int8_rows(l);
+    int panels = (cols + INT8_NR - 1)/INT8_NR;
+    int threads = get_num_threads();
+    int8_args args = {0};
+    args.l = l;
+    args.input = input;
+    args.koff = koff;
+    args.output = output;
+    args.cols = cols;
+    args.ldm = ldm;
+    args.ldp = ldp;
+    args.kernel = select_int8_kernel()->kernel;
+    args.mtasks = 1;
+    /* Too few panels to go around (small maps, connected layers): split the rows too. */
+    if(panels < 2*threads){
+        args.mtasks = (2*threads + panels - 1)/panels;
+        if(args.mtasks > (rows + 31)/32) args.mtasks = (rows + 31)/32;
+        if(args.mtasks < 1) args.mtasks = 1;
+    }
+    args.mchunk = (rows + args.mtasks - 1)/args.mtasks;
+    args.mchunk = (args.mchunk + INT8_MR - 1)/INT8_MR*INT8_MR;
+    args.mtasks = (rows + args.mchunk - 1)/args.mchunk;
+    parallel_for(panels*args.mtasks, 1, int8_gemm_tasks, &args);
+}
+
+void forward_convolutional_int8(layer l, network net)
+{
+    int i;
+    int *koff = int8_offsets(l);
+    int spatial = l.out_h*l.out_w;
+    for(i = 0; i < l.batch; ++i){
+        unsigned char *q = quantize_input(l, net.input + i*l.inputs, l.c, l.h, l.w, l.pad);
+        int8_gemm(l, q, koff, l.output + i*l.outputs, spatial, spatial, 1);
+    }
+}
+
+void forward_connected_int8(layer l, network net)
+{
+    int *koff = int8_offsets(l);
+    unsigned char *q = quantize_input(l, net.input, l.batch, 1, l.inputs, 0);
+    int8_gemm(l, q, koff, l.output, l.batch, 1, l.outputs);
+}
@@ -0,0 +1,19 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+#include <stdio.h>
+#include "darknet.h"
+
+/* Weights file revision marking the int8 variant written by save_weights_int8. */
+#define INT8_WEIGHTS_REVISION 8
+
+int int8_eligible(layer l);
+void fold_batchnorm(layer l, float *weights, float *biases);
+void quantize_weights(float *weights, int rows, int cols, signed char *q, float *scales);
+void make_int8_weights(layer *l, signed char *q, float *scales, float input_scale);
+void save_int8_weights(layer l, float range, FILE *fp);
+void load_int8_weights(layer *l, FILE *fp);
+
+void forward_convolutional_int8(layer l, network net);
+void forward_connected_int8(layer l, network net);
+
+#endif
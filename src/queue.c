@@ -0,0 +1,165 @@
+#include "darknet.h"
+#include "utils.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/*
+ * Bounded multi-producer, multi-consumer queue of pointers, for handing
+ * work between the stages of a pipeline.
+ *
+ * The ring is lock-free: every cell carries a sequence number saying whose
+ * turn it is, producers and consumers claim positions with a CAS and never
+ * wait on each other while there is room or work. A full or empty queue
+ * spins briefly and then sleeps, so a stage that outruns its neighbours
+ * blocks (backpressure) rather than burning a core. The sleeping side
+ * counts itself in before its last look at the ring and the other side
+ * checks that count after its update; all of it is sequentially consistent
+ * so one of the two always sees the other and no wakeup is lost.
+ */
+
+#define QUEUE_SPIN 64
+
+typedef struct{
+    size_t sequence;
+    void *item;
+} queue_cell;
+
+struct bounded_queue{
+    queue_cell *cells;
+    size_t mask;
+    size_t head;
+    char pad0[56];
+    size_t tail;
+    char pad1[56];
+    int sleeping_producers;
+    int sleeping_consumers;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+};
+
+/* Holds capacity items, rounded up to a power of two. */
+bounded_queue *make_bounded_queue(int capacity)
+{
+    size_t i;
+    size_t size = 2;
+    while(size < (size_t)capacity) size <<= 1;
+    bounded_queue *q = calloc(1, sizeof(bounded_queue));
+    q->cells = calloc(size, sizeof(queue_cell));
+    if(!q->cells) malloc_error();
+    for(i = 0; i < size; ++i) q->cells[i].sequence = i;
+    q->mask = size - 1;
+    pthread_mutex_init(&q->mutex, 0);
+    pthread_cond_init(&q->not_full, 0);
+    pthread_cond_init(&q->not_empty, 0);
+    return q;
+}
+
+void free_bounded_queue(bounded_queue *q)
+{
+    if(!q) return;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    free(q->cells);
+    free(q);
+}
+
+static int try_push(bounded_queue *q, void *item)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+    while(1){
+        queue_cell *cell = q->cells + (pos & q->mask);
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_SEQ_CST);
+        long diff = (long)(seq - pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else if(diff < 0){
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static int try_pop(bounded_queue *q, void **item)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+    while(1){
+        queue_cell *cell = q->cells + (pos & q->mask);
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_SEQ_CST);
+        long diff = (long)(seq - (pos + 1));
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+                *item = cell->item;
+                __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else if(diff < 0){
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static void wake(bounded_queue *q, int *sleeping, pthread_cond_t *cond)
+{
+    if(!__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) return;
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* Blocks while the queue is full. */
+void bounded_queue_push(bounded_queue *q, void *item)
+{
+    int i;
+    for(i = 0; !try_push(q, item); ++i){
+        if(i < QUEUE_SPIN){
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&q->mutex);
+        __atomic_add_fetch(&q->sleeping_producers, 1, __ATOMIC_SEQ_CST);
+        while(!try_push(q, item)) pthread_cond_wait(&q->not_full, &q->mutex);
+        __atomic_sub_fetch(&q->sleeping_producers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->mutex);
+        break;
+    }
+    wake(q, &q->sleeping_consumers, &q->not_empty);
+}
+
+/* Blocks while the queue is empty. */
+void *bounded_queue_pop(bounded_queue *q)
+{
+    int i;
+    void *item = 0;
+    for(i = 0; !try_pop(q, &item); ++i){
+        if(i < QUEUE_SPIN){
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&q->mutex);
+        __atomic_add_fetch(&q->sleeping_consumers, 1, __ATOMIC_SEQ_CST);
+        while(!try_pop(q, &item)) pthread_cond_wait(&q->not_empty, &q->mutex);
+        __atomic_sub_fetch(&q->sleeping_consumers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->mutex);
+        break;
+    }
+    wake(q, &q->sleeping_producers, &q->not_full);
+    return item;
+}
+
+/* Takes an item into *item if there is one, without waiting; 0 if there is not. */
+int bounded_queue_try_pop(bounded_queue *q, void **item)
+{
+    if(!try_pop(q, item)) return 0;
+    wake(q, &q->sleeping_producers, &q->not_full);
+    return 1;
+}
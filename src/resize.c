@@ -0,0 +1,228 @@
+#include "darknet.h"
+#include "parallel.h"
+#include "utils.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * Separable resizing of planar float images.
+ *
+ * Every output column and row is a weighted sum of a few source columns or
+ * rows, its taps, worked out once per call for the mode:
+ *  - RESIZE_BILINEAR interpolates between the two nearest samples with the
+ *    corners aligned, scale (in-1)/(out-1), as resize_image() always has,
+ *    but the last row is the source's last row as the last column always
+ *    was, where the old row pass could leave it nearly black;
+ *  - RESIZE_NEAREST takes the sample under the output's center;
+ *  - RESIZE_AREA averages the samples the output covers, weighted by how
+ *    much of each it covers, which keeps downscales from aliasing; it is
+ *    bilinear when scaling up.
+ * An output row blends its source rows into a row buffer, a contiguous
+ * pass the compiler vectorizes (and builds for AVX2 where the CPU has it),
+ * then samples across that buffer with the column taps. Rows are spread
+ * over the worker pool and the result goes into memory the caller owns.
+ *
+ * The source may also be interleaved bytes, as decoders hand them out: the
+ * row blend reads them in place and scales them to [0,1], so letterboxing
+ * a decoded frame never makes a float copy of it.
+ */
+
+typedef struct{
+    int n;
+    int *first;
+    float *weights;
+} resize_taps;
+
+static resize_taps make_taps(int in, int out, RESIZE_MODE mode)
+{
+    int i, j;
+    resize_taps t;
+    float scale = (float)in/out;
+    if(mode == RESIZE_AREA && scale <= 1) mode = RESIZE_BILINEAR;
+    t.n = (mode == RESIZE_AREA) ? (int)ceil(scale) + 1 : (mode == RESIZE_BILINEAR) ? 2 : 1;
+    t.first = calloc(out, sizeof(int));
+    t.weights = calloc((size_t)out*t.n, sizeof(float));
+    for(i = 0; i < out; ++i){
+        float *w = t.weights + (size_t)i*t.n;
+        if(mode == RESIZE_NEAREST){
+            int x = (int)((i + .5f)*scale);
+            t.first[i] = x < in ? x : in - 1;
+            w[0] = 1;
+        } else if(mode == RESIZE_BILINEAR){
+            float s = (out > 1) ? (float)(in - 1)/(out - 1) : 0;
+            float x = i*s;
+            int ix = (int)x;
+            if(i == out - 1 || in == 1 || ix >= in - 1){
+                t.first[i] = in - 1;
+                w[0] = 1;
+            } else {
+                t.first[i] = ix;
+                w[0] = 1 - (x - ix);
+                w[1] = x - ix;
+            }
+        } else {
+            float start = i*scale;
+            float end = (i + 1)*scale;
+            int ix = (int)start;
+            t.first[i] = ix;
+            for(j = 0; j < t.n && ix + j < in; ++j){
+                float lo = (ix + j > start) ? ix + j : start;
+                float hi = (ix + j + 1 < end) ? ix + j + 1 : end;
+                if(hi > lo) w[j] = (hi - lo)/scale;
+            }
+        }
+    }
+    return t;
+}
+
+static void free_taps(resize_taps t)
+{
+    free(t.first);
+    free(t.weights);
+}
+
+typedef struct{
+    image im;
+    const unsigned char *bytes;
+    int step, c, bgr;
+    image out;
+    int dx, dy;
+    int w, h;
+    resize_taps cols;
+    resize_taps rows;
+} resize_args;
+
+/* Blends taps rows of channel k of the byte source from first on into row. */
+static inline void blend_byte_rows(const resize_args *a, int k, int first, const float *wy, int taps, float *row)
+{
+    int i, x;
+    int c = a->c;
+    int src_k = (a->bgr && c >= 3 && k < 3) ? 2 - k : k;
+    const unsigned char *src = a->bytes + (size_t)first*a->step + src_k;
+    float w = wy[0]/255.f;
+    for(x = 0; x < a->im.w; ++x) row[x] = w*src[x*c];
+    for(i = 1; i < taps; ++i){
+        const unsigned char *r = src + (size_t)i*a->step;
+        w = wy[i]/255.f;
+        for(x = 0; x < a->im.w; ++x) row[x] += w*r[x*c];
+    }
+}
+
+static inline void resize_rows_body(int start, int end, void *ptr)
+{
+    resize_args *a = ptr;
+    image im = a->im;
+    image out = a->out;
+    int i, j, k, y, x;
+    /* Padded so the last columns' zero-weighted taps read zeros. */
+    float *row = calloc(im.w + a->cols.n, sizeof(float));
+    if(!row) malloc_error();
+    for(y = start; y < end; ++y){
+        int first = a->rows.first[y];
+        const float *wy = a->rows.weights + (size_t)y*a->rows.n;
+        int taps = a->rows.n;
+        while(taps > 1 && (first + taps > im.h || wy[taps-1] == 0)) --taps;
+        for(k = 0; k < im.c; ++k){
+            if(a->bytes){
+                blend_byte_rows(a, k, first, wy, taps, row);
+            } else {
+                const float *src = im.data + ((size_t)k*im.h + first)*im.w;
+                for(x = 0; x < im.w; ++x) row[x] = wy[0]*src[x];
+                for(i = 1; i < taps; ++i){
+                    const float *r = src + (size_t)i*im.w;
+                    float w = wy[i];
+                    for(x = 0; x < im.w; ++x) row[x] += w*r[x];
+                }
+            }
+            float *dst = out.data + ((size_t)k*out.h + a->dy + y)*out.w + a->dx;
+            const int *cx = a->cols.first;
+            const float *wx = a->cols.weights;
+            if(a->cols.n == 1){
+                for(x = 0; x < a->w; ++x) dst[x] = row[cx[x]];
+            } else if(a->cols.n == 2){
+                for(x = 0; x < a->w; ++x) dst[x] = wx[2*x]*row[cx[x]] + wx[2*x+1]*row[cx[x]+1];
+            } else {
+                int n = a->cols.n;
+                for(x = 0; x < a->w; ++x){
+                    const float *s = row + cx[x];
+                    float sum = 0;
+                    for(j = 0; j < n; ++j) sum += wx[x*n + j]*s[j];
+                    dst[x] = sum;
+                }
+            }
+        }
+    }
+    free(row);
+}
+
+static void resize_rows(int start, int end, void *ptr)
+{
+    resize_rows_body(start, end, ptr);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESIZE_X86
+
+__attribute__((target("avx2")))
+static void resize_rows_avx2(int start, int end, void *ptr)
+{
+    resize_rows_body(start, end, ptr);
+}
+#endif
+
+/* Resizes a's source into the w by h region of a->out at dx, dy. */
+static void resize_region(resize_args *a, int dx, int dy, int w, int h, RESIZE_MODE mode)
+{
+    assert(dx >= 0 && dy >= 0 && dx + w <= a->out.w && dy + h <= a->out.h);
+    if(w < 1 || h < 1) return;
+    a->dx = dx;
+    a->dy = dy;
+    a->w = w;
+    a->h = h;
+    a->cols = make_taps(a->im.w, w, mode);
+    a->rows = make_taps(a->im.h, h, mode);
+    parallel_func rows = resize_rows;
+#ifdef RESIZE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) rows = resize_rows_avx2;
+#endif
+    parallel_for(h, 4, rows, a);
+    free_taps(a->cols);
+    free_taps(a->rows);
+}
+
+/* Resizes im into the w by h region of out at dx, dy. */
+void resize_image_region(image im, image out, int dx, int dy, int w, int h, RESIZE_MODE mode)
+{
+    assert(im.c == out.c);
+    resize_args a = {0};
+    a.im = im;
+    a.out = out;
+    resize_region(&a, dx, dy, w, h, mode);
+}
+
+/*
+ * Resizes an iw by ih image of c interleaved bytes a pixel, rows step bytes
+ * apart, into the w by h region of out at dx, dy; out takes its first out.c
+ * channels, the first and third swapped if bgr.
+ */
+void resize_bytes_region(const unsigned char *data, int iw, int ih, int c, int step, int bgr, image out, int dx, int dy, int w, int h, RESIZE_MODE mode)
+{
+    assert(out.c <= c);
+    resize_args a = {0};
+    a.im.w = iw;
+    a.im.h = ih;
+    a.im.c = out.c;
+    a.bytes = data;
+    a.step = step;
+    a.c = c;
+    a.bgr = bgr;
+    a.out = out;
+    resize_region(&a, dx, dy, w, h, mode);
+}
+
+void resize_image_into(image im, image out, RESIZE_MODE mode)
+{
+    resize_image_region(im, out, 0, 0, out.w, out.h, mode);
+}
@@ -0,0 +1,190 @@
+#include "network.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Keeping a latency target by changing the input resolution.
+ *
+ * The controller owns the model and sizes it once, at the largest
+ * resolution it may run, so every buffer is as big as it will ever need to
+ * be. Every resolution is a view: a copy of the model's layers with the
+ * geometry resize_network() gives them at that size, over the model's own
+ * buffers. Switching picks another view and allocates nothing.
+ *
+ * The caller reports how long each frame took. When the average at the
+ * current size misses the target, the controller steps down to the next
+ * smaller size. When the next larger size would fit with headroom to
+ * spare, it steps back up, estimating that size's cost from the current
+ * one by pixel count. It waits RESOLUTION_SETTLE frames after each switch
+ * before judging the new size, so one slow frame does not make it flap.
+ *
+ * Views share every buffer, so one view runs at a time. The model must not
+ * be resized or rebatched while the controller exists. Views keep CPU
+ * pointers only, so the controller runs on the CPU.
+ */
+
+#define RESOLUTION_SETTLE 8
+#define RESOLUTION_HEADROOM .8
+
+struct resolution_controller{
+    network *model;
+    int n;
+    network **views;
+    int current;
+    float target;
+    float average;
+    int frames;
+};
+
+static int compare_sizes(const void *a, const void *b)
+{
+    return *(const int *)b - *(const int *)a;
+}
+
+/* The model's layers with the geometry they have now; route layers get their own input sizes. */
+static layer *copy_layers(network *net)
+{
+    int i;
+    layer *layers = calloc(net->n, sizeof(layer));
+    memcpy(layers, net->layers, net->n*sizeof(layer));
+    for(i = 0; i < net->n; ++i){
+        layer *l = layers + i;
+        if(l->type == ROUTE){
+            l->input_sizes = calloc(l->n, sizeof(int));
+            memcpy(l->input_sizes, net->layers[i].input_sizes, l->n*sizeof(int));
+        }
+    }
+    return layers;
+}
+
+/* Takes the geometry from shape and everything else, buffers included, from net. */
+static network *make_view(network *net, network *shape)
+{
+    int i;
+    network *view = calloc(1, sizeof(network));
+    *view = *net;
+    view->layers = copy_layers(net);
+    for(i = 0; i < net->n; ++i){
+        layer *l = view->layers + i;
+        layer s = shape->layers[i];
+        if(s.outputs > net->layers[i].outputs || s.workspace_size > net->layers[i].workspace_size){
+            error("A smaller input gave a layer a larger output");
+        }
+        l->w = s.w;
+        l->h = s.h;
+        l->c = s.c;
+        l->out_w = s.out_w;
+        l->out_h = s.out_h;
+        l->out_c = s.out_c;
+        l->inputs = s.inputs;
+        l->outputs = s.outputs;
+        l->workspace_size = s.workspace_size;
+        if(l->type == ROUTE) memcpy(l->input_sizes, s.input_sizes, l->n*sizeof(int));
+    }
+    view->w = shape->w;
+    view->h = shape->h;
+    view->inputs = shape->inputs;
+    view->outputs = shape->outputs;
+    return view;
+}
+
+static void free_layers(layer *layers, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        if(layers[i].type == ROUTE) free(layers[i].input_sizes);
+    }
+    free(layers);
+}
+
+static int round_size(float size)
+{
+    int rounded = ((int)(size + 16)/32)*32;
+    return rounded < 32 ? 32 : rounded;
+}
+
+/*
+ * Runs model at the given widths, largest first, or without any at its
+ * own width, two thirds and half of it. Widths round to multiples of 32,
+ * and heights keep the model's aspect in multiples of 32 too; widths that
+ * round alike run once. Aims each frame at target_ms.
+ */
+resolution_controller *make_resolution_controller(network *model, int *widths, int n, float target_ms)
+{
+    int i;
+#ifdef GPU
+    if(model->gpu_index >= 0) error("The resolution controller runs on the CPU");
+#endif
+    int defaults[] = {model->w, model->w*2/3, model->w/2};
+    if(!widths || n < 1){
+        widths = defaults;
+        n = sizeof(defaults)/sizeof(defaults[0]);
+    }
+    resolution_controller *rc = calloc(1, sizeof(resolution_controller));
+    int *sizes = calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i) sizes[i] = round_size(widths[i]);
+    qsort(sizes, n, sizeof(int), compare_sizes);
+    int unique = 1;
+    for(i = 1; i < n; ++i){
+        if(sizes[i] != sizes[unique-1]) sizes[unique++] = sizes[i];
+    }
+    n = unique;
+    float aspect = (float)model->h/model->w;
+
+    network *shapes = calloc(n, sizeof(network));
+    for(i = n-1; i >= 0; --i){
+        resize_network(model, sizes[i], round_size(sizes[i]*aspect));
+        shapes[i] = *model;
+        shapes[i].layers = copy_layers(model);
+    }
+    rc->model = model;
+    rc->n = n;
+    rc->views = calloc(n, sizeof(network *));
+    for(i = 0; i < n; ++i){
+        rc->views[i] = make_view(model, shapes + i);
+        free_layers(shapes[i].layers, shapes[i].n);
+    }
+    free(shapes);
+    free(sizes);
+    rc->target = target_ms;
+    return rc;
+}
+
+void free_resolution_controller(resolution_controller *rc)
+{
+    int i;
+    if(!rc) return;
+    for(i = 0; i < rc->n; ++i){
+        free_layers(rc->views[i]->layers, rc->views[i]->n);
+        free(rc->views[i]);
+    }
+    free(rc->views);
+    free(rc);
+}
+
+/* The network to run next, at the current size. */
+network *resolution_network(resolution_controller *rc)
+{
+    return rc->views[__atomic_load_n(&rc->current, __ATOMIC_SEQ_CST)];
+}
+
+/* Reports that the last frame took ms; 1 if the size changes for the next one. */
+int control_resolution(resolution_controller *rc, float ms)
+{
+    int next = rc->current;
+    rc->average = rc->frames ? .8*rc->average + .2*ms : ms;
+    if(++rc->frames < RESOLUTION_SETTLE) return 0;
+    network *now = rc->views[rc->current];
+    if(rc->average > rc->target && rc->current < rc->n - 1){
+        next = rc->current + 1;
+    } else if(rc->current > 0){
+        network *up = rc->views[rc->current - 1];
+        float predicted = rc->average*up->w*up->h/(now->w*now->h);
+        if(predicted < RESOLUTION_HEADROOM*rc->target) next = rc->current - 1;
+    }
+    if(next == rc->current) return 0;
+    rc->frames = 0;
+    __atomic_store_n(&rc->current, next, __ATOMIC_SEQ_CST);
+    return 1;
+}
@@ -0,0 +1,97 @@
+#include "network.h"
+#include "image.h"
+#include "box.h"
+#include "utils.h"
+#include <stdlib.h>
+
+/*
+ * Inference sessions: the reentrant way to run a model.
+ *
+ * network_predict_image() and get_network_boxes() work on the network they
+ * are given, so two threads sharing one network overwrite each other's
+ * activations. A session is an execution context of the model at batch 1
+ * plus the letterbox image it feeds it; all it writes between calls is its
+ * own. Sessions of one model can be used from as many threads at once as
+ * there are sessions, and a session from one thread at a time. Results go
+ * into memory the caller owns, so nothing outlives a call but the session.
+ */
+
+struct session{
+    network *net;
+    image boxed;
+    int classes;
+};
+
+session *make_session(network *model)
+{
+    int i;
+    session *s = calloc(1, sizeof(session));
+    s->net = make_network_context(model);
+    if(s->net->batch != 1) set_batch_network(s->net, 1);
+    s->boxed = make_image(s->net->w, s->net->h, s->net->c);
+    for(i = 0; i < s->net->n; ++i){
+        layer l = s->net->layers[i];
+        if(l.type == YOLO || l.type == REGION || l.type == DETECTION) s->classes = l.classes;
+    }
+    return s;
+}
+
+void free_session(session *s)
+{
+    if(!s) return;
+    free_network_context(s->net);
+    free_image(s->boxed);
+    free(s);
+}
+
+float *session_predict(session *s, image im)
+{
+    fill_image(s->boxed, .5);
+    letterbox_image_into(im, s->net->w, s->net->h, s->boxed);
+    return network_predict(s->net, s->boxed.data);
+}
+
+static int compare_session_detections(const void *a, const void *b)
+{
+    float diff = ((const session_detection *)b)->prob - ((const session_detection *)a)->prob;
+    return (diff > 0) - (diff < 0);
+}
+
+/*
+ * Letterboxes im into the model, runs it and writes up to max detections
+ * above thresh into dets, most likely first, with boxes in im's pixels. One
+ * box above thresh for several classes gives one detection per class.
+ * Returns how many there were, which may be more than max.
+ */
+int session_detect(session *s, image im, float thresh, float hier, float nms, session_detection *dets, int max)
+{
+    int i, j;
+    int nboxes = 0;
+    int found = 0;
+    if(!s->classes) error("session_detect needs a model with a yolo, region or detection layer");
+    session_predict(s, im);
+    detection *boxes = get_network_boxes(s->net, im.w, im.h, thresh, hier, 0, 0, &nboxes);
+    if(nms) do_nms_sort(boxes, nboxes, s->classes, nms);
+    for(i = 0; i < nboxes; ++i){
+        for(j = 0; j < s->classes; ++j) found += boxes[i].prob[j] > thresh;
+    }
+    session_detection *all = found > max ? calloc(found, sizeof(session_detection)) : dets;
+    int n = 0;
+    for(i = 0; i < nboxes; ++i){
+        for(j = 0; j < s->classes; ++j){
+            if(boxes[i].prob[j] <= thresh) continue;
+            all[n].bbox = boxes[i].bbox;
+            all[n].class_id = j;
+            all[n].prob = boxes[i].prob[j];
+            all[n].objectness = boxes[i].objectness;
+            ++n;
+        }
+    }
+    free_detections(boxes, nboxes);
+    qsort(all, n, sizeof(session_detection), compare_session_detections);
+    if(all != dets){
+        for(i = 0; i < max; ++i) dets[i] = all[i];
+        free(all);
+    }
+    return found;
+}
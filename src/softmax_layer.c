@@ -20,7 +20,7 @@ softmax_layer make_softmax_layer(int batch, int inputs, int groups)
     l.outputs = inputs;
     l.loss = calloc(inputs*batch, sizeof(float));
     l.output = calloc(inputs*batch, sizeof(float));
-    l.delta = calloc(inputs*batch, sizeof(float));
+    l.delta = train_calloc(inputs*batch, sizeof(float));
     l.cost = calloc(1, sizeof(float));
 
     l.forward = forward_softmax_layer;
@@ -0,0 +1,377 @@
+#include "network.h"
+#include "image.h"
+#include "utils.h"
+#include "box.h"
+#include <json-c/json.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#ifdef OPENCV
+
+/*
+ * Many video streams, one network. Every source gets a decode thread that
+ * reads frames and letterboxes their bytes, and keeps only its newest frame
+ * ready for inference. The calling thread runs the network: it takes the
+ * ready frame of every stream that has one, up to -batch of them, taking
+ * streams in turn so none waits behind the others. It runs them as one
+ * batch and hands each frame's boxes to the writer thread of the stream it
+ * came from. Writers print one line of JSON per frame and, with -prefix,
+ * save the frame with its boxes drawn.
+ *
+ * Live sources drop frames the network has not reached when a newer one is
+ * decoded. Files wait, so every frame of a file is seen, unless -drop says
+ * otherwise. Each stream holds STREAM_FRAMES frames: one decoding, one
+ * ready, one in the batch and one being written.
+ *
+ * With -slo, a resolution controller picks the input size from how long
+ * each batch takes. Frames are letterboxed for the size current when they
+ * are decoded and again, from their bytes, if a batch runs at another.
+ */
+
+#define STREAM_FRAMES 4
+
+typedef struct stream_engine stream_engine;
+
+typedef struct{
+    byte_image frame;
+    image letter;
+    int index;
+    double captured;
+    double inferred;
+    int batch;
+    detection *dets;
+    int nboxes;
+} stream_frame;
+
+typedef struct{
+    int id;
+    char *source;
+    void *cap;
+    int drop;
+    stream_frame frames[STREAM_FRAMES];
+    bounded_queue *free_frames;
+    bounded_queue *results;
+    stream_frame *latest;
+    int decoded;
+    int dropped;
+    int written;
+    double latency;
+    stream_engine *engine;
+    pthread_t decoder;
+    pthread_t writer;
+} stream;
+
+struct stream_engine{
+    network *net;
+    resolution_controller *rc;
+    stream *streams;
+    int n;
+    int batch;
+    float thresh, hier, nms;
+    char **names;
+    image **alphabet;
+    int classes;
+    char *prefix;
+    FILE *out;
+    pthread_mutex_t out_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t taken;
+    int decoding;
+    int next;
+};
+
+/* A free frame; on a live stream, the ready one if there is none. */
+static stream_frame *take_frame(stream *s)
+{
+    void *f;
+    stream_engine *e = s->engine;
+    if(bounded_queue_try_pop(s->free_frames, &f)) return f;
+    if(s->drop){
+        pthread_mutex_lock(&e->mutex);
+        f = s->latest;
+        s->latest = 0;
+        pthread_mutex_unlock(&e->mutex);
+        if(f){
+            ++s->dropped;
+            return f;
+        }
+    }
+    return bounded_queue_pop(s->free_frames);
+}
+
+static void publish_frame(stream *s, stream_frame *f)
+{
+    stream_engine *e = s->engine;
+    pthread_mutex_lock(&e->mutex);
+    while(!s->drop && s->latest) pthread_cond_wait(&e->taken, &e->mutex);
+    stream_frame *stale = s->latest;
+    s->latest = f;
+    pthread_cond_signal(&e->ready);
+    pthread_mutex_unlock(&e->mutex);
+    if(stale){
+        ++s->dropped;
+        bounded_queue_push(s->free_frames, stale);
+    }
+}
+
+static network *current_network(stream_engine *e)
+{
+    return e->rc ? resolution_network(e->rc) : e->net;
+}
+
+/* Letterboxes the frame for net, into the frame's buffer sized for the largest input. */
+static void letterbox_frame(stream_frame *f, network *net)
+{
+    f->letter.w = net->w;
+    f->letter.h = net->h;
+    letterbox_bytes_into(f->frame.data, f->frame.w, f->frame.h, f->frame.c, f->frame.step, 1, f->letter);
+}
+
+static void *decode_stream(void *ptr)
+{
+    stream *s = ptr;
+    stream_engine *e = s->engine;
+    while(1){
+        stream_frame *f = take_frame(s);
+        if(!read_stream_frame(s->cap, &f->frame)){
+            bounded_queue_push(s->free_frames, f);
+            break;
+        }
+        f->captured = what_time_is_it_now();
+        f->index = s->decoded++;
+        letterbox_frame(f, current_network(e));
+        publish_frame(s, f);
+    }
+    pthread_mutex_lock(&e->mutex);
+    --e->decoding;
+    pthread_cond_signal(&e->ready);
+    pthread_mutex_unlock(&e->mutex);
+    return 0;
+}
+
+/* Takes up to batch ready frames, streams in turn; 0 once every stream has ended. */
+static int take_batch(stream_engine *e, stream_frame **frames, stream **owners)
+{
+    int i = 0;
+    int n = 0;
+    pthread_mutex_lock(&e->mutex);
+    while(1){
+        for(i = 0; i < e->n && n < e->batch; ++i){
+            stream *s = e->streams + (e->next + i) % e->n;
+            if(!s->latest) continue;
+            frames[n] = s->latest;
+            owners[n] = s;
+            s->latest = 0;
+            ++n;
+        }
+        if(n || !e->decoding) break;
+        pthread_cond_wait(&e->ready, &e->mutex);
+    }
+    e->next = (e->next + i) % e->n;
+    pthread_cond_broadcast(&e->taken);
+    pthread_mutex_unlock(&e->mutex);
+    return n;
+}
+
+static void *write_stream(void *ptr)
+{
+    stream *s = ptr;
+    stream_engine *e = s->engine;
+    image display = {0};
+    stream_frame *f;
+    int i, j;
+    while((f = bounded_queue_pop(s->results))){
+        if(e->prefix){
+            if(display.w != f->frame.w || display.h != f->frame.h || display.c != f->frame.c){
+                free_image(display);
+                display = make_image(f->frame.w, f->frame.h, f->frame.c);
+            }
+            bytes_to_image(f->frame.data, f->frame.step, 1, display);
+            /* The boxes are in pixels; drawing takes them relative. */
+            for(i = 0; i < f->nboxes; ++i){
+                box b = f->dets[i].bbox;
+                b.x /= display.w;
+                b.w /= display.w;
+                b.y /= display.h;
+                b.h /= display.h;
+                for(j = 0; j < e->classes; ++j){
+                    if(f->dets[i].prob[j] > e->thresh) draw_class_box(display, b, j, e->classes, e->names, e->alphabet);
+                }
+            }
+        }
+        struct json_object *objects = detections_to_json(f->dets, f->nboxes, e->thresh, e->names, e->classes);
+        struct json_object *line = json_object_new_object();
+        json_object_object_add(line, "stream", json_object_new_int(s->id));
+        json_object_object_add(line, "source", json_object_new_string(s->source));
+        json_object_object_add(line, "frame", json_object_new_int(f->index));
+        json_object_object_add(line, "width", json_object_new_int(f->frame.w));
+        json_object_object_add(line, "height", json_object_new_int(f->frame.h));
+        json_object_object_add(line, "batch", json_object_new_int(f->batch));
+        if(e->rc){
+            struct json_object *input = json_object_new_array();
+            json_object_array_add(input, json_object_new_int(f->letter.w));
+            json_object_array_add(input, json_object_new_int(f->letter.h));
+            json_object_object_add(line, "input", input);
+        }
+        json_object_object_add(line, "ms", json_object_new_double((f->inferred - f->captured)*1000));
+        json_object_object_add(line, "objects", objects);
+        pthread_mutex_lock(&e->out_mutex);
+        fprintf(e->out, "%s\n", json_object_to_json_string_ext(line, JSON_C_TO_STRING_PLAIN));
+        pthread_mutex_unlock(&e->out_mutex);
+        json_object_put(line);
+
+        if(e->prefix){
+            char name[256];
+            snprintf(name, sizeof(name), "%s_%d_%08d", e->prefix, s->id, f->index);
+            save_image(display, name);
+        }
+        s->latency += f->inferred - f->captured;
+        ++s->written;
+        free_detections(f->dets, f->nboxes);
+        f->dets = 0;
+        bounded_queue_push(s->free_frames, f);
+    }
+    free_image(display);
+    return 0;
+}
+
+static void run_engine(stream_engine *e)
+{
+    int i, n;
+    stream_frame **frames = calloc(e->batch, sizeof(stream_frame *));
+    stream **owners = calloc(e->batch, sizeof(stream *));
+    float *X = calloc((size_t)e->batch*e->net->inputs, sizeof(float));
+    int images = 0;
+    int batches = 0;
+    double start = what_time_is_it_now();
+    while((n = take_batch(e, frames, owners))){
+        network *net = current_network(e);
+        double begin = what_time_is_it_now();
+        for(i = 0; i < n; ++i){
+            stream_frame *f = frames[i];
+            if(f->letter.w != net->w || f->letter.h != net->h) letterbox_frame(f, net);
+            memcpy(X + (size_t)i*net->inputs, f->letter.data, net->inputs*sizeof(float));
+        }
+        set_active_batch(net, n);
+        network_predict(net, X);
+        double now = what_time_is_it_now();
+        for(i = 0; i < n; ++i){
+            stream_frame *f = frames[i];
+            f->dets = get_network_boxes_batch(net, i, f->frame.w, f->frame.h, e->thresh, e->hier, 0, 0, &f->nboxes);
+            if(e->nms) do_nms_sort(f->dets, f->nboxes, e->classes, e->nms);
+            f->inferred = now;
+            f->batch = n;
+            bounded_queue_push(owners[i]->results, f);
+        }
+        if(e->rc) control_resolution(e->rc, 1000*(now - begin));
+        images += n;
+        ++batches;
+    }
+    double elapsed = what_time_is_it_now() - start;
+    fprintf(stderr, "streams: %d frames from %d streams in %d batches (%.2f per batch), %.1f frames/s\n",
+            images, e->n, batches, batches ? (float)images/batches : 0, images/elapsed);
+    free(frames);
+    free(owners);
+    free(X);
+}
+
+/* A source that is a number is a camera; one that names a file on disk is a file, the rest are live. */
+static void *open_source(char *source, int *live)
+{
+    char *p = source;
+    while(isdigit((unsigned char)*p)) ++p;
+    if(*source && !*p){
+        *live = 1;
+        return open_video_stream(0, atoi(source), 0, 0, 0);
+    }
+    *live = access(source, F_OK) != 0;
+    return open_video_stream(source, 0, 0, 0, 0);
+}
+
+void detect_streams(char *cfgfile, char *weightfile, char **sources, int n, char **names, float thresh, float hier_thresh, int batch, int drop, char *prefix, char *outfile, float slo, char *sizes)
+{
+    int i, j;
+    stream_engine e = {0};
+    e.net = load_network_inference(cfgfile, weightfile);
+    e.n = n;
+    e.batch = (batch < 1) ? n : batch;
+    e.thresh = thresh;
+    e.hier = hier_thresh;
+    e.nms = .45;
+    e.names = names;
+    e.alphabet = prefix ? load_alphabet() : 0;
+    e.classes = e.net->layers[e.net->n-1].classes;
+    e.prefix = prefix;
+    e.out = outfile ? fopen(outfile, "w") : stdout;
+    if(!e.out) file_error(outfile);
+    pthread_mutex_init(&e.out_mutex, 0);
+    pthread_mutex_init(&e.mutex, 0);
+    pthread_cond_init(&e.ready, 0);
+    pthread_cond_init(&e.taken, 0);
+    set_batch_network(e.net, e.batch);
+    if(slo > 0){
+        int count = 0;
+        int *widths = sizes ? read_intlist(sizes, &count, 0) : 0;
+        e.rc = make_resolution_controller(e.net, widths, count, slo);
+        free(widths);
+    }
+
+    e.streams = calloc(n, sizeof(stream));
+    for(i = 0; i < n; ++i){
+        stream *s = e.streams + i;
+        int live;
+        s->id = i;
+        s->source = sources[i];
+        s->engine = &e;
+        s->cap = open_source(s->source, &live);
+        if(!s->cap) error(s->source);
+        s->drop = (drop < 0) ? live : drop;
+        s->free_frames = make_bounded_queue(STREAM_FRAMES);
+        s->results = make_bounded_queue(STREAM_FRAMES + 1);
+        for(j = 0; j < STREAM_FRAMES; ++j){
+            s->frames[j].letter = make_image(e.net->w, e.net->h, e.net->c);
+            bounded_queue_push(s->free_frames, s->frames + j);
+        }
+    }
+    e.decoding = n;
+    for(i = 0; i < n; ++i){
+        stream *s = e.streams + i;
+        if(pthread_create(&s->decoder, 0, decode_stream, s)) error("Thread creation failed");
+        if(pthread_create(&s->writer, 0, write_stream, s)) error("Thread creation failed");
+    }
+
+    run_engine(&e);
+
+    for(i = 0; i < n; ++i){
+        stream *s = e.streams + i;
+        bounded_queue_push(s->results, 0);
+        pthread_join(s->decoder, 0);
+        pthread_join(s->writer, 0);
+        close_video_stream(s->cap);
+        fprintf(stderr, "%4d %s: %d frames decoded, %d detected, %d dropped, %.1f ms capture to result\n",
+                s->id, s->source, s->decoded, s->written, s->dropped, s->written ? 1000*s->latency/s->written : 0);
+        for(j = 0; j < STREAM_FRAMES; ++j){
+            free_byte_image(s->frames[j].frame);
+            free_image(s->frames[j].letter);
+        }
+        free_bounded_queue(s->free_frames);
+        free_bounded_queue(s->results);
+    }
+    free(e.streams);
+    if(outfile) fclose(e.out);
+    pthread_mutex_destroy(&e.out_mutex);
+    pthread_mutex_destroy(&e.mutex);
+    pthread_cond_destroy(&e.ready);
+    pthread_cond_destroy(&e.taken);
+    free_resolution_controller(e.rc);
+    free_network(e.net);
+}
+
+#else
+void detect_streams(char *cfgfile, char *weightfile, char **sources, int n, char **names, float thresh, float hier_thresh, int batch, int drop, char *prefix, char *outfile, float slo, char *sizes)
+{
+    fprintf(stderr, "Streams need OpenCV for video.\n");
+}
+#endif
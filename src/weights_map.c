@@ -0,0 +1,497 @@
+#include "weights_map.h"
+#include "parallel.h"
+#include "winograd.h"
+#include "blocked.h"
+#include "gemm.h"
+#include "convolutional_layer.h"
+#include "connected_layer.h"
+#include "batchnorm_layer.h"
+#include "local_layer.h"
+#include "layer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Mapped weights: a weights container laid out to be used in place.
+ *
+ *   header (64 bytes) | tensor table | tensors, each 64-byte aligned
+ *
+ * The table lists every tensor with its layer, kind, element count, file
+ * offset and CRC-32C. Networks built by load_network_inference() point their
+ * weights straight at a read-only shared mapping, so every process on a host
+ * uses the one copy in the page cache; other networks copy the tensors out,
+ * spread over the worker threads. "darknet convert" writes the format from a
+ * .weights file with batchnorm already folded, which leaves nothing for
+ * optimize_network() to write into the mapping. Layers that would still need
+ * folding are copied instead.
+ *
+ * "darknet compile" writes a snapshot: the same container plus the kernels'
+ * copies of the weights (Winograd, nchw8c, GEMM panels), tagged with the
+ * GEMM kernel they were packed for, and the cfg text at the end of the file.
+ * read_cfg() and load_weights() both accept one, so a worker starts with a
+ * cfg parse and a mapping, not a weights transform.
+ */
+
+#define MAPPED_WEIGHTS_MAGIC "DKNWMAP1"
+#define MAPPED_WEIGHTS_VERSION 1
+#define MAPPED_WEIGHTS_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t tensors;
+    uint64_t seen;
+    uint64_t table;
+    uint32_t table_crc;
+    uint32_t layers;
+    uint64_t cfg;
+    uint64_t cfg_size;
+    char kernel[8];
+} mapped_header;
+
+typedef struct {
+    int32_t layer;
+    int32_t kind;
+    uint64_t count;
+    uint64_t offset;
+    uint32_t crc;
+    uint32_t reserved;
+} mapped_tensor;
+
+/* What a network with mapped weights holds on to until it is freed. */
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    float **unused;
+    int n;
+} mapped_weights;
+
+enum {MAPPED_BIASES, MAPPED_SCALES, MAPPED_ROLLING_MEAN, MAPPED_ROLLING_VARIANCE, MAPPED_WEIGHTS,
+    MAPPED_WINOGRAD, MAPPED_BLOCKED, MAPPED_PACKED, MAPPED_KINDS};
+
+/* Kernel copies: derived from the weights and only valid for the GEMM kernel they were packed for. */
+static int kernel_kind(int k)
+{
+    return k == MAPPED_WINOGRAD || k == MAPPED_BLOCKED || k == MAPPED_PACKED;
+}
+
+static uint32_t crc32c_generic(uint32_t crc, const unsigned char *p, size_t n)
+{
+    int i, j;
+    uint32_t table[256];
+    for(i = 0; i < 256; ++i){
+        uint32_t c = i;
+        for(j = 0; j < 8; ++j) c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        table[i] = c;
+    }
+    while(n--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+    for(; n >= 8; n -= 8, p += 8){
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = c;
+    for(; n; --n) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(const void *data, size_t n)
+{
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2")) return ~crc32c_sse42(~0u, data, n);
+#endif
+    return ~crc32c_generic(~0u, data, n);
+}
+
+/* Where each kind of tensor lives in l and how many floats it holds; 0 for kinds l does not have. */
+static void layer_tensors(layer *l, float **field[MAPPED_KINDS], uint64_t count[MAPPED_KINDS])
+{
+    int k;
+    uint64_t n = 0;
+    int bn = 0;
+    for(k = 0; k < MAPPED_KINDS; ++k){
+        field[k] = 0;
+        count[k] = 0;
+    }
+    if(l->int8_weights) error("Mapped weights do not hold int8 layers");
+    switch(l->type){
+        case CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+            n = l->n;
+            bn = l->batch_normalize;
+            field[MAPPED_WEIGHTS] = &l->weights;
+            count[MAPPED_WEIGHTS] = l->nweights;
+            if(l->winograd_weights){
+                field[MAPPED_WINOGRAD] = &l->winograd_weights;
+                count[MAPPED_WINOGRAD] = 36*gemm_packed_size(l->n, l->c);
+            }
+            if(l->blocked_weights){
+                field[MAPPED_BLOCKED] = &l->blocked_weights;
+                count[MAPPED_BLOCKED] = l->nweights;
+            }
+            break;
+        case CONNECTED:
+            n = l->outputs;
+            bn = l->batch_normalize;
+            field[MAPPED_WEIGHTS] = &l->weights;
+            count[MAPPED_WEIGHTS] = (uint64_t)l->inputs*l->outputs;
+            break;
+        case LOCAL:
+            n = l->outputs;
+            field[MAPPED_WEIGHTS] = &l->weights;
+            count[MAPPED_WEIGHTS] = (uint64_t)l->size*l->size*l->c*l->n*l->out_w*l->out_h;
+            break;
+        case BATCHNORM:
+            field[MAPPED_SCALES] = &l->scales;
+            field[MAPPED_ROLLING_MEAN] = &l->rolling_mean;
+            field[MAPPED_ROLLING_VARIANCE] = &l->rolling_variance;
+            count[MAPPED_SCALES] = count[MAPPED_ROLLING_MEAN] = count[MAPPED_ROLLING_VARIANCE] = l->c;
+            return;
+        case RNN:
+        case GRU:
+        case LSTM:
+        case CRNN:
+            error("Mapped weights do not hold recurrent layers");
+        default:
+            return;
+    }
+    if(l->packed_weights){
+        field[MAPPED_PACKED] = &l->packed_weights;
+        count[MAPPED_PACKED] = packed_weights_size(*l);
+    }
+    field[MAPPED_BIASES] = &l->biases;
+    count[MAPPED_BIASES] = n;
+    if(bn){
+        field[MAPPED_SCALES] = &l->scales;
+        field[MAPPED_ROLLING_MEAN] = &l->rolling_mean;
+        field[MAPPED_ROLLING_VARIANCE] = &l->rolling_variance;
+        count[MAPPED_SCALES] = count[MAPPED_ROLLING_MEAN] = count[MAPPED_ROLLING_VARIANCE] = n;
+    }
+}
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + MAPPED_WEIGHTS_ALIGN - 1)/MAPPED_WEIGHTS_ALIGN*MAPPED_WEIGHTS_ALIGN;
+}
+
+/* Kernel copies are written only into snapshots, which carry the cfg they were built from. */
+static void save_mapped(network *net, char *filename, char *cfgfile)
+{
+    int i, k;
+    float **field[MAPPED_KINDS];
+    uint64_t count[MAPPED_KINDS];
+    char zeros[MAPPED_WEIGHTS_ALIGN] = {0};
+    char *cfg = 0;
+    size_t cfg_size = 0;
+    if(cfgfile){
+        FILE *cf = fopen(cfgfile, "rb");
+        if(!cf) file_error(cfgfile);
+        fseek(cf, 0, SEEK_END);
+        cfg_size = ftell(cf);
+        rewind(cf);
+        cfg = calloc(cfg_size, 1);
+        if(fread(cfg, 1, cfg_size, cf) != cfg_size) file_error(cfgfile);
+        fclose(cf);
+    }
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+
+    mapped_tensor *table = calloc((size_t)net->n*MAPPED_KINDS, sizeof(mapped_tensor));
+    float **data = calloc((size_t)net->n*MAPPED_KINDS, sizeof(float *));
+    int tensors = 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->dontsave) continue;
+#ifdef GPU
+        if(gpu_index >= 0){
+            if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL) pull_convolutional_layer(*l);
+            if(l->type == CONNECTED) pull_connected_layer(*l);
+            if(l->type == BATCHNORM) pull_batchnorm_layer(*l);
+            if(l->type == LOCAL) pull_local_layer(*l);
+        }
+#endif
+        layer_tensors(l, field, count);
+        for(k = 0; k < MAPPED_KINDS; ++k){
+            if(!field[k] || (kernel_kind(k) && !cfg)) continue;
+            table[tensors].layer = i;
+            table[tensors].kind = k;
+            table[tensors].count = count[k];
+            table[tensors].crc = crc32c(*field[k], count[k]*sizeof(float));
+            data[tensors] = *field[k];
+            ++tensors;
+        }
+    }
+    uint64_t offset = align_offset(sizeof(mapped_header) + (uint64_t)tensors*sizeof(mapped_tensor));
+    for(i = 0; i < tensors; ++i){
+        table[i].offset = offset;
+        offset = align_offset(offset + table[i].count*sizeof(float));
+    }
+
+    mapped_header h = {{0}};
+    memcpy(h.magic, MAPPED_WEIGHTS_MAGIC, sizeof(h.magic));
+    h.version = MAPPED_WEIGHTS_VERSION;
+    h.tensors = tensors;
+    h.seen = *net->seen;
+    h.table = sizeof(mapped_header);
+    h.table_crc = crc32c(table, (size_t)tensors*sizeof(mapped_tensor));
+    h.layers = net->n;
+    if(cfg){
+        h.cfg = offset;
+        h.cfg_size = cfg_size;
+        strncpy(h.kernel, gemm_kernel_name(), sizeof(h.kernel) - 1);
+    }
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(table, sizeof(mapped_tensor), tensors, fp);
+    uint64_t pos = sizeof(h) + (uint64_t)tensors*sizeof(mapped_tensor);
+    for(i = 0; i < tensors; ++i){
+        fwrite(zeros, 1, table[i].offset - pos, fp);
+        fwrite(data[i], sizeof(float), table[i].count, fp);
+        pos = table[i].offset + table[i].count*sizeof(float);
+    }
+    fwrite(zeros, 1, offset - pos, fp);
+    if(cfg) fwrite(cfg, 1, cfg_size, fp);
+    fclose(fp);
+    free(table);
+    free(data);
+    free(cfg);
+}
+
+void save_mapped_weights(network *net, char *filename)
+{
+    fprintf(stderr, "Saving mapped weights to %s\n", filename);
+    save_mapped(net, filename, 0);
+}
+
+void save_network_snapshot(network *net, char *cfgfile, char *filename)
+{
+    fprintf(stderr, "Saving snapshot to %s\n", filename);
+    save_mapped(net, filename, cfgfile);
+}
+
+/* For read_cfg(): positions fp at a snapshot's cfg text, leaves any other file at its start. */
+void seek_snapshot_cfg(FILE *fp)
+{
+    mapped_header h;
+    if(fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, MAPPED_WEIGHTS_MAGIC, sizeof(h.magic))){
+        if(!h.cfg) error("Mapped weights hold no cfg, only a snapshot does");
+        fseek(fp, h.cfg, SEEK_SET);
+        return;
+    }
+    rewind(fp);
+}
+
+int is_mapped_weights(char *filename)
+{
+    char magic[8] = {0};
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return n == sizeof(magic) && !memcmp(magic, MAPPED_WEIGHTS_MAGIC, sizeof(magic));
+}
+
+typedef struct {
+    const unsigned char *map;
+    const mapped_tensor *table;
+    float **dst;
+    int bad;
+} mapped_args;
+
+/* Checks each tensor and copies it out where dst[i] is set. */
+static void check_tensors(int start, int end, void *ptr)
+{
+    mapped_args *a = (mapped_args *)ptr;
+    int i;
+    for(i = start; i < end; ++i){
+        const mapped_tensor t = a->table[i];
+        const unsigned char *src = a->map + t.offset;
+        if(crc32c(src, t.count*sizeof(float)) != t.crc) a->bad = i + 1;
+        if(a->dst[i]) memcpy(a->dst[i], src, t.count*sizeof(float));
+    }
+}
+
+typedef struct {
+    layer *layers;
+    int *found;
+} transform_args;
+
+/* The kernels' own copies of the weights the file did not hold, a layer per task. */
+static void transform_layers(int start, int end, void *ptr)
+{
+    transform_args *a = (transform_args *)ptr;
+    int i;
+    for(i = start; i < end; ++i){
+        layer l = a->layers[i];
+        if(l.dontload) continue;
+        if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
+            if(!(a->found[i] & 1 << MAPPED_WINOGRAD)) winograd_transform_weights(l);
+            if(!(a->found[i] & 1 << MAPPED_BLOCKED)) blocked_transform_weights(l);
+        }
+        if(!(a->found[i] & 1 << MAPPED_PACKED)) pack_weights(l);
+    }
+}
+
+void load_mapped_weights(network *net, char *filename, int start, int cutoff)
+{
+    int i, k;
+    float **field[MAPPED_KINDS];
+    uint64_t count[MAPPED_KINDS];
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st)) file_error(filename);
+    uint64_t size = st.st_size;
+    if(size < sizeof(mapped_header)) error("Mapped weights file is truncated");
+    unsigned char *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) file_error(filename);
+
+    mapped_header h;
+    memcpy(&h, map, sizeof(h));
+    if(memcmp(h.magic, MAPPED_WEIGHTS_MAGIC, sizeof(h.magic)) || h.version != MAPPED_WEIGHTS_VERSION){
+        error("Unknown mapped weights version");
+    }
+    if(h.table > size || (size - h.table)/sizeof(mapped_tensor) < h.tensors) error("Mapped weights file is truncated");
+    const mapped_tensor *table = (const mapped_tensor *)(map + h.table);
+    if(crc32c(table, (size_t)h.tensors*sizeof(mapped_tensor)) != h.table_crc) error("Mapped weights table is corrupt");
+    if(h.layers != net->n) error("Mapped weights do not match the cfg");
+    *net->seen = h.seen;
+    /* Packed for another kernel, or for none: the copies get made here instead. */
+    int kernels = h.cfg && !strncmp(h.kernel, gemm_kernel_name(), sizeof(h.kernel));
+
+    int *found = calloc(net->n, sizeof(int));
+    for(i = 0; i < h.tensors; ++i){
+        mapped_tensor t = table[i];
+        if(t.layer < 0 || t.layer >= net->n || t.kind < 0 || t.kind >= MAPPED_KINDS
+                || t.offset % MAPPED_WEIGHTS_ALIGN || t.offset > size || (size - t.offset)/sizeof(float) < t.count){
+            error("Mapped weights table is corrupt");
+        }
+        if(kernel_kind(t.kind)){
+            layer_tensors(net->layers + t.layer, field, count);
+            if(!kernels || !field[t.kind] || count[t.kind] != t.count) continue;
+        }
+        found[t.layer] |= 1 << t.kind;
+    }
+    /* Layers whose batchnorm is still stored get folded later, so they are copied rather than mapped. */
+    int *unfolded = calloc(net->n, sizeof(int));
+    for(i = 0; i < net->n; ++i) unfolded[i] = (found[i] >> MAPPED_SCALES) & 1;
+
+    int mapped = 0;
+    float **dst = calloc(h.tensors, sizeof(float *));
+    /*
+     * The buffers the layers were built with are kept, not freed, until the
+     * network is: they were never written, so they cost no memory, while
+     * freeing them now would raise glibc's dynamic mmap threshold and move
+     * the allocations that follow onto the heap.
+     */
+    float **unused = calloc(h.tensors, sizeof(float *));
+    for(i = 0; i < h.tensors; ++i){
+        mapped_tensor t = table[i];
+        layer *l = net->layers + t.layer;
+        if(t.layer < start || t.layer >= cutoff || l->dontload) continue;
+        int bn = t.kind == MAPPED_SCALES || t.kind == MAPPED_ROLLING_MEAN || t.kind == MAPPED_ROLLING_VARIANCE;
+        if(bn && l->dontloadscales) continue;
+        if(!(found[t.layer] & 1 << t.kind)) continue;
+        layer_tensors(l, field, count);
+        if(!field[t.kind] || count[t.kind] != t.count) error("Mapped weights do not match the cfg");
+        if(net->inference_only && !unfolded[t.layer]){
+            unused[mapped++] = *field[t.kind];
+            *field[t.kind] = (float *)(map + t.offset);
+        } else {
+            dst[i] = *field[t.kind];
+        }
+    }
+    mapped_args args = {map, table, dst, 0};
+    parallel_for(h.tensors, 1, check_tensors, &args);
+    if(args.bad) error("Mapped weights tensor checksum mismatch");
+    if(cutoff > net->n) cutoff = net->n;
+    transform_args targs = {net->layers + start, found + start};
+    if(cutoff > start) parallel_for(cutoff - start, 1, transform_layers, &targs);
+
+    for(i = start; i < net->n && i < cutoff; ++i){
+        layer *l = net->layers + i;
+        if(l->dontload) continue;
+        /* Stored without batchnorm: it was folded into the weights by darknet convert. */
+        if((l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL || l->type == CONNECTED)
+                && l->batch_normalize && !unfolded[i] && !l->dontloadscales){
+            l->batch_normalize = 0;
+        }
+        layer_tensors(l, field, count);
+        for(k = 0; k < MAPPED_KINDS; ++k){
+            int bn = k == MAPPED_SCALES || k == MAPPED_ROLLING_MEAN || k == MAPPED_ROLLING_VARIANCE;
+            if((bn && l->dontloadscales) || kernel_kind(k)) continue;
+            if(field[k] && !(found[i] & 1 << k)) error("Mapped weights do not match the cfg");
+        }
+#ifdef GPU
+        if(gpu_index >= 0){
+            if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL) push_convolutional_layer(*l);
+            if(l->type == CONNECTED) push_connected_layer(*l);
+            if(l->type == BATCHNORM) push_batchnorm_layer(*l);
+            if(l->type == LOCAL) push_local_layer(*l);
+        }
+#endif
+    }
+    free(found);
+    free(unfolded);
+    free(dst);
+
+    if(mapped){
+        if(net->weights_map) error("Network already has mapped weights");
+        mapped_weights *w = calloc(1, sizeof(mapped_weights));
+        w->map = map;
+        w->size = size;
+        w->unused = unused;
+        w->n = mapped;
+        net->weights_map = w;
+    } else {
+        munmap(map, size);
+        free(unused);
+    }
+    fprintf(stderr, "%d of %d tensors mapped\n", mapped, (int)h.tensors);
+}
+
+int in_weights_map(network *net, void *p)
+{
+    mapped_weights *w = net->weights_map;
+    return w && p >= (void *)w->map && p < (void *)(w->map + w->size);
+}
+
+/* For free_network(): the layers' pointers into the mapping are not theirs to free. */
+void unmap_network_weights(network *net)
+{
+    int i, k;
+    float **field[MAPPED_KINDS];
+    uint64_t count[MAPPED_KINDS];
+    mapped_weights *w = net->weights_map;
+    if(!w) return;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN) continue;
+        layer_tensors(l, field, count);
+        /* Folded layers list no batchnorm tensors, but still own theirs. */
+        for(k = 0; k < MAPPED_KINDS; ++k){
+            if(field[k] && in_weights_map(net, *field[k])) *field[k] = 0;
+        }
+    }
+    for(i = 0; i < w->n; ++i) free(w->unused[i]);
+    munmap(w->map, w->size);
+    free(w->unused);
+    free(w);
+    net->weights_map = 0;
+}
@@ -0,0 +1,12 @@
+#ifndef WEIGHTS_MAP_H
+#define WEIGHTS_MAP_H
+#include "darknet.h"
+#include <stdio.h>
+
+int is_mapped_weights(char *filename);
+void load_mapped_weights(network *net, char *filename, int start, int cutoff);
+void unmap_network_weights(network *net);
+int in_weights_map(network *net, void *p);
+void seek_snapshot_cfg(FILE *fp);
+
+#endif
@@ -0,0 +1,254 @@
+#include "winograd.h"
+#include "gemm.h"
+#include "parallel.h"
+#include "utils.h"
+#include "blocked.h"
+#include "layer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Winograd F(4x4, 3x3) convolution (Lavin & Gray, "Fast Algorithms for
+ * Convolutional Neural Networks").
+ *
+ * The output is cut into 4x4 tiles, each computed from a 6x6 input tile:
+ *
+ *     Y = A^T [ (G g G^T) . (B^T d B) ] A
+ *
+ * Per tile that is 36 multiplies per input/output channel pair instead of
+ * 144.  The 36 element-wise products are batched over channels and tiles
+ * into 36 independent GEMMs, U[xi] (n x c) * V[xi] (c x tiles), so the
+ * heavy lifting still goes through the packed SGEMM.  U = G g G^T depends
+ * only on the weights; l.winograd_weights keeps the 36 U matrices already
+ * packed for gemm_prepacked, so inference never touches them again.
+ * They sit beside the original weights at four times their size, so a net
+ * asks for them with winograd=1 in [net], or a layer in its own section.
+ */
+
+/* Bytes of V + M scratch per block of tiles; bounds memory for big layers. */
+#define WINOGRAD_SCRATCH (16 << 20)
+
+/*
+ * With few input channels the tile transforms cost more than the GEMM
+ * saves (the first layers of a backbone), so those stay on implicit GEMM.
+ */
+#define WINOGRAD_MIN_CHANNELS 64
+
+int winograd_eligible(layer l)
+{
+    return l.type == CONVOLUTIONAL && l.size == 3 && l.stride == 1 && l.groups == 1
+        && !l.binary && !l.xnor && l.c >= WINOGRAD_MIN_CHANNELS;
+}
+
+static void weight_transform(const float *g, float *u)
+{
+    float t[6][3];
+    int i;
+    for(i = 0; i < 3; ++i){
+        float g0 = g[0*3 + i], g1 = g[1*3 + i], g2 = g[2*3 + i];
+        t[0][i] = g0/4;
+        t[1][i] = -(g0 + g1 + g2)/6;
+        t[2][i] = -(g0 - g1 + g2)/6;
+        t[3][i] = g0/24 + g1/12 + g2/6;
+        t[4][i] = g0/24 - g1/12 + g2/6;
+        t[5][i] = g2;
+    }
+    for(i = 0; i < 6; ++i){
+        float g0 = t[i][0], g1 = t[i][1], g2 = t[i][2];
+        u[i*6 + 0] = g0/4;
+        u[i*6 + 1] = -(g0 + g1 + g2)/6;
+        u[i*6 + 2] = -(g0 - g1 + g2)/6;
+        u[i*6 + 3] = g0/24 + g1/12 + g2/6;
+        u[i*6 + 4] = g0/24 - g1/12 + g2/6;
+        u[i*6 + 5] = g2;
+    }
+}
+
+void winograd_transform_weights(layer l)
+{
+    int i, j, xi;
+    float u[36];
+    if(!l.winograd_weights) return;
+    size_t packed = gemm_packed_size(l.n, l.c);
+    float *t = calloc(36*l.n*l.c, sizeof(float));
+    for(i = 0; i < l.n; ++i){
+        for(j = 0; j < l.c; ++j){
+            weight_transform(l.weights + (i*l.c + j)*9, u);
+            for(xi = 0; xi < 36; ++xi){
+                t[(xi*l.n + i)*l.c + j] = u[xi];
+            }
+        }
+    }
+    for(xi = 0; xi < 36; ++xi){
+        gemm_pack(0, l.n, l.c, t + xi*l.n*l.c, l.c, l.winograd_weights + xi*packed);
+    }
+    free(t);
+}
+
+void make_winograd_weights(layer *l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    if(!winograd_eligible(*l)) return;
+    l->winograd_weights = calloc(36*gemm_packed_size(l->n, l->c), sizeof(float));
+    /* Without random weights there is nothing to transform until they load. */
+    if(init_random_weights()) winograd_transform_weights(*l);
+}
+
+typedef struct {
+    layer l;
+    float *input;
+    float *output;
+    float *v;
+    float *m;
+    int tiles_w;
+    int first, count, ld;
+    int blocked;
+    const gemm_epilogue *ep;
+} winograd_args;
+
+/*
+ * Plane of channel c and the distance between neighbouring pixels in it,
+ * for plain NCHW or channel-blocked (BLOCK_C interleaved channels) data.
+ */
+static float *winograd_plane(float *x, int c, int spatial, int blocked, int *step)
+{
+    if(!blocked){
+        *step = 1;
+        return x + c*spatial;
+    }
+    *step = BLOCK_C;
+    return x + (c/BLOCK_C)*spatial*BLOCK_C + c%BLOCK_C;
+}
+
+/* V[xi][c][t] = (B^T d B)[xi] for every tile t of the block. */
+static void input_transform(int start, int end, void *ptr)
+{
+    winograd_args a = *(winograd_args *)ptr;
+    int h = a.l.h, w = a.l.w, pad = a.l.pad;
+    int c, t, i, j, step;
+    for(c = start; c < end; ++c){
+        float *im = winograd_plane(a.input, c, h*w, a.blocked, &step);
+        for(t = 0; t < a.count; ++t){
+            int tile = a.first + t;
+            int y0 = (tile / a.tiles_w)*4 - pad;
+            int x0 = (tile % a.tiles_w)*4 - pad;
+            float d[6][6], r[6][6];
+            for(i = 0; i < 6; ++i){
+                int y = y0 + i;
+                for(j = 0; j < 6; ++j){
+                    int x = x0 + j;
+                    d[i][j] = (y >= 0 && y < h && x >= 0 && x < w) ? im[(y*w + x)*step] : 0;
+                }
+            }
+            for(j = 0; j < 6; ++j){
+                float d0 = d[0][j], d1 = d[1][j], d2 = d[2][j], d3 = d[3][j], d4 = d[4][j], d5 = d[5][j];
+                r[0][j] = 4*d0 - 5*d2 + d4;
+                r[1][j] = -4*d1 - 4*d2 + d3 + d4;
+                r[2][j] = 4*d1 - 4*d2 - d3 + d4;
+                r[3][j] = -2*d1 - d2 + 2*d3 + d4;
+                r[4][j] = 2*d1 - d2 - 2*d3 + d4;
+                r[5][j] = 4*d1 - 5*d3 + d5;
+            }
+            float *v = a.v + c*a.ld + t;
+            int stride = a.l.c*a.ld;
+            for(i = 0; i < 6; ++i){
+                float d0 = r[i][0], d1 = r[i][1], d2 = r[i][2], d3 = r[i][3], d4 = r[i][4], d5 = r[i][5];
+                v[(i*6 + 0)*stride] = 4*d0 - 5*d2 + d4;
+                v[(i*6 + 1)*stride] = -4*d1 - 4*d2 + d3 + d4;
+                v[(i*6 + 2)*stride] = 4*d1 - 4*d2 - d3 + d4;
+                v[(i*6 + 3)*stride] = -2*d1 - d2 + 2*d3 + d4;
+                v[(i*6 + 4)*stride] = 2*d1 - d2 - 2*d3 + d4;
+                v[(i*6 + 5)*stride] = 4*d1 - 5*d3 + d5;
+            }
+        }
+    }
+}
+
+/* Y = A^T M A for every tile of the block, clipped to the output. */
+static void output_transform(int start, int end, void *ptr)
+{
+    winograd_args a = *(winograd_args *)ptr;
+    int out_h = a.l.out_h, out_w = a.l.out_w;
+    int f, t, i, j, step;
+    for(f = start; f < end; ++f){
+        float *out = winograd_plane(a.output, f, out_h*out_w, a.blocked, &step);
+        for(t = 0; t < a.count; ++t){
+            int tile = a.first + t;
+            int y0 = (tile / a.tiles_w)*4;
+            int x0 = (tile % a.tiles_w)*4;
+            float *m = a.m + f*a.ld + t;
+            int stride = a.l.n*a.ld;
+            float r[4][6];
+            for(j = 0; j < 6; ++j){
+                float m0 = m[(0*6 + j)*stride], m1 = m[(1*6 + j)*stride], m2 = m[(2*6 + j)*stride];
+                float m3 = m[(3*6 + j)*stride], m4 = m[(4*6 + j)*stride], m5 = m[(5*6 + j)*stride];
+                r[0][j] = m0 + m1 + m2 + m3 + m4;
+                r[1][j] = m1 - m2 + 2*m3 - 2*m4;
+                r[2][j] = m1 + m2 + 4*m3 + 4*m4;
+                r[3][j] = m1 - m2 + 8*m3 - 8*m4 + m5;
+            }
+            for(i = 0; i < 4 && y0 + i < out_h; ++i){
+                float m0 = r[i][0], m1 = r[i][1], m2 = r[i][2], m3 = r[i][3], m4 = r[i][4], m5 = r[i][5];
+                float y[4];
+                y[0] = m0 + m1 + m2 + m3 + m4;
+                y[1] = m1 - m2 + 2*m3 - 2*m4;
+                y[2] = m1 + m2 + 4*m3 + 4*m4;
+                y[3] = m1 - m2 + 8*m3 - 8*m4 + m5;
+                for(j = 0; j < 4 && x0 + j < out_w; ++j){
+                    out[((y0 + i)*out_w + x0 + j)*step] = y[j];
+                }
+                if(a.ep){
+                    gemm_epilogue_apply(a.ep, f, (size_t)f*out_h*out_w + (y0 + i)*out_w + x0, a.output, j);
+                }
+            }
+        }
+    }
+}
+
+void forward_winograd_convolution(layer l, float *input, float *output, int blocked, const gemm_epilogue *ep)
+{
+    static __thread float *scratch = 0;
+    static __thread size_t scratch_size = 0;
+    int tiles_h = (l.out_h + 3)/4;
+    int tiles_w = (l.out_w + 3)/4;
+    int tiles = tiles_h*tiles_w;
+    int block = WINOGRAD_SCRATCH/(36*(l.c + l.n)*sizeof(float));
+    block = (block < 64) ? 64 : block/32*32;
+    if(block > tiles) block = tiles;
+
+    size_t size = (size_t)36*(l.c + l.n)*block;
+    if(size > scratch_size){
+        free(scratch);
+        scratch = calloc(size, sizeof(float));
+        if(!scratch) malloc_error();
+        scratch_size = size;
+    }
+
+    winograd_args args = {0};
+    args.l = l;
+    args.input = input;
+    args.output = output;
+    args.v = scratch;
+    args.m = scratch + (size_t)36*l.c*block;
+    args.tiles_w = tiles_w;
+    args.ld = block;
+    args.blocked = blocked;
+    args.ep = blocked ? 0 : ep;
+
+    int xi;
+    size_t packed = gemm_packed_size(l.n, l.c);
+    for(args.first = 0; args.first < tiles; args.first += block){
+        args.count = (tiles - args.first < block) ? tiles - args.first : block;
+        parallel_for(l.c, 1, input_transform, &args);
+        for(xi = 0; xi < 36; ++xi){
+            gemm_prepacked(l.n, args.count, l.c,
+                    l.winograd_weights + xi*packed,
+                    args.v + xi*l.c*block, block,
+                    0,
+                    args.m + xi*l.n*block, block, 0);
+        }
+        parallel_for(l.n, 1, output_transform, &args);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+#include "darknet.h"
+#include "gemm.h"
+
+int winograd_eligible(layer l);
+void make_winograd_weights(layer *l);
+void winograd_transform_weights(layer l);
+/* ep, if any, is applied to NCHW output rows as they are written; blocked output is left raw. */
+void forward_winograd_convolution(layer l, float *input, float *output, int blocked, const gemm_epilogue *ep);
+
+#endif